@@ -83,6 +83,16 @@ DEFINE_int32(downsample, 0, "How many times to downsample image.");
 DEFINE_double(depth_sigma, 0.0, "Gaussian noise added to perturb depth map.");
 DEFINE_double(imu_accel_sigma, 0.0, "Gaussian noise added to perturb accel data.");
 DEFINE_double(imu_gyro_sigma, 0.0, "Gaussian noise added to perturb gyro data.");
+DEFINE_bool(imu_seeding, true, "Seed visual odometry with IMU measurements instead of using pyramid");
+DEFINE_bool(use_imu, true, "Use IMU measurements within a BA window to aid localization");
+DEFINE_bool(async_ba, false, "Run windowed BA on its own thread instead of after every frame.");
+DEFINE_int32(keyframe_ram_mb, 512, "RAM for frame images kept for loop closure; older ones go to disk.");
+DEFINE_string(keyframe_file, "", "File for frame images over the RAM cap. Empty uses a temporary file.");
+DEFINE_bool(discard_saturated, true, "Discard under/over saturated pixels during pose estimation.");
+DEFINE_double(min_depth, 0.10, "Minimum depth to consider for pose estimation.");
+DEFINE_double(max_depth, 20.0, "Maxmimum depth to consider for pose estimation.");
+DEFINE_double(norm_param, 10.0, "Tukey norm parameter for robust norm.");
+DEFINE_bool(semi_dense, false, "Use semi-dense approach for VO rather than full dense.");
 /////////////////////////////////////////////////////////////////////////////
 ///
 
@@ -181,6 +191,22 @@ int main(int argc, char** argv)
   std::cout << "Starting VIDTrack ..." << std::endl;
   vid::Tracker vid_tracker(15, 4);
 
+  // Flags only provide this app's defaults; the tracker keeps its own copy.
+  vid::Tracker::Options tracker_options;
+  tracker_options.imu_seeding                    = FLAGS_imu_seeding;
+  tracker_options.use_imu                        = FLAGS_use_imu;
+  tracker_options.async_ba                       = FLAGS_async_ba;
+  // Half raw, half compressed.
+  tracker_options.keyframes.max_hot_bytes        = size_t(FLAGS_keyframe_ram_mb) << 19;
+  tracker_options.keyframes.max_warm_bytes       = size_t(FLAGS_keyframe_ram_mb) << 19;
+  tracker_options.keyframes.cold_path            = FLAGS_keyframe_file;
+  tracker_options.dtrack.do_semi_dense_tracking  = FLAGS_semi_dense;
+  tracker_options.dtrack.discard_saturated       = FLAGS_discard_saturated;
+  tracker_options.dtrack.min_depth               = FLAGS_min_depth;
+  tracker_options.dtrack.max_depth               = FLAGS_max_depth;
+  tracker_options.dtrack.norm_param              = FLAGS_norm_param;
+  vid_tracker.SetOptions(tracker_options);
+
   bool use_map = false;
   if (!FLAGS_map.empty()) {
     // Import map.
@@ -851,10 +877,13 @@ int main(int argc, char** argv)
         if (have_gt) {
           path_gt_vec.push_back(gt_pose);
         }
-        path_ba_win_vec.clear();
-        const std::deque<ba::PoseT<double> > ba_poses = vid_tracker.GetAdjustedPoses();
-        for (size_t ii = 0; ii < ba_poses.size(); ++ii) {
-          path_ba_win_vec.push_back(ba_poses[ii].t_wp);
+        // The BA window belongs to the back-end thread if it is running.
+        if (!FLAGS_async_ba) {
+          path_ba_win_vec.clear();
+          const vid::Tracker::PoseWindow& ba_poses = vid_tracker.GetAdjustedPoses();
+          for (size_t ii = 0; ii < ba_poses.size(); ++ii) {
+            path_ba_win_vec.push_back(ba_poses[ii].t_wp);
+          }
         }
 
         // Update analytics.
@@ -902,21 +931,20 @@ int main(int argc, char** argv)
 
 #if 1
     // Update path using NIMA's code.
-    {
+    if (!FLAGS_async_ba) {
       const std::vector<uint32_t>& imu_residual_ids = vid_tracker.GetImuResidualIds();
 
       view_3d.ActivateAndScissor(stacks3d);
       const ba::ImuCalibrationT<double>& imu = vid_tracker.GetImuCalibration();
       std::vector<ba::ImuPoseT<double>> imu_poses;
-      const ba::InterpolationBufferT<ba::ImuMeasurementT<double>, double>& imu_buffer
-          = vid_tracker.GetImuBuffer();
+      const vid::ImuBuffer& imu_buffer = vid_tracker.GetImuBuffer();
+      std::vector<ba::ImuMeasurementT<double> > meas;
 
       for (uint32_t id : imu_residual_ids) {
         const auto& res = vid_tracker.GetImuResidual(id);
         const ba::PoseT<double>& pose = vid_tracker.GetPose(res.pose1_id);
-        std::vector<ba::ImuMeasurementT<double> > meas =
-            imu_buffer.GetRange(res.measurements.front().time,
-                                res.measurements.back().time);
+        imu_buffer.GetRange(res.measurements.front().time,
+                            res.measurements.back().time, meas);
         res.IntegrateResidual(pose, meas, pose.b.head<3>(), pose.b.tail<3>(),
                               imu.g_vec, imu_poses);
         if (pose.is_active) {
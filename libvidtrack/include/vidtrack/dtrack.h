@@ -19,14 +19,17 @@
 #pragma once
 
 #include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <memory>
 #include <vector>
 
 #include <vidtrack/config.h>
-
-#undef VIDTRACK_USE_TBB
+#include <vidtrack/image_pool.h>
+#include <vidtrack/thread_pool.h>
 
 #ifdef VIDTRACK_USE_TBB
-#include <tbb/tbb.h>
+#include <tbb/task_arena.h>
 #endif
 
 
@@ -61,9 +64,129 @@ typedef Matrix<double, 6, 1> Vector6d;
 class DTrack
 {
 public:
+  /// Implementation of the per-pixel ESM loop in BuildProblem.
+  enum Kernel {
+    kKernelScalar,    // Double precision reference implementation.
+    kKernelFloat,     // Single precision scalar math, double accumulation.
+    kKernelAuto,      // Widest SIMD kernel supported by the CPU.
+    kKernelSSE4,      // Single precision, 4 points per step.
+    kKernelAVX2,      // Single precision, 8 points per step.
+    kKernelAVX512     // Single precision, 16 points per step.
+  };
+
   struct Options {
     bool optimize_wrt_depth_camera = false;
+    // Only track pixels on Canny edges of the keyframe.
     bool do_semi_dense_tracking = false;
+    // Discard under/over saturated live pixels.
+    bool discard_saturated = true;
+    // Depth range of reference pixels used for pose estimation (meters).
+    double min_depth = 0.10;
+    double max_depth = 20.0;
+    // Tukey norm parameter of the finest level, scaled by level + 1.
+    double norm_param = 10.0;
+    // Inverse compositional solver. Jacobians and Hessian depend only on the
+    // keyframe and are built once in SetKeyframe, so each iteration only
+    // computes residuals, robust weights and the RHS. Points that leave the
+    // image or saturate are removed from the Hessian. Otherwise ESM is used.
+    bool use_inverse_compositional = false;
+    // SIMD kernels fall back to the widest one the CPU supports, or to
+    // kKernelFloat without SIMD.
+    Kernel kernel = kKernelScalar;
+    // Threads used by BuildProblem, including the caller. 0 uses all cores.
+    // Results do not depend on this value.
+    unsigned int num_threads = 1;
+    // Max reference points per pyramid level. Points are spread over a grid
+    // and the strongest gradients of each cell are kept, with budget unused
+    // by sparse cells going to the strongest of the rest. 0 uses all valid
+    // pixels, so cost scales with resolution.
+    unsigned int pixel_budget = 0;
+    // Estimate live = gain * reference + bias jointly with the pose, instead
+    // of rewriting the live image to match the keyframe's mean and variance.
+    bool estimate_brightness = false;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Pose independent data of valid reference pixels for one pyramid level.
+  /// Stored as a compacted structure-of-arrays and built once per keyframe.
+  struct KeyframePoints {
+    std::vector<double>   x, y, z;          // 3d point in reference grey camera.
+    std::vector<double>   xd, yd, zd;       // 3d point in reference depth camera.
+    std::vector<double>   Ir;               // Reference intensity.
+    std::vector<double>   dIr_x, dIr_y;     // Reference image gradient.
+    std::vector<double>   dPd_x, dPd_y, dPd_z; // Grey point derivative wrt depth.
+    std::vector<double>   Jdr;              // Depth derivative on reference image.
+
+    // Inverse compositional only.
+    std::vector<double>   Jic;              // Pose Jacobians (6 per point).
+    Eigen::Matrix6d       hessian;          // Sum of Jic' * Jic / sigma^2.
+    Eigen::Matrix<double, 6, 2> hessian_pb; // Pose-brightness block, Jb = [-Ir, -1].
+    Eigen::Matrix2d       hessian_bb;       // Brightness block.
+
+    // Single precision copy for SIMD kernels. One padded block per field.
+    std::vector<float>    simd_data;
+    size_t                simd_stride = 0;
+
+    void Clear();
+    void Reserve(size_t num_points);
+    // Keeps the given points (ascending indices). Before Jic/simd are built.
+    void Keep(const std::vector<size_t>& indices);
+    size_t Size() const { return x.size(); }
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Iteration control of one pyramid level.
+  struct LevelPolicy {
+    unsigned int  max_iterations = 5;     // 0 skips the level.
+    bool          full_estimate = true;   // Solve for rotation only if false.
+    double        min_update = 1e-5;      // Converged once |X| is below this.
+    double        min_error_decrease = 0; // Converged once RMSE improves by less than this fraction.
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Iteration control of Estimate.
+  struct EstimatePolicy {
+    std::vector<LevelPolicy>  levels;     // One per pyramid level, finest first.
+    // No iteration is started if it is predicted to end after the deadline.
+    // The cost of an iteration is predicted from the last one, scaled by the
+    // number of reference points when moving to a finer level.
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+  };
+
+  /// Why a pyramid level stopped iterating.
+  enum StopReason {
+    kStopNotRun,            // Level was skipped, or time ran out before it.
+    kStopMaxIterations,
+    kStopConverged,         // Update or error decrease below policy.
+    kStopErrorIncreased,    // Last step was rejected.
+    kStopDeadline
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// What Estimate actually ran, and where its time went. Times are in
+  /// seconds. Reusing the same report across frames does not allocate.
+  struct EstimateReport {
+    struct Level {
+      unsigned int  iterations = 0;       // Problems built, rejected step included.
+      StopReason    stop_reason = kStopNotRun;
+      unsigned int  num_obs = 0;          // Observations of final_error.
+      double        initial_error = FLT_MAX; // RMSE at the pose the level started from.
+      double        final_error = FLT_MAX; // RMSE of the last accepted step.
+      std::vector<double> step_norms;     // |X| of each iteration, rejected step included.
+      unsigned int  rank_deficient = 0;   // Iterations with a rank deficient system.
+      double        gradient_time = 0;    // Packing the live level, if not done yet.
+      double        build_problem_time = 0; // BuildProblem, all iterations.
+      double        solve_time = 0;       // Solve and update, all iterations.
+    };
+    std::vector<Level>  levels;           // One per pyramid level, finest first.
+    bool                deadline_reached = false;
+    double              gain = 1;         // Estimated brightness, if enabled.
+    double              bias = 0;
+    double              pyramid_time = 0; // Live pyramid and brightness initialization.
+    double              total_time = 0;   // Whole Estimate call.
   };
 
   ///////////////////////////////////////////////////////////////////////////
@@ -89,15 +212,72 @@ public:
       );
 
   ///////////////////////////////////////////////////////////////////////////
+  /// Makes the frame passed to the last Estimate the new keyframe. Its grey
+  /// pyramid and any gradients computed for it are reused, so only the
+  /// depth pyramid is built. Note the promoted image is the brightness
+  /// corrected one, i.e. photometrically matched to the previous keyframe,
+  /// unless brightness is estimated.
+  void PromoteLiveToKeyframe(
+      const cv::Mat&    live_depth  // Input: Depth of live image (float format, meters).
+      );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Same as the policy overload with DefaultPolicy(use_pyramid).
   double Estimate(
       bool                      use_pyramid,  // Input: Flag to enable full pyramid.
       const cv::Mat&            live_grey,    // Input: Live image (unsigned char format).
       Sophus::SE3d&             Trl,          // Input/Output: Transform between grey cameras (vision frame/input is hint).
       Eigen::Matrix6d&          covariance,   // Output: Covariance.
-      unsigned int&             num_obs);
+      unsigned int&             num_obs,
+      EstimateReport*           report = nullptr // Output: Optional, what ran.
+    );
 
   ///////////////////////////////////////////////////////////////////////////
-  void BuildProblem(const Sophus::SE3d& Trl,
+  /// Coarse to fine estimate. If the deadline is reached Trl is the best
+  /// pose found so far. Returns the RMSE of the finest level that ran, or
+  /// FLT_MAX if none did.
+  double Estimate(
+      const EstimatePolicy&     policy,       // Input: Per-level iterations and deadline.
+      const cv::Mat&            live_grey,    // Input: Live image (unsigned char format).
+      Sophus::SE3d&             Trl,          // Input/Output: Transform between grey cameras (vision frame/input is hint).
+      Eigen::Matrix6d&          covariance,   // Output: Covariance.
+      unsigned int&             num_obs,      // Output: Observations of the returned error.
+      EstimateReport*           report = nullptr // Output: Optional, what ran.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Refines K hypotheses of the live frame against the keyframe, e.g. to
+  /// verify loop closure or relocalization candidates. Hypotheses are K
+  /// poses of one live image, or one pose per live image of the same size.
+  /// Each iteration builds the problems of all hypotheses still running in
+  /// a single pass over the cached reference points. Per hypothesis, levels
+  /// and iterations run as in Estimate and the same error is returned. Uses
+  /// ESM in double precision whatever the options, and live images are
+  /// always brightness corrected (estimate_brightness is ignored).
+  /// If max_survivors is set, only that many hypotheses with the lowest
+  /// error go on to the next level. Pruned ones return FLT_MAX, so when
+  /// only the best is wanted most of the work happens on coarse levels.
+  void EstimateHypotheses(
+      const EstimatePolicy&         policy,       // Input: Per-level iterations and deadline.
+      const std::vector<cv::Mat>&   live_greys,   // Input: Live images (unsigned char format), one or one per hypothesis.
+      std::vector<Sophus::SE3d>&    Trls,         // Input/Output: Transform of each hypothesis (input is hint).
+      std::vector<double>&          errors,       // Output: RMSE of each hypothesis, or FLT_MAX.
+      std::vector<unsigned int>&    num_obs,      // Output: Observations of each error.
+      std::vector<Eigen::Matrix6d,
+          Eigen::aligned_allocator<Eigen::Matrix6d> >& covariances, // Output: Covariance of each hypothesis.
+      unsigned int                  max_survivors = 0 // Input: Hypotheses kept per level, 0 keeps all.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Full pyramid, or only the finest level if use_pyramid is false. The
+  /// coarsest level solves for rotation only. No deadline.
+  EstimatePolicy DefaultPolicy(bool use_pyramid) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Accumulates the normal equations over all cached reference points.
+  /// Points are split in fixed size tiles that are reduced in order, so the
+  /// result is the same for any number of threads.
+  void BuildProblem(const Sophus::SE3d& Tlr,
                     Eigen::Matrix6d&    LHS,
                     Eigen::Vector6d&    RHS,
                     double&             squared_error,
@@ -108,9 +288,205 @@ public:
   void BuildPyramid(const cv::Mat &live_grey);
 
   ///////////////////////////////////////////////////////////////////////////
+  /// Packs the live level if BuildPyramid did not already do so.
   void ComputeGradient(uint pyramid_lvl);
 
+  ///////////////////////////////////////////////////////////////////////////
+  /// Back-projects and samples all valid reference pixels of a pyramid level
+  /// so BuildProblem only has to warp them into the live image.
+  void PrepareKeyframe(uint pyramid_lvl);
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Number of cached reference points of a pyramid level, i.e. the most
+  /// observations Estimate can report for it.
+  size_t NumKeyframePoints(uint pyramid_lvl) const
+  {
+    return ref_points_[pyramid_lvl].Size();
+  }
+
 private:
+  ///////////////////////////////////////////////////////////////////////////
+  /// Partial normal equations of one tile of reference points. Brightness
+  /// blocks are only filled if Options::estimate_brightness is set.
+  struct Accumulator {
+    Eigen::Matrix6d   LHS;
+    Eigen::Vector6d   RHS;
+    Eigen::Matrix<double, 6, 2> LHS_pb;   // Pose-brightness block.
+    Eigen::Matrix2d   LHS_bb;             // Brightness block.
+    Eigen::Vector2d   RHS_b;
+    double            squared_error;
+    double            num_obs;
+
+    void SetZero();
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Canny edge of the reference image, with its depth.
+  struct EdgePixel {
+    int     u;
+    int     v;
+    float   depth;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Scratch of budgeted point selection, kept to reuse its capacity.
+  struct SelectionBuffers {
+    std::vector<int>      pixels;     // Depth pixel of each point.
+    std::vector<int>      cell_of;
+    std::vector<size_t>   cell_start;
+    std::vector<size_t>   bucket;
+    std::vector<size_t>   fill;
+    std::vector<char>     keep;
+    std::vector<size_t>   indices;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Live pyramids of one EstimateHypotheses image.
+  struct HypothesisImage {
+    std::vector<cv::Mat>  grey_pyramid;
+    std::vector<cv::Mat>  packed_pyramid; // CV_32FC4 {I, gx, gy, 0}.
+    std::vector<bool>     packed_valid;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Hypotheses of one EstimateHypotheses iteration. Warps are stored
+  /// coefficient-major, i.e. coefficient c of hypothesis k is Tlr[c*stride+k],
+  /// so a block of hypotheses warps a point with vector instructions.
+  struct HypothesisBatch {
+    size_t                size = 0;
+    size_t                stride = 0;     // size rounded up to kHypothesisBlock.
+    std::vector<double>   Tlr;            // Row-major 3x4 transforms.
+    std::vector<Eigen::Matrix3x4d,
+        Eigen::aligned_allocator<Eigen::Matrix3x4d> > KlgTlr;
+    std::vector<const float*>  live_packed;
+    int                   live_width = 0;
+    int                   live_height = 0;
+  };
+
+  /// Hypotheses that are warped together by _BuildHypothesesESM.
+  static const size_t kHypothesisBlock = 8;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// BuildProblem including the brightness blocks.
+  void _BuildProblem(
+      const Sophus::SE3d&       Tlr,          //< Input: Current estimate.
+      uint                      pyramid_lvl,  //< Input: Pyramid level.
+      Accumulator&              problem       //< Output: Full problem.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Initial gain and bias from the mean and deviation of the coarsest level.
+  void _InitBrightness();
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// ESM problem over reference points [begin, end). Per-point math is done
+  /// in Scalar and summed in double. float reads the single precision copy
+  /// of the points. kAligned drops the depth-grey transform (see aligned_).
+  template<typename Scalar, bool kAligned>
+  void _BuildProblemESM(
+      const Sophus::SE3d&       Tlr,          //< Input: Current estimate.
+      uint                      pyramid_lvl,  //< Input: Pyramid level.
+      size_t                    begin,        //< Input: First point.
+      size_t                    end,          //< Input: One past last point.
+      Accumulator&              acc           //< Output: Partial problem.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// _BuildProblemESM<double> for every hypothesis of hypothesis_batch_.
+  /// Each reference point is loaded once and warped by blocks of
+  /// hypotheses. Brightness blocks are not filled.
+  template<bool kAligned>
+  void _BuildHypothesesESM(
+      uint                      pyramid_lvl,  //< Input: Pyramid level.
+      size_t                    begin,        //< Input: First point.
+      size_t                    end,          //< Input: One past last point.
+      Accumulator*              accs          //< Output: Partial problem of each hypothesis.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Fills hypothesis_problems_ for hypothesis_batch_, reducing the tiles in
+  /// order like _BuildProblem.
+  void _BuildHypothesisProblems(
+      uint                      pyramid_lvl   //< Input: Pyramid level.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Gauss-Newton step of the pose, or of the rotation only.
+  Eigen::Vector6d _SolvePose(
+      const Eigen::Matrix6d&    LHS,          //< Input: Normal equations.
+      const Eigen::Vector6d&    RHS,          //< Input: Normal equations.
+      bool                      full_estimate, //< Input: Solve for translation too.
+      int                       pyramid_lvl,  //< Input: For logging.
+      unsigned int              iteration,    //< Input: For logging.
+      bool&                     rank_deficient //< Output: System was rank deficient.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// SIMD version of _BuildProblemESM. Uses the resolved kernel.
+  void _BuildProblemSIMD(
+      const Sophus::SE3d&       Tlr,          //< Input: Current estimate.
+      uint                      pyramid_lvl,  //< Input: Pyramid level.
+      size_t                    begin,        //< Input: First point.
+      size_t                    end,          //< Input: One past last point.
+      Accumulator&              acc           //< Output: Partial problem.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Inverse compositional problem over reference points [begin, end). LHS
+  /// only holds the (negative) Hessian of points rejected at this pose.
+  void _BuildProblemIC(
+      const Sophus::SE3d&       Tlr,          //< Input: Current estimate.
+      uint                      pyramid_lvl,  //< Input: Pyramid level.
+      size_t                    begin,        //< Input: First point.
+      size_t                    end,          //< Input: One past last point.
+      Accumulator&              acc           //< Output: Partial problem.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Runs task(ii) for ii in [0, num_tasks) on the configured threads.
+  template<typename Task>
+  void _ParallelFor(
+      size_t                                num_tasks,
+      const Task&                           task
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Halves level 0 of grey_pyramid into the remaining levels (2x2 blocks,
+  /// matching _ScaleCM). If pack is set, each level is also packed with its
+  /// gradients as it is built.
+  void _BuildGreyPyramid(
+      std::vector<cv::Mat>&     grey_pyramid,   //< Input/Output: Level 0 must be set.
+      std::vector<cv::Mat>&     packed_pyramid, //< Output: Packed levels.
+      std::vector<bool>&        packed_valid,   //< Output: Which levels were packed.
+      bool                      pack            //< Input: Pack levels.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Copies depth into level 0 of the reference depth pyramid and halves it
+  /// into the remaining levels without blending across depth edges.
+  void _BuildDepthPyramid(
+      const cv::Mat&            depth           //< Input: Depth (float format, meters).
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Reduces points to exactly options_.pixel_budget by keeping the highest
+  /// gradient magnitudes of each cell of a regular grid over the depth image,
+  /// then filling the budget sparse cells left unused with the strongest of
+  /// the remaining points.
+  void _SelectPoints(
+      const std::vector<int>&   pixels,       //< Input: Depth pixel of each point.
+      int                       image_width,  //< Input: Depth image width.
+      int                       image_height, //< Input: Depth image height.
+      KeyframePoints&           points        //< Input/Output: Points to reduce.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Runs the edge detector (if needed) and caches reference points of all
+  /// levels from the current reference pyramids.
+  void _InitKeyframe();
+
   ///////////////////////////////////////////////////////////////////////////
   Eigen::Matrix3d  _ScaleCM(
       const Eigen::Matrix3d&    K,      // Input: Camera model matrix K.
@@ -118,20 +494,21 @@ private:
     );
 
   ///////////////////////////////////////////////////////////////////////////
-  /// Calculates image gradients.
-  void _CalculateGradients(
+  /// Calculates image gradients. Output is interleaved as {I, gx, gy, 0} per
+  /// pixel so intensity and gradients are sampled with a single fetch.
+  void _CalculatePackedImage(
       const unsigned char*      image_ptr,    //< Input: Image pointer.
       int                       image_width,  //< Input: Image width.
       int                       image_height, //< Input: Image height.
-      float*                    gradX_ptr,    //< Output: Gradient in X.
-      float*                    gradY_ptr     //< Output: Gradient in Y.
+      float*                    packed_ptr    //< Output: Packed image (4 floats per pixel).
     );
 
   ///////////////////////////////////////////////////////////////////////////
   /// Tukey robust norm.
-  double _NormTukey(
-      double      r,    //< Input: Error.
-      double      c     //< Input: Norm parameter.
+  template<typename Scalar>
+  static Scalar _NormTukey(
+      Scalar      r,    //< Input: Error.
+      Scalar      c     //< Input: Norm parameter.
     );
 
   ///////////////////////////////////////////////////////////////////////////
@@ -152,22 +529,42 @@ private:
   cuDTrack*                       cu_dtrack_;
 #endif
 #ifdef VIDTRACK_USE_TBB
-  tbb::task_scheduler_init        tbb_scheduler_;
+  std::unique_ptr<tbb::task_arena>  tbb_arena_;
+#else
+  std::unique_ptr<vid::ThreadPool>  thread_pool_;
 #endif
-  cv::Mat                         gradient_x_live_;
-  cv::Mat                         gradient_y_live_;
-  cv::Mat                         gradient_x_ref_;
-  cv::Mat                         gradient_y_ref_;
-
   std::vector<cv::Mat>            live_grey_pyramid_;
+  std::vector<cv::Mat>            live_packed_pyramid_; // CV_32FC4 {I, gx, gy, 0}.
+  std::vector<bool>               live_packed_valid_;
+  bool                            has_live_frame_;
   std::vector<cv::Mat>            live_depth_pyramid_;
   std::vector<cv::Mat>            ref_grey_edges_;
+  std::vector<std::vector<EdgePixel> > ref_edge_pixels_; // Empty if unaligned.
   std::vector<cv::Mat>            ref_grey_pyramid_;
+  std::vector<cv::Mat>            ref_packed_pyramid_;  // CV_32FC4 {I, gx, gy, 0}.
+  std::vector<bool>               ref_packed_valid_;
   std::vector<cv::Mat>            ref_depth_pyramid_;
   std::vector<Eigen::Matrix3d>    live_grey_cam_model_;
   std::vector<Eigen::Matrix3d>    ref_grey_cam_model_;
   std::vector<Eigen::Matrix3d>    ref_depth_cam_model_;
+  std::vector<KeyframePoints,
+      Eigen::aligned_allocator<KeyframePoints> > ref_points_;
+  std::vector<Accumulator,
+      Eigen::aligned_allocator<Accumulator> >    tile_accumulators_;
+  std::vector<HypothesisImage>    hypothesis_images_;
+  HypothesisBatch                 hypothesis_batch_;
+  std::vector<Accumulator,
+      Eigen::aligned_allocator<Accumulator> >    hypothesis_accumulators_; // Per tile and hypothesis.
+  std::vector<Accumulator,
+      Eigen::aligned_allocator<Accumulator> >    hypothesis_problems_;
   Sophus::SE3d                    Tgd_;
+  bool                            aligned_;     // Tgd = I and Krg = Krd.
+  double                          gain_;        // Live = gain_ * ref + bias_.
+  double                          bias_;
+  vid::ImagePool                  image_pool_;  // Edge detection scratch.
+  SelectionBuffers                selection_;
+  EstimatePolicy                  default_policies_[2]; // By use_pyramid.
 
   Options options_;
+  Kernel  kernel_;
 };
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <deque>
+
+#include <opencv2/opencv.hpp>
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////
+/// Owns scratch images keyed by pyramid level and resolution. A buffer is
+/// allocated the first time its key is requested and handed back on every
+/// later request, so per-frame work stops allocating after the first frame.
+/// Buffers with the same key are shared: a key should only back one image
+/// at a time.
+class ImagePool {
+
+public:
+  ///////////////////////////////////////////////////////////////////////////
+  /// Returns the buffer for the given key. Contents are whatever its last
+  /// user left. The reference stays valid until Clear().
+  cv::Mat& Get(
+      unsigned int    level,    //< Input: Pyramid level.
+      int             rows,     //< Input: Image height.
+      int             cols,     //< Input: Image width.
+      int             type      //< Input: OpenCV image type.
+    );
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Number of buffers allocated so far. Constant once warmed up.
+  size_t NumAllocations() const
+  {
+    return buffers_.size();
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Releases all buffers.
+  void Clear()
+  {
+    buffers_.clear();
+  }
+
+private:
+  struct Buffer {
+    unsigned int    level;
+    int             rows;
+    int             cols;
+    int             type;
+    cv::Mat         image;
+  };
+
+  // Deque so references survive new keys being added.
+  std::deque<Buffer>              buffers_;
+};
+
+} /* vid namespace */
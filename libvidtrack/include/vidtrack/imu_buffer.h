@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+#endif
+#include <ba/Types.h>
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////
+/// Fixed capacity ring of IMU samples, written by one thread and queried by
+/// time from any number of others without locks. Once full, the oldest
+/// sample is overwritten; samples can also be released early with
+/// EvictBefore. Queries that race with an overwrite are retried, so they
+/// never return a torn sample.
+class ImuBuffer {
+
+public:
+  typedef ba::ImuMeasurementT<double>   ImuMeasurement;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Capacity is rounded up to a power of two.
+  explicit ImuBuffer(size_t capacity);
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  size_t Capacity() const
+  {
+    return mask_ + 1;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Producer only. Samples must come in increasing time; a sample not
+  /// newer than the last one is dropped and false is returned.
+  bool Push(const ImuMeasurement& measurement);
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Time of the newest sample, or -DBL_MAX if empty. GetRange called after
+  /// this returns holds every sample up to it.
+  double EndTime() const
+  {
+    return end_time_.load(std::memory_order_acquire);
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Time of the oldest sample held, or -DBL_MAX if empty.
+  double StartTime() const;
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Same contract as ba::InterpolationBufferT::GetRange: the samples
+  /// strictly between start_time and end_time, preceded and followed by
+  /// samples interpolated at both ends (clamped to the newest sample).
+  /// Empty if start_time is not after the oldest sample held.
+  void GetRange(
+      double                        start_time,   //< Input: Seconds.
+      double                        end_time,     //< Input: Seconds.
+      std::vector<ImuMeasurement>&  measurements  //< Output: Reuses capacity.
+    ) const;
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Releases samples that are not needed to interpolate at time or later.
+  void EvictBefore(double time);
+
+private:
+  // Sequence is 2*index+1 while sample index is written and 2*index+2 once
+  // it is complete. Fields are atomics so readers racing with the writer
+  // are well defined; they discard what they read if the sequence moved.
+  struct Slot {
+    std::atomic<uint64_t>   sequence;
+    std::atomic<double>     time;
+    std::atomic<double>     w[3];
+    std::atomic<double>     a[3];
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Returns false if the sample was overwritten.
+  bool _Read(
+      uint64_t                      index,        //< Input: Sample index.
+      ImuMeasurement&               measurement   //< Output: Sample.
+    ) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Samples currently held: [begin, end).
+  void _Bounds(
+      uint64_t&                     begin,        //< Output: Oldest held.
+      uint64_t&                     end           //< Output: One past newest.
+    ) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// First sample in [begin, end) later than time, or end. Returns false if
+  /// a sample was overwritten during the search.
+  bool _UpperBound(
+      uint64_t                      begin,        //< Input: First index.
+      uint64_t                      end,          //< Input: One past last index.
+      double                        time,         //< Input: Seconds.
+      uint64_t&                     index         //< Output: Sample index.
+    ) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// One attempt of GetRange. Returns false if a sample was overwritten.
+  bool _GetRange(
+      double                        start_time,   //< Input: Seconds.
+      double                        end_time,     //< Input: Seconds.
+      std::vector<ImuMeasurement>&  measurements  //< Output: Appended to.
+    ) const;
+
+private:
+  std::unique_ptr<Slot[]>                 slots_;
+  uint64_t                                mask_;
+  std::atomic<uint64_t>                   count_;     // Samples pushed.
+  std::atomic<uint64_t>                   first_;     // Oldest not evicted.
+  std::atomic<double>                     end_time_;
+};
+
+} /* vid namespace */
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <vidtrack/dtrack.h>
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////
+/// History of tracked frames for loop closure and map export. Poses and
+/// thumbnails always stay in RAM; the grey and depth images move through
+/// three tiers as newer frames come in, oldest first:
+///   hot:  as given.
+///   warm: grey as PNG, depth quantized to 16 bit millimeters and PNG.
+///   cold: the warm encoding, appended to a file read back through mmap.
+/// Depth at or below half a millimeter, NaN or infinite, is invalid and
+/// comes back as NaN. Depth beyond 65.535 m, the 16 bit limit, comes back
+/// as 65.535 m. Not thread safe.
+class KeyframeStore {
+
+public:
+  ///////////////////////////////////////////////////////////////////////////
+  /// RAM caps in bytes, images only. When a tier is over its cap its oldest
+  /// frames move down a tier. cold_path is created on first use; empty
+  /// uses an unlinked temporary file in TMPDIR, or /tmp if it is not set.
+  struct Options {
+    size_t        max_hot_bytes   = 256 << 20;
+    size_t        max_warm_bytes  = 256 << 20;
+    int           png_compression = 1;        // 0-9, speed over size.
+    std::string   cold_path;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// What is kept in RAM for every frame.
+  struct Frame {
+    Sophus::SE3d      T_wp;
+    Sophus::SE3d      T_ab;
+    double            time_a;
+    double            time_b;
+    Eigen::Matrix6d   covariance;
+    cv::Mat           thumbnail;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  KeyframeStore();
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  ~KeyframeStore();
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Owns the cold file.
+  KeyframeStore(const KeyframeStore&) = delete;
+  KeyframeStore& operator=(const KeyframeStore&) = delete;
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Applies new caps right away. A cold file already open is kept.
+  void SetOptions(const Options& options);
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  const Options& GetOptions() const
+  {
+    return options_;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  size_t Size() const
+  {
+    return frames_.size();
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  Frame& operator[](size_t id)
+  {
+    return frames_[id].frame;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  const Frame& operator[](size_t id) const
+  {
+    return frames_[id].frame;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Appends a frame. Images are copied.
+  void Add(
+      const Frame&      frame,      //< Input: Pose and thumbnail.
+      const cv::Mat&    grey,       //< Input: CV_8U image.
+      const cv::Mat&    depth       //< Input: CV_32F depth (meters).
+    );
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Images of a frame. Hot images are shared, not copied: do not write to
+  /// them. Others are decoded into new buffers.
+  void GetImages(
+      size_t            id,         //< Input: Frame index.
+      cv::Mat&          grey,       //< Output: CV_8U image.
+      cv::Mat&          depth       //< Output: CV_32F depth (meters).
+    ) const;
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Grey image only. Same sharing as GetImages.
+  cv::Mat GetGrey(size_t id) const;
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  size_t HotBytes() const
+  {
+    return hot_bytes_;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  size_t WarmBytes() const
+  {
+    return warm_bytes_;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  size_t ColdBytes() const
+  {
+    return cold_bytes_;
+  }
+
+private:
+  enum Tier { kHot, kWarm, kCold };
+
+  struct Entry {
+    Frame                       frame;
+    Tier                        tier;
+    cv::Mat                     grey;         // Hot.
+    cv::Mat                     depth;        // Hot.
+    std::vector<unsigned char>  grey_png;     // Warm.
+    std::vector<unsigned char>  depth_png;    // Warm.
+    size_t                      offset;       // Cold: grey, then depth.
+    size_t                      grey_size;    // Cold.
+    size_t                      depth_size;   // Cold.
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Moves the oldest frames down until each tier is within its cap.
+  void _Enforce();
+
+  ///////////////////////////////////////////////////////////////////////////
+  void _ToWarm(Entry& entry);
+
+  ///////////////////////////////////////////////////////////////////////////
+  void _ToCold(Entry& entry);
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Decodes a cold entry through a mapping of just its pages.
+  void _ReadCold(
+      const Entry&          entry,      //< Input: Cold entry.
+      cv::Mat&              grey,       //< Output: CV_8U image.
+      cv::Mat*              depth       //< Output: CV_32F depth, if not null.
+    ) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  static void _DecodeGrey(
+      const unsigned char*  data,       //< Input: PNG.
+      size_t                size,       //< Input: Bytes.
+      cv::Mat&              grey        //< Output: CV_8U image.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  static void _DecodeDepth(
+      const unsigned char*  data,       //< Input: 16 bit PNG (millimeters).
+      size_t                size,       //< Input: Bytes.
+      cv::Mat&              depth       //< Output: CV_32F depth (meters).
+    );
+
+private:
+  Options                                 options_;
+  std::deque<Entry, Eigen::aligned_allocator<Entry> > frames_;
+  size_t                                  hot_bytes_;
+  size_t                                  warm_bytes_;
+  size_t                                  cold_bytes_;
+  size_t                                  first_hot_;   // Older ones are not.
+  size_t                                  first_warm_;  // Older ones are cold.
+  cv::Mat                                 quantized_;   // Depth scratch.
+  int                                     cold_fd_;     // Appended only.
+};
+
+} /* vid namespace */
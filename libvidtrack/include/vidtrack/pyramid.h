@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <vidtrack/image_pool.h>
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+/// Same output as cv::pyrDown (5x5 Gaussian, reflect 101 border) for single
+/// channel CV_8U images, to the bit. CV_32F images match up to the order in
+/// which the taps are summed. Row buffers come from the pool and dst is only
+/// allocated if its size changed.
+void PyrDown(
+    const cv::Mat&    src,      //< Input: Image at level - 1.
+    cv::Mat&          dst,      //< Output: Image at level.
+    unsigned int      level,    //< Input: Level of dst, keys the row buffers.
+    ImagePool&        pool      //< Input/Output: Scratch buffers.
+  );
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Halves a CV_8U image by averaging 2x2 blocks (rounded). A trailing odd
+/// row or column is dropped. Pixel (u, v) of dst covers (2u, 2v) to
+/// (2u+1, 2v+1) of src, which is the convention of DTrack::_ScaleCM.
+void HalfSampleGrey(
+    const cv::Mat&    src,      //< Input: Image at level - 1.
+    cv::Mat&          dst       //< Output: Image at level.
+  );
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Halves a CV_32F depth image over 2x2 blocks without mixing surfaces.
+/// Samples that are NaN or not positive are invalid. The output is the mean
+/// of the valid samples within kMaxDepthSpread of the nearest one, or NaN
+/// if the whole block is invalid. Same block layout as HalfSampleGrey.
+void HalfSampleDepth(
+    const cv::Mat&    src,      //< Input: Depth at level - 1 (meters).
+    cv::Mat&          dst       //< Output: Depth at level (meters).
+  );
+
+/// Relative depth difference over which two samples of a 2x2 block are
+/// considered different surfaces.
+const float kMaxDepthSpread = 0.05f;
+
+} /* vid namespace */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <glog/logging.h>
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////
+/// Bounded lock-free queue for exactly one producer and one consumer thread.
+/// Slots are allocated once; pushing and popping only move elements in and
+/// out of them. The allocator is exposed for Eigen fixed size members.
+template<typename T, typename Allocator = std::allocator<T> >
+class SpscQueue {
+
+public:
+  ///////////////////////////////////////////////////////////////////////////
+  /// Capacity is rounded up to a power of two.
+  explicit SpscQueue(size_t capacity)
+    : head_(0), tail_(0)
+  {
+    CHECK_GT(capacity, 0u);
+    size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    }
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  size_t Capacity() const
+  {
+    return slots_.size();
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Producer only. Returns false, leaving value untouched, if full.
+  bool TryPush(T& value)
+  {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+      return false;
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Consumer only. Returns false if empty.
+  bool TryPop(T& value)
+  {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Consumer only. True if nothing is left to pop.
+  bool Empty() const
+  {
+    return head_.load(std::memory_order_relaxed)
+        == tail_.load(std::memory_order_acquire);
+  }
+
+private:
+  // Head and tail are padded apart so the two threads do not invalidate
+  // each other's cache line on every operation. Padding rather than alignas
+  // keeps the queue (and its owner) usable with plain new.
+  static const size_t kCacheLine = 64;
+
+  std::atomic<size_t>                 head_;
+  char                                head_pad_[kCacheLine];
+  std::atomic<size_t>                 tail_;
+  char                                tail_pad_[kCacheLine];
+  std::vector<T, Allocator>           slots_;
+  size_t                              mask_;
+};
+
+} /* vid namespace */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////
+/// Minimal fork-join pool. Workers are spawned once and sleep between jobs;
+/// the calling thread always takes part in the work.
+class ThreadPool {
+
+public:
+  ///////////////////////////////////////////////////////////////////////////
+  /// Total number of threads, including the caller. 0 uses all cores.
+  explicit ThreadPool(unsigned int num_threads);
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  ~ThreadPool();
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  unsigned int NumThreads() const
+  {
+    return workers_.size() + 1;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Runs task(ii) for every ii in [0, num_tasks) and blocks until all are
+  /// done. Tasks are handed out in any order, so each one should write to
+  /// its own output. Not re-entrant. task is called through a plain
+  /// function pointer, so no std::function (and no allocation) is involved.
+  template<typename Task>
+  void ParallelFor(
+      size_t                                  num_tasks,
+      const Task&                             task
+    )
+  {
+    _ParallelFor(num_tasks, &ThreadPool::_Invoke<Task>, &task);
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Number of threads 0 resolves to.
+  static unsigned int HardwareThreads();
+
+private:
+  typedef void (*TaskFunction)(const void*, size_t);
+
+  ///////////////////////////////////////////////////////////////////////////
+  template<typename Task>
+  static void _Invoke(const void* task, size_t ii)
+  {
+    (*static_cast<const Task*>(task))(ii);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void _ParallelFor(
+      size_t                                  num_tasks,
+      TaskFunction                            function,
+      const void*                             task
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  void _WorkerLoop();
+
+  ///////////////////////////////////////////////////////////////////////////
+  void _RunTasks();
+
+private:
+  std::vector<std::thread>                workers_;
+  std::mutex                              mutex_;
+  std::condition_variable                 start_cv_;
+  std::condition_variable                 done_cv_;
+
+  // Current job. Written under mutex_ before workers are woken up.
+  TaskFunction                            task_function_;
+  const void*                             task_;
+  size_t                                  num_tasks_;
+  std::atomic<size_t>                     next_task_;
+  unsigned int                            num_busy_;
+  unsigned int                            generation_;
+  bool                                    stop_;
+};
+
+} /* vid namespace */
@@ -18,7 +18,10 @@
 
 #pragma once
 
+#include <atomic>
 #include <deque>
+#include <thread>
+#include <vector>
 
 #include <Eigen/Eigen>
 
@@ -27,7 +30,6 @@
 #pragma clang diagnostic ignored "-Wunused-parameter"
 #endif
 #include <ba/BundleAdjuster.h>
-#include <ba/InterpolationBuffer.h>
 #include <ba/Types.h>
 #ifdef __clang__
 #pragma clang diagnostic pop
@@ -36,6 +38,9 @@
 #include <calibu/Calibu.h>
 
 #include <vidtrack/dtrack.h>
+#include <vidtrack/imu_buffer.h>
+#include <vidtrack/keyframe_store.h>
+#include <vidtrack/spsc_queue.h>
 
 
 namespace vid {
@@ -53,6 +58,53 @@ inline void ConvertAndNormalize(cv::Mat& image)
 class Tracker {
 
 public:
+  ///////////////////////////////////////////////////////////////////////////
+  /// When to replace DTrack's keyframe. Frames are tracked against the same
+  /// keyframe until any of these is crossed by the frame just estimated,
+  /// which then becomes the new keyframe. max_time = 0 switches on every
+  /// frame (frame to frame tracking).
+  struct KeyframePolicy {
+    double  max_translation = 0.15;   // Meters from the keyframe.
+    double  max_rotation    = 0.2;    // Radians from the keyframe.
+    double  max_time        = 1.0;    // Seconds since the keyframe.
+    double  min_overlap     = 0.5;    // num_obs over keyframe points.
+    double  min_obs_ratio   = 0.7;    // num_obs over that of the first frame
+                                      // tracked against the keyframe.
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Constant velocity prior, used when the IMU cannot seed DTrack. The last
+  /// frame-to-frame motion seeds the estimate. If it agrees with the one
+  /// before (scaled to the current frame interval), the coarse pyramid levels
+  /// are skipped.
+  struct MotionPrior {
+    bool          enabled = true;
+    double        max_rotation_error    = 0.005;  // Radians.
+    double        max_translation_error = 0.005;  // Meters.
+    unsigned int  start_level = 0;                // First level if trusted.
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Per instance configuration. Nothing is read from global flags, so
+  /// trackers with different settings can run side by side in one process.
+  ///
+  /// With async_ba, windowed BA runs on its own thread and Estimate returns
+  /// as soon as DTrack is done. The returned pose is then the latest BA
+  /// result composed with the visual estimates BA has not caught up with.
+  /// The BA window and bundle adjuster belong to that thread: the debugging
+  /// accessors below are only safe to use while async_ba is off.
+  struct Options {
+    bool            imu_seeding = true;   // Seed DTrack with the IMU once BA converged.
+    bool            use_imu     = true;   // Windowed BA with IMU residuals.
+    bool            async_ba    = false;  // Windowed BA on a back-end thread.
+    DTrack::Options dtrack;               // Tracking and map refinement.
+    KeyframeStore::Options keyframes;     // Frame history memory cap.
+  };
+
+  /// Vectors, not deques: windows are short and shift in place, so in
+  /// steady state they reuse their capacity instead of allocating nodes.
+  typedef std::vector<ba::PoseT<double>,
+                      Eigen::aligned_allocator<ba::PoseT<double> > > PoseWindow;
 
   ///////////////////////////////////////////////////////////////////////////
   Tracker(unsigned int window_size = 5, unsigned int pyramid_levels = 5);
@@ -97,6 +149,44 @@ public:
     );
 
 
+  ///////////////////////////////////////////////////////////////////////////
+  /// Also configures both DTrack instances. Waits for the BA back-end to
+  /// finish the frames already handed to it before switching.
+  void SetOptions(const Options& options);
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  const Options& GetOptions() const
+  {
+    return tracker_options_;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SetKeyframePolicy(const KeyframePolicy& policy)
+  {
+    keyframe_policy_ = policy;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  const KeyframePolicy& GetKeyframePolicy() const
+  {
+    return keyframe_policy_;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SetMotionPrior(const MotionPrior& prior);
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  const MotionPrior& GetMotionPrior() const
+  {
+    return motion_prior_;
+  }
+
+
   ///////////////////////////////////////////////////////////////////////////
   void Estimate(
       const cv::Mat&  grey_image,
@@ -108,6 +198,32 @@ public:
     );
 
 
+  ///////////////////////////////////////////////////////////////////////////
+  /// True if the last frame given to Estimate became the keyframe.
+  bool IsKeyframe() const
+  {
+    return is_keyframe_;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// True once Estimate returns BA adjusted poses. With async_ba, as of the
+  /// latest BA result taken.
+  bool HasBAConverged() const
+  {
+    return ba_result_.converged;
+  }
+
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// What DTrack ran for the last frame given to Estimate: iterations,
+  /// errors and where the time went, per pyramid level.
+  const DTrack::EstimateReport& GetEstimateReport() const
+  {
+    return dtrack_report_;
+  }
+
+
   ///////////////////////////////////////////////////////////////////////////
   void AddInertialMeasurement(
       const Eigen::Vector3d&  accel,
@@ -121,24 +237,28 @@ public:
   // For debugging. Remove later.
   const ba::ImuResidualT<double,15,15>& GetImuResidual(const uint32_t id)
   {
+    CHECK(!tracker_options_.async_ba) << "Owned by the BA back-end.";
     return bundle_adjuster_.GetImuResidual(id);
   }
 
   // For debugging. Remove later.
   const std::vector<uint32_t>& GetImuResidualIds()
   {
+    CHECK(!tracker_options_.async_ba) << "Owned by the BA back-end.";
     return imu_residual_ids_;
   }
 
   // For debugging. Remove later.
   const ba::ImuCalibrationT<double>& GetImuCalibration()
   {
+    CHECK(!tracker_options_.async_ba) << "Owned by the BA back-end.";
     return bundle_adjuster_.GetImuCalibration();
   }
 
   // For debugging. Remove later.
   size_t GetNumPoses()
   {
+    CHECK(!tracker_options_.async_ba) << "Owned by the BA back-end.";
     return bundle_adjuster_.GetNumPoses();
   }
 
@@ -151,6 +271,7 @@ public:
   // For debugging. Remove later.
   const ba::PoseT<double>& GetPose(const uint32_t id)
   {
+    CHECK(!tracker_options_.async_ba) << "Owned by the BA back-end.";
     return bundle_adjuster_.GetPose(id);
   }
 
@@ -161,14 +282,22 @@ public:
   }
 
   // For debugging. Remove later.
-  const ba::InterpolationBufferT<ba::ImuMeasurementT<double>, double>& GetImuBuffer()
+  const ImuBuffer& GetImuBuffer()
   {
     return imu_buffer_;
   }
 
+  // For debugging. Remove later. Holds the BA back-end, so edges queue up
+  // and only the newest is solved once it resumes. Stopping still drains.
+  void PauseBackEnd(bool pause)
+  {
+    back_end_pause_.store(pause, std::memory_order_release);
+  }
+
   // For debugging. Remove later.
-  const std::deque<ba::PoseT<double> >& GetAdjustedPoses()
+  const PoseWindow& GetAdjustedPoses()
   {
+    CHECK(!tracker_options_.async_ba) << "Owned by the BA back-end.";
     return ba_window_;
   }
 
@@ -193,7 +322,9 @@ public:
       Sophus::SE3d&   Twp
     );
 
-  cv::Mat GenerateThumbnail(const cv::Mat& image);
+  /// Level 3 of the image's pyramid. The result lives in a pool buffer and is
+  /// overwritten by the next call, so clone it to keep it.
+  const cv::Mat& GenerateThumbnail(const cv::Mat& image);
 
   void RefinePose(
       const cv::Mat&    grey_image,
@@ -215,22 +346,21 @@ public:
   const unsigned int kMinWindowSize;
   const unsigned int kPyramidLevels;
 
+  // Best scoring loop closure candidates verified together per keyframe,
+  // and how many of them are refined past each pyramid level.
+  const unsigned int kMaxLoopClosureCandidates = 8;
+  const unsigned int kLoopClosureSurvivors = 2;
+
+  // IMU samples held, about 16 seconds at 1 kHz. Samples older than the BA
+  // window are released before that.
+  const unsigned int kImuBufferSize = 1 << 14;
+
   const double       kTimeOffset = 0.0;
 //  const double       kTimeOffset = -0.00195049; // Old
 //  const double       kTimeOffset = -0.00490676; // New
 
-  // Hack because of stupid deadlines like usual.
-  struct DTrackPoseOut {
-    Sophus::SE3d      T_wp;
-    Sophus::SE3d      T_ab;
-    double            time_a;
-    double            time_b;
-    Eigen::Matrix6d   covariance;
-    cv::Mat           grey_img;
-    cv::Mat           depth_img;
-    cv::Mat           thumbnail;
-  };
-  std::vector<DTrackPoseOut>                        dtrack_vector_;
+  // Every tracked frame, for loop closure and map export.
+  KeyframeStore                                     keyframe_store_;
 
   struct DTrackMap {
     Sophus::SE3d      T_wp;
@@ -240,8 +370,8 @@ public:
   };
   std::vector<DTrackMap>                            dtrack_map_;
 
-  typedef ba::ImuMeasurementT<double>   ImuMeasurement;
-  ba::InterpolationBufferT<ImuMeasurement, double>  imu_buffer_;
+  typedef ImuBuffer::ImuMeasurement   ImuMeasurement;
+  ImuBuffer                                         imu_buffer_;
 
 private:
   struct DTrackPose {
@@ -249,10 +379,79 @@ private:
     double            time_a;
     double            time_b;
     Eigen::Matrix6d   covariance;
+    // IMU measurements between time_a and time_b. Fetched by IMU seeding or
+    // when the edge first enters BA, and kept once the buffer has reached
+    // time_b.
+    std::vector<ImuMeasurement> imu_measurements;
+    bool              imu_complete = false;
   };
 
+  ///////////////////////////////////////////////////////////////////////////
+  /// Latest state of the BA window as seen by Estimate.
+  struct BAResult {
+    bool              converged = false;
+    ba::PoseT<double> pose;       // Newest adjusted pose.
+  };
+
+  typedef std::vector<DTrackPose, Eigen::aligned_allocator<DTrackPose> >
+      EdgeWindow;
+  typedef SpscQueue<DTrackPose, Eigen::aligned_allocator<DTrackPose> >
+      EdgeQueue;
+  typedef SpscQueue<BAResult, Eigen::aligned_allocator<BAResult> >
+      ResultQueue;
+
+  // Edges and results in flight between Estimate and the BA back-end.
+  const unsigned int kBackEndQueueSize = 64;
+
 //  typedef ba::ImuMeasurementT<double>   ImuMeasurement;
 
+  ///////////////////////////////////////////////////////////////////////////
+  /// Checks the estimate of a frame against the keyframe policy.
+  bool _NeedsNewKeyframe(
+      const Sophus::SE3d&   Tkc,        //< Input: Frame pose wrt keyframe (vision).
+      unsigned int          num_obs,    //< Input: DTrack observations.
+      double                time        //< Input: Frame time.
+    ) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Constant velocity prediction from the last DTrack estimates. Returns
+  /// true if the prediction can skip the coarse pyramid levels.
+  bool _PredictMotion(
+      double                time,       //< Input: Frame time.
+      Sophus::SE3d&         rel_pose    //< Output: Motion since last frame (vision).
+    ) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Appends a DTrack edge to the BA window and runs windowed BA on it,
+  /// dropping the oldest pose once the window is full. Runs on the
+  /// back-end thread if async_ba is set.
+  void _AddToWindow(
+      DTrackPose&           edge,       //< Input: New edge (IMU). Moved from.
+      bool                  solve       //< Input: False only updates the window.
+    );
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Latest BA state propagated with the visual edges BA has not adjusted
+  /// yet, up to the newest one. Only t_wp and time are propagated; velocity
+  /// and biases stay those of the adjusted pose.
+  void _PropagateBAResult(
+      ba::PoseT<double>&    pose        //< Output: State at the last frame (IMU).
+    ) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Takes the newest result published by the back-end, if any, and drops
+  /// the edges it already covers.
+  void _TakeBAResults();
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Back-end thread. Runs windowed BA on each edge handed over by Estimate
+  /// until stopped and all queued edges are done.
+  void _BackEndLoop();
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Joins the back-end, if running, and syncs Estimate with its window.
+  void _StopBackEnd();
+
 private:
   bool                                              config_ba_;
   bool                                              config_dtrack_;
@@ -260,20 +459,47 @@ private:
 
   std::shared_ptr<calibu::Rig<double>>              rig_;
   Sophus::SE3d                                      Tic_;
+  Eigen::Vector3d                                   gravity_; // Given to BA.
   Sophus::SE3d                                      current_pose_;
   double                                            current_time_;
 
   /// DTrack variables.
   DTrack                                            dtrack_;
   DTrack                                            dtrack_refine_;
+  DTrack::EstimateReport                            dtrack_report_;
   Sophus::SE3d                                      last_estimated_pose_;
-  std::deque<DTrackPose>                            dtrack_window_;
-
-  /// BA variables.
+  EdgeWindow                                        dtrack_window_;
+  KeyframePolicy                                    keyframe_policy_;
+  Sophus::SE3d                                      Tkc_;   // Last frame wrt keyframe (vision).
+  Eigen::Matrix6d                                   Tkc_covariance_; // DTrack's, of Tkc_.
+  double                                            keyframe_time_;
+  unsigned int                                      keyframe_num_obs_; // 0 until tracked.
+  bool                                              is_keyframe_;
+  MotionPrior                                       motion_prior_;
+  Options                                           tracker_options_;
+  DTrack::EstimatePolicy                            motion_prior_policy_;
+  ImagePool                                         thumbnail_pool_;
+
+  /// Front-end view of BA. Edges are kept until BA has adjusted the frame
+  /// they end at, and the last two also feed the motion prior.
+  EdgeWindow                                        vo_edges_;      // No IMU.
+  BAResult                                          ba_result_;
+
+  /// BA back-end. Only used if async_ba is set.
+  std::thread                                       back_end_;
+  std::atomic<bool>                                 back_end_stop_;
+  std::atomic<bool>                                 back_end_pause_;
+  EdgeQueue                                         edge_queue_;
+  ResultQueue                                       result_queue_;
+
+  /// BA variables. Owned by the back-end while it runs.
   ba::BundleAdjuster<double, 0, 15, 0>              bundle_adjuster_;
   ba::BundleAdjuster<double, 0, 6, 0>               pose_relaxer_;
   ba::Options<double>                               options_;
-  std::deque<ba::PoseT<double> >                    ba_window_;
+  PoseWindow                                        ba_window_;
+  std::vector<ImuMeasurement>                       spare_imu_measurements_; // Of the last edge popped.
+  std::vector<ba::ImuPoseT<double> >                imu_poses_; // IMU seeding scratch.
+  std::vector<ImuMeasurement>                       imu_lag_measurements_; // Same.
 //  ba::InterpolationBufferT<ImuMeasurement, double>  imu_buffer_;
 
   // TODO(jfalquez) Remove later. Only for debugging.
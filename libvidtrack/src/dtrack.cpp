@@ -17,23 +17,15 @@
  */
 
 #include <vidtrack/dtrack.h>
+#include <vidtrack/pyramid.h>
 
 #include <glog/logging.h>
 
+#ifdef VIDTRACK_USE_TBB
+#include <tbb/parallel_for.h>
+#endif
 
-DEFINE_bool(discard_saturated, true,
-            "Discard under/over saturated pixels during pose estimation.");
-DEFINE_double(min_depth, 0.10,
-              "Minimum depth to consider for pose estimation.");
-DEFINE_double(max_depth, 20.0,
-              "Maxmimum depth to consider for pose estimation.");
-DEFINE_double(norm_param, 10.0,
-              "Tukey norm parameter for robust norm.");
-DEFINE_bool(semi_dense, false,
-            "Use semi-dense approach for VO rather than full dense.");
-
-
-#undef VIDTRACK_USE_TBB
+#include "dtrack_simd.h"
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -81,457 +73,100 @@ inline double interp(
   return p1+p2;
 }
 
-
-#ifdef VIDTRACK_USE_TBB
 /////////////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////////////
-class PoseRefine
+/// Bilinear sample of intensity and gradients from a packed {I, gx, gy, 0}
+/// image. All three values come from the same 2x2 neighbourhood, i.e. two
+/// 32 byte rows. Branch-free: callers must keep (x, y) inside
+/// [0, width-2] x [0, height-2].
+template<typename Scalar>
+inline Eigen::Matrix<Scalar, 3, 1> interp_packed(
+    Scalar                x,            // Input: X coordinate.
+    Scalar                y,            // Input: Y coordinate.
+    const float*          packed_ptr,   // Input: Pointer to packed image.
+    const unsigned int    image_width   // Input: Image width.
+    )
 {
-public:
-  ///////////////////////////////////////////////////////////////////////////
-  PoseRefine(
-      const cv::Mat&           live_grey,
-      const cv::Mat&           ref_grey,
-      const cv::Mat&           ref_depth,
-      const cv::Mat&           grad_x_live,
-      const cv::Mat&           grad_y_live,
-      const cv::Mat&           grad_x_ref,
-      const cv::Mat&           grad_y_ref,
-      const Eigen::Matrix3d&   Klg,
-      const Eigen::Matrix3d&   Krg,
-      const Eigen::Matrix3d&   Krd,
-      const Eigen::Matrix4d&   Tgd,
-      const Eigen::Matrix4d&   Tlr,
-      const Eigen::Matrix3x4d& KlgTlr,
-      double                   sigma,
-      float                    norm_param,
-      bool                     discard_saturated,
-      float                    min_depth,
-      float                    max_depth
-      ):
-    error(0),
-    num_obs(0),
-    live_grey_(live_grey),
-    ref_grey_(ref_grey),
-    ref_depth_(ref_depth),
-    grad_x_live_(grad_x_live),
-    grad_y_live_(grad_y_live),
-    grad_x_ref_(grad_x_ref),
-    grad_y_ref_(grad_y_ref),
-    Klg_(Klg),
-    Krg_(Krg),
-    Krd_(Krd),
-    Tgd_(Tgd),
-    Tlr_(Tlr),
-    KlgTlr_(KlgTlr),
-    grey_sigma_(sigma),
-    norm_param_(norm_param),
-    discard_saturated_(discard_saturated),
-    min_depth_(min_depth),
-    max_depth_(max_depth)
-  {
-    hessian.setZero();
-    LHS.setZero();
-    RHS.setZero();
-  }
-
-  ///////////////////////////////////////////////////////////////////////////
-  PoseRefine(
-      const PoseRefine& x,
-      tbb::split
-      ):
-    error(0),
-    num_obs(0),
-    live_grey_(x.live_grey_),
-    ref_grey_(x.ref_grey_),
-    ref_depth_(x.ref_depth_),
-    grad_x_live_(x.grad_x_live_),
-    grad_y_live_(x.grad_y_live_),
-    grad_x_ref_(x.grad_x_ref_),
-    grad_y_ref_(x.grad_x_ref_),
-    Klg_(x.Klg_),
-    Krg_(x.Krg_),
-    Krd_(x.Krd_),
-    Tgd_(x.Tgd_),
-    Tlr_(x.Tlr_),
-    KlgTlr_(x.KlgTlr_),
-    grey_sigma_(x.grey_sigma_),
-    norm_param_(x.norm_param_),
-    discard_saturated_(x.discard_saturated_),
-    min_depth_(x.min_depth_),
-    max_depth_(x.max_depth_)
-  {
-    hessian.setZero();
-    LHS.setZero();
-    RHS.setZero();
-  }
-
-  ///////////////////////////////////////////////////////////////////////////
-  void operator()(const tbb::blocked_range<size_t>& r)
-  {
-    // Local pointer for optimization apparently.
-    for (size_t ii = r.begin(); ii != r.end(); ++ii) {
-      const unsigned int u = ii%ref_depth_.cols;
-      const unsigned int v = ii/ref_depth_.cols;
-
-      // 2d point in reference depth camera.
-      Eigen::Vector2d pr_d;
-      pr_d << u, v;
-
-      // Get depth.
-      const double depth = ref_depth_.at<float>(v, u);
-
-      // Check if depth is NAN.
-      if (depth != depth) {
-        continue;
-      }
-
-      if (depth < min_depth_ || depth > max_depth_) {
-        continue;
-      }
-
-      // 3d point in reference depth camera.
-      Eigen::Vector4d hPr_d;
-      hPr_d(0) = depth * (pr_d(0)-Krd_(0,2))/Krd_(0,0);
-      hPr_d(1) = depth * (pr_d(1)-Krd_(1,2))/Krd_(1,1);
-      hPr_d(2) = depth;
-      hPr_d(3) = 1;
-
-      // 3d point in reference grey camera (homogenized).
-      // If depth and grey cameras are aligned, Tgd_ = I4.
-      const Eigen::Vector4d hPr_g = Tgd_ * hPr_d;
-
-      // Project to reference grey camera's image coordinate.
-      Eigen::Vector2d pr_g;
-      pr_g(0) = (hPr_g(0)*Krg_(0,0)/hPr_g(2)) + Krg_(0,2);
-      pr_g(1) = (hPr_g(1)*Krg_(1,1)/hPr_g(2)) + Krg_(1,2);
-
-      // Check if point is out of bounds.
-      if ((pr_g(0) < 2) || (pr_g(0) >= ref_grey_.cols-3) || (pr_g(1) < 2)
-          || (pr_g(1) >= ref_grey_.rows-3)) {
-        continue;
-      }
-
-      // Homogenized 3d point in live grey camera.
-      const Eigen::Vector4d hPl_g = Tlr_ * hPr_g;
-
-      // Project to live grey camera's image coordinate.
-      Eigen::Vector2d pl_g;
-      pl_g(0) = (hPl_g(0)*Klg_(0,0)/hPl_g(2)) + Klg_(0,2);
-      pl_g(1) = (hPl_g(1)*Klg_(1,1)/hPl_g(2)) + Klg_(1,2);
-
-      // Check if point is out of bounds.
-      if ((pl_g(0) < 2) || (pl_g(0) >= live_grey_.cols-3) || (pl_g(1) < 2)
-          || (pl_g(1) >= live_grey_.rows-3)) {
-        continue;
-      }
-
-      // Get intensities.
-      const double Il =
-          interp<unsigned char>(pl_g(0), pl_g(1), live_grey_.data,
-                 live_grey_.cols, live_grey_.rows);
-      const double Ir =
-          interp<unsigned char>(pr_g(0), pr_g(1), ref_grey_.data,
-                 ref_grey_.cols, ref_grey_.rows);
-
-      // Discard under/over-saturated pixels.
-      if (discard_saturated_) {
-        if (Il == 0.0 || Il == 255.0 || Ir == 0.0 || Ir == 255.0) {
-          continue;
-        }
-      }
-
-      // Calculate photometric error.
-      const double y = Il-Ir;
-
-      ///-------------------- Forward Compositional
-      // Image derivative.
-      const double Il_xr =
-          interp<unsigned char>(pl_g(0)+0.5, pl_g(1), live_grey_.data,
-                 live_grey_.cols, live_grey_.rows);
-      const double Il_xl =
-          interp<unsigned char>(pl_g(0)-0.5, pl_g(1), live_grey_.data,
-                 live_grey_.cols, live_grey_.rows);
-      const double Il_yu =
-          interp<unsigned char>(pl_g(0), pl_g(1)-0.5, live_grey_.data,
-                 live_grey_.cols, live_grey_.rows);
-      const double Il_yd =
-          interp<unsigned char>(pl_g(0), pl_g(1)+0.5, live_grey_.data,
-                 live_grey_.cols, live_grey_.rows);
-
-      Eigen::Matrix<double, 1, 2> dIl;
-//      dIl << (Il_xr-Il_xl)/2.0, (Il_yd-Il_yu)/2.0;
-//      dIl << ((Il_xr-Il)+(Il-Il_xl))/2.0, ((Il_yd-Il)+(Il-Il_yu))/2.0;
-      dIl << ((Il_xr-Il)+(Il-Il_xl))/1.0, ((Il_yd-Il)+(Il-Il_yu))/1.0;
-      if (u == 10 && v == 10) {
-        std::cout << "hPrg: " << hPr_g.transpose() << std::endl;
-        std::cout << "Tlr: " << std::endl << Tlr_.matrix() << std::endl;
-        std::cout << "hPlg: " << hPl_g.transpose() << std::endl;
-        std::cout << "pl: " << pl_g.transpose() << std::endl;
-        std::cout << "dIl: " << dIl << std::endl;
-      }
-      dIl(0) = interp<float>(pl_g(0), pl_g(1),
-                             reinterpret_cast<float*>(grad_x_live_.data),
-                             grad_x_live_.cols, grad_x_live_.rows);
-      dIl(1) = interp<float>(pl_g(0), pl_g(1),
-                             reinterpret_cast<float*>(grad_y_live_.data),
-                             grad_y_live_.cols, grad_y_live_.rows);
-      if (u == 10 && v == 10) {
-        std::cout << "dIl: " << dIl << std::endl;
-      }
-
-
-      ///-------------------- Inverse Compositional
-      // Image derivative.
-      const double Ir_xr =
-          interp<unsigned char>(pr_g(0)+0.5, pr_g(1), ref_grey_.data,
-                 ref_grey_.cols, ref_grey_.rows);
-      const double Ir_xl =
-          interp<unsigned char>(pr_g(0)-0.5, pr_g(1), ref_grey_.data,
-                 ref_grey_.cols, ref_grey_.rows);
-      const double Ir_yu =
-          interp<unsigned char>(pr_g(0), pr_g(1)-0.5, ref_grey_.data,
-                 ref_grey_.cols, ref_grey_.rows);
-      const double Ir_yd =
-          interp<unsigned char>(pr_g(0), pr_g(1)+0.5, ref_grey_.data,
-                 ref_grey_.cols, ref_grey_.rows);
-
-      Eigen::Matrix<double, 1, 2> dIr;
-//      dIr << (Ir_xr-Ir_xl)/2.0, (Ir_yd-Ir_yu)/2.0;
-//      dIr << ((Ir_xr-Ir)+(Ir-Ir_xl))/2.0, ((Ir_yd-Ir)+(Ir-Ir_yu))/2.0;
-      dIr << ((Ir_xr-Ir)+(Ir-Ir_xl))/1.0, ((Ir_yd-Ir)+(Ir-Ir_yu))/1.0;
-      if (u == 10 && v == 10) {
-        std::cout << "pr: " << pr_g.transpose() << std::endl;
-        std::cout << "dIr: " << dIr << std::endl;
-      }
-      dIr(0) = interp<float>(pr_g(0), pr_g(1),
-                             reinterpret_cast<float*>(grad_x_ref_.data),
-                             grad_x_ref_.cols, grad_x_ref_.rows);
-      dIr(1) = interp<float>(pr_g(0), pr_g(1),
-                             reinterpret_cast<float*>(grad_y_ref_.data),
-                             grad_y_ref_.cols, grad_y_ref_.rows);
-      if (u == 10 && v == 10) {
-        std::cout << "dIr: " << dIr << std::endl;
-      }
-
-      // Projection & dehomogenization derivative.
-      Eigen::Vector3d KlPl = Klg_ * hPl_g.head(3);
-
-      Eigen::Matrix<double, 2, 3> dPl;
-      dPl << 1.0/KlPl(2), 0, -KlPl(0)/(KlPl(2)*KlPl(2)),
-          0, 1.0/KlPl(2), -KlPl(1)/(KlPl(2)*KlPl(2));
-
-      const Eigen::Matrix<double, 1, 4> dIesm_dPl_KlgTlr
-                                              = ((dIl+dIr)/2.0)*dPl*KlgTlr_;
-
-      // J = dIesm_dPl_KlgTlr * gen_i * Pr
-      Eigen::Matrix<double, 1, 6> J;
-      J << dIesm_dPl_KlgTlr(0),
-           dIesm_dPl_KlgTlr(1),
-           dIesm_dPl_KlgTlr(2),
-          -dIesm_dPl_KlgTlr(1)*hPr_g(2) + dIesm_dPl_KlgTlr(2)*hPr_g(1),
-          +dIesm_dPl_KlgTlr(0)*hPr_g(2) - dIesm_dPl_KlgTlr(2)*hPr_g(0),
-          -dIesm_dPl_KlgTlr(0)*hPr_g(1) + dIesm_dPl_KlgTlr(1)*hPr_g(0);
-
-
-      ///-------------------- Depth Derivative
-      // Homogenization derivative.
-      Eigen::Matrix<double, 4, 3> dPinv4;
-      dPinv4 << 1, 0, 0,
-                0, 1, 0,
-                0, 0, 1,
-                0, 0, 0;
-
-      // Homogenized depth pixel.
-      Eigen::Vector3d hpr_d;
-      hpr_d << pr_d(0), pr_d(1), 1;
-
-      // Depth derivative on live image.
-      // Jdl = dIl * dPl * Kl * Tlr * Tgd * dPinv * Kdinv * pr_d
-      const double Jdl = dIl * dPl * KlgTlr_ * Tgd_ * dPinv4
-                             * Krd_.inverse() * hpr_d;
-
-      // Depth derivative on reference image.
-      // Projection & dehomogenization derivative.
-      Eigen::Vector3d KrPr = Krg_ * hPr_g.head(3);
-
-      Eigen::Matrix<double, 2, 3> dPr;
-      dPr << 1.0/KrPr(2), 0, -KrPr(0)/(KrPr(2)*KrPr(2)),
-          0, 1.0/KrPr(2), -KrPr(1)/(KrPr(2)*KrPr(2));
-
-      // Jdr = dIr * dPr * Kr * Tgd * dPinv * Kdinv * pr_d
-      const double Jdr = dIr * dPr * Krg_ * Tgd_.block<3,4>(0,0) * dPinv4
-                                    * Krd_.inverse() * hpr_d;
-
-
-      if (dIl(0) != 0 && dIl(1) != 0 && u == 10 && v == 10 && false) {
-        std::cout << "----------------------------" << std::endl;
-        std::cout << "Jd-a: " << Jdl - Jdr << std::endl;
-        Eigen::Vector2d tmp = dPl * KlgTlr_ * Tgd_ * dPinv4
-                                     * Krd_.inverse() * hpr_d;
-//        std::cout << "Jd-a Pix: " << tmp.transpose() << std::endl;
-
-        double epsilon = 1e-6;
-
-        // Get depth.
-        const double depthf = depth + epsilon;
-        const double depthb = depth - epsilon;
-
-        // 3d point in reference depth camera.
-        Eigen::Vector4d hPr_df;
-        hPr_df(0) = depthf * (pr_d(0)-Krd_(0,2))/Krd_(0,0);
-        hPr_df(1) = depthf * (pr_d(1)-Krd_(1,2))/Krd_(1,1);
-        hPr_df(2) = depthf;
-        hPr_df(3) = 1;
-        Eigen::Vector4d hPr_db;
-        hPr_db(0) = depthb * (pr_d(0)-Krd_(0,2))/Krd_(0,0);
-        hPr_db(1) = depthb * (pr_d(1)-Krd_(1,2))/Krd_(1,1);
-        hPr_db(2) = depthb;
-        hPr_db(3) = 1;
-
-        // 3d point in reference grey camera (homogenized).
-        // If depth and grey cameras are aligned, Tgd_ = I4.
-        const Eigen::Vector4d hPr_gf = Tgd_ * hPr_df;
-        const Eigen::Vector4d hPr_gb = Tgd_ * hPr_db;
-
-        // Project to reference grey camera's image coordinate.
-        Eigen::Vector2d pr_gf;
-        pr_gf(0) = (hPr_gf(0)*Krg_(0,0)/hPr_gf(2)) + Krg_(0,2);
-        pr_gf(1) = (hPr_gf(1)*Krg_(1,1)/hPr_gf(2)) + Krg_(1,2);
-        Eigen::Vector2d pr_gb;
-        pr_gb(0) = (hPr_gb(0)*Krg_(0,0)/hPr_gb(2)) + Krg_(0,2);
-        pr_gb(1) = (hPr_gb(1)*Krg_(1,1)/hPr_gb(2)) + Krg_(1,2);
-
-        // Homogenized 3d point in live grey camera.
-        const Eigen::Vector4d hPl_gf = Tlr_ * hPr_gf;
-        const Eigen::Vector4d hPl_gb = Tlr_ * hPr_gb;
-
-        // Project to live grey camera's image coordinate.
-        Eigen::Vector2d pl_gf;
-        pl_gf(0) = (hPl_gf(0)*Klg_(0,0)/hPl_gf(2)) + Klg_(0,2);
-        pl_gf(1) = (hPl_gf(1)*Klg_(1,1)/hPl_gf(2)) + Klg_(1,2);
-        Eigen::Vector2d pl_gb;
-        pl_gb(0) = (hPl_gb(0)*Klg_(0,0)/hPl_gb(2)) + Klg_(0,2);
-        pl_gb(1) = (hPl_gb(1)*Klg_(1,1)/hPl_gb(2)) + Klg_(1,2);
-
-        // Get intensities.
-        const double Ilf =
-            interp(pl_gf(0), pl_gf(1), live_grey_.data,
-                   live_grey_.cols, live_grey_.rows);
-        const double Irf =
-            interp(pr_gf(0), pr_gf(1), ref_grey_.data,
-                   ref_grey_.cols, ref_grey_.rows);
-        const double Ilb =
-            interp(pl_gb(0), pl_gb(1), live_grey_.data,
-                   live_grey_.cols, live_grey_.rows);
-        const double Irb =
-            interp(pr_gb(0), pr_gb(1), ref_grey_.data,
-                   ref_grey_.cols, ref_grey_.rows);
-
-
-        std::cout << "Jd-fd: " << ((Ilf-Irf) - (Ilb-Irb))/(depthf-depthb) << std::endl;
-//        std::cout << "Jd-fd Pix: " << ((pl_gf-pl_gb)/(depthf-depthb)).transpose() << std::endl;
-      }
-
-
-      // Final depth Jacobian: Jd = Jdl - Jdr
-      double Jd = Jdl - Jdr;
-      if (Jd == 0) {
-        Jd = FLT_MIN;
-      }
-
-
-      ///-------------------- Robust Norm
-      const double w = _NormTukey(y, norm_param_);
-
-      // Uncertainties.
-      const double depth_sigma = depth/20.0;
-
-      // Error prop: NewSigma = J * Sigma * J_transpose
-      const double depth_unc = Jd * (depth_sigma*depth_sigma) * Jd;
-
-      // Try gradient as uncertainty. Makes more sense for ELAS.
-      // Do finite differences on edge pixel to test all the way.
-      const double inv_sigma = 1.0/((grey_sigma_*grey_sigma_)+depth_unc);
-
-      hessian     += J.transpose() * w * inv_sigma * J;
-      LHS         += J.transpose() * w * inv_sigma * J;
-      RHS         += J.transpose() * w * inv_sigma * y;
-      error       += y * y;
-      num_obs++;
-    }
-  }
-
-  ///////////////////////////////////////////////////////////////////////////
-  void join(const PoseRefine& other)
-  {
-    LHS         += other.LHS;
-    RHS         += other.RHS;
-    hessian     += other.hessian;
-    error       += other.error;
-    num_obs     += other.num_obs;
-  }
-
-private:
-  ///////////////////////////////////////////////////////////////////////////
-  inline double _NormTukey(double r,
-                           double c)
-  {
-    const double roc    = r/c;
-    const double omroc2 = 1.0f-roc*roc;
-
-    return (fabs(r) <= c) ? omroc2*omroc2 : 0.0f;
+  const int     px  = static_cast<int>(x);  /* top-left corner */
+  const int     py  = static_cast<int>(y);
+  const Scalar  ax  = x-px;
+  const Scalar  ay  = y-py;
+  const Scalar  ax1 = 1-ax;
+  const Scalar  ay1 = 1-ay;
+
+  const float* p0 = packed_ptr+4*((image_width*py)+px);
+  const float* p1 = p0+4*image_width;
+
+  Eigen::Matrix<Scalar, 3, 1> value;
+  for (int cc = 0; cc < 3; ++cc) {
+    value(cc) = (p0[cc]*ay1 + p1[cc]*ay)*ax1 + (p0[cc+4]*ay1 + p1[cc+4]*ay)*ax;
   }
+  return value;
+}
 
+/////////////////////////////////////////////////////////////////////////////
+/// Field of the cached reference points, in the requested precision.
+template<typename Scalar>
+const Scalar* point_field(
+    const DTrack::KeyframePoints&   points,   // Input: Reference points.
+    dtrack_simd::Field              field     // Input: Field to fetch.
+    );
+
+template<>
+inline const double* point_field<double>(
+    const DTrack::KeyframePoints&   points,
+    dtrack_simd::Field              field
+    )
+{
+  const std::vector<double>* fields[dtrack_simd::kNumFields] = {
+    &points.x, &points.y, &points.z, &points.xd, &points.yd, &points.zd,
+    &points.Ir, &points.dIr_x, &points.dIr_y,
+    &points.dPd_x, &points.dPd_y, &points.dPd_z, &points.Jdr };
+  return fields[field]->data();
+}
 
-  ///
-  ///////////////////////////////////////////////////////////////////////////
+template<>
+inline const float* point_field<float>(
+    const DTrack::KeyframePoints&   points,
+    dtrack_simd::Field              field
+    )
+{
+  return points.simd_data.data() + field*points.simd_stride;
+}
 
-public:
-  Eigen::Matrix6d   LHS;
-  Eigen::Vector6d   RHS;
-  Eigen::Matrix6d   hessian;
-  double            error;
-  unsigned int      num_obs;
-
-private:
-  cv::Mat           live_grey_;
-  cv::Mat           ref_grey_;
-  cv::Mat           ref_depth_;
-  cv::Mat           grad_x_live_;
-  cv::Mat           grad_y_live_;
-  cv::Mat           grad_x_ref_;
-  cv::Mat           grad_y_ref_;
-  Eigen::Matrix3d   Klg_;
-  Eigen::Matrix3d   Krg_;
-  Eigen::Matrix3d   Krd_;
-  Eigen::Matrix4d   Tgd_;
-  Eigen::Matrix4d   Tlr_;
-  Eigen::Matrix3x4d KlgTlr_;
-  double            grey_sigma_;
-  float             norm_param_;
-  bool              discard_saturated_;
-  float             min_depth_;
-  float             max_depth_;
-};
-#endif
+/////////////////////////////////////////////////////////////////////////////
+template<typename Scalar>
+inline Scalar DTrack::_NormTukey(Scalar r,
+                                 Scalar c)
+{
+  const Scalar roc    = r/c;
+  const Scalar omroc2 = 1.0f-roc*roc;
 
+  return (std::abs(r) <= c) ? omroc2*omroc2 : Scalar(0);
+}
 
 
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
 DTrack::DTrack(unsigned int pyramid_levels) :
-  kPyramidLevels(pyramid_levels)
+  kPyramidLevels(pyramid_levels), aligned_(false), gain_(1), bias_(0),
+  kernel_(kKernelScalar)
 #ifdef VIDTRACK_USE_CUDA
   , cu_dtrack_(nullptr)
 #endif
-#ifdef VIDTRACK_USE_TBB
-  , tbb_scheduler_(tbb::task_scheduler_init::automatic)
-#endif
 {
-#ifdef VIDTRACK_USE_TBB
-  tbb_scheduler_.initialize();
-#endif
+  has_live_frame_ = false;
+  live_grey_pyramid_.resize(kPyramidLevels);
+  ref_grey_pyramid_.resize(kPyramidLevels);
+  live_packed_pyramid_.resize(kPyramidLevels);
+  live_packed_valid_.assign(kPyramidLevels, false);
+  ref_packed_pyramid_.resize(kPyramidLevels);
+  ref_packed_valid_.assign(kPyramidLevels, false);
+  ref_depth_pyramid_.resize(kPyramidLevels);
+  ref_grey_edges_.resize(kPyramidLevels);
+
+  // Estimate(bool) runs every frame, so do not rebuild its policy each time.
+  default_policies_[0] = DefaultPolicy(false);
+  default_policies_[1] = DefaultPolicy(true);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -542,9 +177,6 @@ DTrack::~DTrack()
     free(cu_dtrack_);
   }
 #endif
-#ifdef VIDTRACK_USE_TBB
-  tbb_scheduler_.terminate();
-#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -564,6 +196,11 @@ void DTrack::SetParams(
 
   // Copy reference camera's depth-grey transform.
   Tgd_ = Tgd;
+
+  // Registered depth: depth pixels are grey pixels, so the depth-grey
+  // transform and the reference projection drop out of the per-pixel math.
+  aligned_ = Tgd.matrix() == Eigen::Matrix4d::Identity()
+      && ref_grey_cmod == ref_depth_cmod;
   LOG(INFO) << "Tgd is: " << Tgd.log().transpose() << std::endl;
 
 #ifdef VIDTRACK_USE_CUDA
@@ -577,7 +214,45 @@ void DTrack::SetParams(
 ///////////////////////////////////////////////////////////////////////////
 void DTrack::SetOptions(const DTrack::Options &options) {
   options_ = options;
-  FLAGS_semi_dense = options_.do_semi_dense_tracking;
+
+  // Resolve SIMD kernel against what the CPU supports.
+  kernel_ = options_.kernel;
+  if (kernel_ != kKernelScalar && kernel_ != kKernelFloat) {
+    const Kernel supported =
+        static_cast<Kernel>(kKernelSSE4 + dtrack_simd::DetectIsa() - 1);
+    if (supported < kKernelSSE4) {
+      LOG(WARNING) << "No SIMD support. Using single precision scalar kernel.";
+      kernel_ = kKernelFloat;
+    } else if (kernel_ == kKernelAuto) {
+      kernel_ = supported;
+    } else if (kernel_ > supported) {
+      LOG(WARNING) << "Requested SIMD kernel is not supported by this CPU.";
+      kernel_ = supported;
+    }
+  }
+
+  // (Re)create workers. A single thread runs everything on the caller.
+  const unsigned int num_threads = options_.num_threads == 0 ?
+        vid::ThreadPool::HardwareThreads() : options_.num_threads;
+#ifdef VIDTRACK_USE_TBB
+  if (num_threads == 1) {
+    tbb_arena_.reset();
+  } else {
+    tbb_arena_.reset(new tbb::task_arena(num_threads));
+  }
+#else
+  if (num_threads == 1) {
+    thread_pool_.reset();
+  } else if (!thread_pool_ || thread_pool_->NumThreads() != num_threads) {
+    thread_pool_.reset(new vid::ThreadPool(num_threads));
+  }
+#endif
+
+  // Cached reference points depend on the options, so rebuild them if a
+  // keyframe was already set.
+  if (!ref_grey_pyramid_[0].empty()) {
+    _InitKeyframe();
+  }
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -587,359 +262,1279 @@ void DTrack::SetKeyframe(
     )
 {
   // Build pyramids.
-  cv::buildPyramid(ref_grey, ref_grey_pyramid_, kPyramidLevels);
-  cv::buildPyramid(ref_depth, ref_depth_pyramid_, kPyramidLevels);
+  ref_grey.copyTo(ref_grey_pyramid_[0]);
+  _BuildGreyPyramid(ref_grey_pyramid_, ref_packed_pyramid_, ref_packed_valid_,
+                    true);
+  _BuildDepthPyramid(ref_depth);
+
+  _InitKeyframe();
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::PromoteLiveToKeyframe(
+    const cv::Mat& live_depth  // Input: Depth of live image (float format, meters).
+    )
+{
+  CHECK(has_live_frame_) << "No live frame to promote. Call Estimate first.";
+
+  // Live buffers take over the old reference ones, to be reused next frame.
+  ref_grey_pyramid_.swap(live_grey_pyramid_);
+  ref_packed_pyramid_.swap(live_packed_pyramid_);
+  ref_packed_valid_.swap(live_packed_valid_);
+  live_packed_valid_.assign(kPyramidLevels, false);
+  has_live_frame_ = false;
+
+  _BuildDepthPyramid(live_depth);
+
+  _InitKeyframe();
+}
 
+///////////////////////////////////////////////////////////////////////////
+void DTrack::_InitKeyframe()
+{
   // If semi-dense is used, run edge detector over pyramid.
-  if (FLAGS_semi_dense) {
-    ref_grey_edges_.clear();
+  if (options_.do_semi_dense_tracking) {
     for (size_t pyramid_lvl = 0; pyramid_lvl < kPyramidLevels; ++pyramid_lvl) {
-      cv::Mat detected_edges;
-      cv::blur(ref_grey_pyramid_[pyramid_lvl], detected_edges, cv::Size(3,3));
+      const cv::Mat& grey_img = ref_grey_pyramid_[pyramid_lvl];
+      cv::Mat& blurred = image_pool_.Get(pyramid_lvl, grey_img.rows,
+                                         grey_img.cols, grey_img.type());
+      cv::blur(grey_img, blurred, cv::Size(3,3));
 
-      // Canny detector.
+      // Canny detector. Edge image contains 255 if edge, 0 otherwise.
       const double kernel_size = 3;
       const double canny_threshold = 30;
-      cv::Canny(detected_edges, detected_edges, canny_threshold,
+      cv::Canny(blurred, ref_grey_edges_[pyramid_lvl], canny_threshold,
                 canny_threshold*3, kernel_size);
+    }
+  }
 
-      // Store edge image. Contains 255 if edge, 0 otherwise.
-      ref_grey_edges_.push_back(detected_edges);
+  // If depth pixels map one to one onto grey pixels, keep a compact list of
+  // the edge pixels with their depth so PrepareKeyframe skips the rest.
+  // Lists are cleared rather than dropped to keep their capacity.
+  if (options_.do_semi_dense_tracking && aligned_ &&
+      ref_grey_pyramid_[0].size() == ref_depth_pyramid_[0].size()) {
+    ref_edge_pixels_.resize(kPyramidLevels);
+    for (size_t pyramid_lvl = 0; pyramid_lvl < kPyramidLevels; ++pyramid_lvl) {
+      const cv::Mat& edges = ref_grey_edges_[pyramid_lvl];
+      const cv::Mat& depth = ref_depth_pyramid_[pyramid_lvl];
+      std::vector<EdgePixel>& edge_pixels = ref_edge_pixels_[pyramid_lvl];
+      edge_pixels.clear();
+      edge_pixels.reserve(cv::countNonZero(edges));
+      for (int vv = 0; vv < edges.rows; ++vv) {
+        const unsigned char* edge_row = edges.ptr<unsigned char>(vv);
+        const float*         depth_row = depth.ptr<float>(vv);
+        for (int uu = 0; uu < edges.cols; ++uu) {
+          if (edge_row[uu] != 0 && depth_row[uu] == depth_row[uu]) {
+            edge_pixels.push_back({uu, vv, depth_row[uu]});
+          }
+        }
+      }
     }
+  } else {
+    ref_edge_pixels_.clear();
   }
 
+  // Cache pose independent data of reference points.
+  ref_points_.resize(kPyramidLevels);
+  for (size_t pyramid_lvl = 0; pyramid_lvl < kPyramidLevels; ++pyramid_lvl) {
+    PrepareKeyframe(pyramid_lvl);
+  }
 }
 
 #define DECIMATE 0
 
 void DTrack::ComputeGradient(uint pyramid_lvl) {
+  // Usually done while building the pyramid.
+  if (live_packed_valid_[pyramid_lvl]) {
+    return;
+  }
   const cv::Mat& live_grey_img = live_grey_pyramid_[pyramid_lvl];
+  cv::Mat& live_packed = live_packed_pyramid_[pyramid_lvl];
+  live_packed.create(live_grey_img.rows, live_grey_img.cols, CV_32FC4);
+  _CalculatePackedImage(
+        live_grey_img.data, live_grey_img.cols, live_grey_img.rows,
+        reinterpret_cast<float*>(live_packed.data));
+  live_packed_valid_[pyramid_lvl] = true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::_BuildGreyPyramid(
+    std::vector<cv::Mat>&     grey_pyramid,
+    std::vector<cv::Mat>&     packed_pyramid,
+    std::vector<bool>&        packed_valid,
+    bool                      pack
+    )
+{
+  // Each level is packed right after it is produced, while it is still in
+  // cache. Buffers are reused across frames.
+  for (size_t pyramid_lvl = 0; pyramid_lvl < kPyramidLevels; ++pyramid_lvl) {
+    const cv::Mat& grey_img = grey_pyramid[pyramid_lvl];
+    if (pyramid_lvl > 0) {
+      vid::HalfSampleGrey(grey_pyramid[pyramid_lvl-1],
+                          grey_pyramid[pyramid_lvl]);
+    }
+    packed_valid[pyramid_lvl] = pack;
+    if (pack) {
+      cv::Mat& packed_img = packed_pyramid[pyramid_lvl];
+      packed_img.create(grey_img.rows, grey_img.cols, CV_32FC4);
+      _CalculatePackedImage(grey_img.data, grey_img.cols, grey_img.rows,
+                            reinterpret_cast<float*>(packed_img.data));
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::_BuildDepthPyramid(const cv::Mat& depth)
+{
+  depth.copyTo(ref_depth_pyramid_[0]);
+  for (size_t pyramid_lvl = 1; pyramid_lvl < kPyramidLevels; ++pyramid_lvl) {
+    vid::HalfSampleDepth(ref_depth_pyramid_[pyramid_lvl-1],
+                         ref_depth_pyramid_[pyramid_lvl]);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::KeyframePoints::Clear()
+{
+  x.clear();      y.clear();      z.clear();
+  xd.clear();     yd.clear();     zd.clear();
+  Ir.clear();
+  dIr_x.clear();  dIr_y.clear();
+  dPd_x.clear();  dPd_y.clear();  dPd_z.clear();
+  Jdr.clear();
+  Jic.clear();
+  hessian.setZero();
+  hessian_pb.setZero();
+  hessian_bb.setZero();
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::KeyframePoints::Reserve(size_t num_points)
+{
+  x.reserve(num_points);      y.reserve(num_points);      z.reserve(num_points);
+  xd.reserve(num_points);     yd.reserve(num_points);     zd.reserve(num_points);
+  Ir.reserve(num_points);
+  dIr_x.reserve(num_points);  dIr_y.reserve(num_points);
+  dPd_x.reserve(num_points);  dPd_y.reserve(num_points);  dPd_z.reserve(num_points);
+  Jdr.reserve(num_points);
+  Jic.reserve(6*num_points);
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::KeyframePoints::Keep(const std::vector<size_t>& indices)
+{
+  std::vector<double>* fields[] = {
+    &x, &y, &z, &xd, &yd, &zd, &Ir, &dIr_x, &dIr_y,
+    &dPd_x, &dPd_y, &dPd_z, &Jdr };
+  for (std::vector<double>* field : fields) {
+    for (size_t ii = 0; ii < indices.size(); ++ii) {
+      (*field)[ii] = (*field)[indices[ii]];
+    }
+    field->resize(indices.size());
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Smallest grid cell, in pixels, used by budgeted point selection.
+static const int kSelectionCellSize = 16;
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::_SelectPoints(
+    const std::vector<int>&   pixels,
+    int                       image_width,
+    int                       image_height,
+    KeyframePoints&           points
+    )
+{
+  const size_t budget = options_.pixel_budget;
+  CHECK_EQ(pixels.size(), points.Size());
+
+  // Grow cells until there is at least one point of budget per cell.
+  int cell_size = kSelectionCellSize;
+  int cells_x, cells_y;
+  while (true) {
+    cells_x = (image_width + cell_size - 1) / cell_size;
+    cells_y = (image_height + cell_size - 1) / cell_size;
+    if (static_cast<size_t>(cells_x * cells_y) <= budget) {
+      break;
+    }
+    cell_size *= 2;
+  }
+  const size_t num_cells = cells_x * cells_y;
+  const size_t points_per_cell = budget / num_cells;
+
+  // Bucket points by cell (counting sort keeps row-major order in a cell).
+  std::vector<int>& cell_of = selection_.cell_of;
+  std::vector<size_t>& cell_start = selection_.cell_start;
+  cell_of.resize(points.Size());
+  cell_start.assign(num_cells+1, 0);
+  for (size_t ii = 0; ii < points.Size(); ++ii) {
+    const int uu = pixels[ii] % image_width;
+    const int vv = pixels[ii] / image_width;
+    cell_of[ii] = (vv / cell_size) * cells_x + (uu / cell_size);
+    cell_start[cell_of[ii]+1]++;
+  }
+  for (size_t cc = 0; cc < num_cells; ++cc) {
+    cell_start[cc+1] += cell_start[cc];
+  }
+  std::vector<size_t>& bucket = selection_.bucket;
+  std::vector<size_t>& fill = selection_.fill;
+  bucket.resize(points.Size());
+  fill.assign(cell_start.begin(), cell_start.end()-1);
+  for (size_t ii = 0; ii < points.Size(); ++ii) {
+    bucket[fill[cell_of[ii]]++] = ii;
+  }
+
+  auto stronger = [&points](size_t a, size_t b) {
+    return points.dIr_x[a]*points.dIr_x[a] + points.dIr_y[a]*points.dIr_y[a]
+        >  points.dIr_x[b]*points.dIr_x[b] + points.dIr_y[b]*points.dIr_y[b];
+  };
+
+  // Strongest gradients of each cell.
+  std::vector<char>& keep = selection_.keep;
+  keep.assign(points.Size(), 0);
+  size_t num_kept = 0;
+  for (size_t cc = 0; cc < num_cells; ++cc) {
+    const auto first = bucket.begin() + cell_start[cc];
+    const auto last  = bucket.begin() + cell_start[cc+1];
+    auto kept = last;
+    if (static_cast<size_t>(last - first) > points_per_cell) {
+      kept = first + points_per_cell;
+      std::nth_element(first, kept, last, stronger);
+    }
+    for (auto it = first; it != kept; ++it) {
+      keep[*it] = 1;
+    }
+    num_kept += kept - first;
+  }
+
+  // Sparse cells and the remainder of the division leave budget unused:
+  // spend it on the strongest gradients left over from any cell.
+  // The buckets are reused to hold them.
+  if (num_kept < budget) {
+    auto last = bucket.begin();
+    for (size_t ii = 0; ii < points.Size(); ++ii) {
+      if (!keep[ii]) {
+        *last++ = ii;
+      }
+    }
+    const auto kept = bucket.begin() + (budget - num_kept);
+    std::nth_element(bucket.begin(), kept, last, stronger);
+    for (auto it = bucket.begin(); it != kept; ++it) {
+      keep[*it] = 1;
+    }
+  }
+
+  // Compact in original order so tiles remain bands of rows.
+  std::vector<size_t>& indices = selection_.indices;
+  indices.clear();
+  for (size_t ii = 0; ii < points.Size(); ++ii) {
+    if (keep[ii]) {
+      indices.push_back(ii);
+    }
+  }
+  points.Keep(indices);
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::PrepareKeyframe(uint pyramid_lvl)
+{
+  // Options.
+  const bool   discard_saturated = options_.discard_saturated;
+  const float  min_depth         = options_.min_depth;
+  const float  max_depth         = options_.max_depth;
+
   const cv::Mat& ref_grey_img  = ref_grey_pyramid_[pyramid_lvl];
+  const cv::Mat& ref_depth_img = ref_depth_pyramid_[pyramid_lvl];
+
+  const Eigen::Matrix3d& Krg = ref_grey_cam_model_[pyramid_lvl];
+  const Eigen::Matrix3d& Krd = ref_depth_cam_model_[pyramid_lvl];
+  const Eigen::Matrix3d  Krd_inv = Krd.inverse();
+  const Eigen::Matrix3d  Rgd = Tgd_.so3().matrix();
+
+  // Reference camera matrix used by the inverse compositional Jacobian.
+  const Eigen::Matrix3x4d KrgTgd = options_.optimize_wrt_depth_camera ?
+        Krg * Tgd_.matrix3x4() :
+        Krg * Sophus::SE3d().matrix3x4();
+
+  // Reference intensity and gradients. Already there if the keyframe was
+  // promoted from a live frame.
+  cv::Mat& ref_packed = ref_packed_pyramid_[pyramid_lvl];
+  if (!ref_packed_valid_[pyramid_lvl]) {
+    ref_packed.create(ref_grey_img.rows, ref_grey_img.cols, CV_32FC4);
+    _CalculatePackedImage(
+          ref_grey_img.data, ref_grey_img.cols, ref_grey_img.rows,
+          reinterpret_cast<float*>(ref_packed.data));
+    ref_packed_valid_[pyramid_lvl] = true;
+  }
+
+  KeyframePoints& points = ref_points_[pyramid_lvl];
+  points.Clear();
+  points.Reserve(ref_depth_img.rows * ref_depth_img.cols);
+
+  // Depth pixel of each point, only needed for budgeted selection.
+  std::vector<int>& pixels = selection_.pixels;
+  pixels.clear();
+
+  // Semi-dense on an aligned rig only needs to visit the edge pixels.
+  const bool use_edge_pixels =
+      options_.do_semi_dense_tracking && !ref_edge_pixels_.empty();
+
+  // Back-projects a depth pixel and stores it if it passes all checks.
+  auto add_point = [&](int uu, int vv, double depth) {
+    // Check if depth is NAN.
+    if (depth != depth) {
+      return;
+    }
+
+    if (depth < min_depth || depth > max_depth) {
+      return;
+    }
+
+    // 3d point in reference depth camera.
+    Eigen::Vector4d hPr_d;
+    hPr_d(0) = depth * (uu-Krd(0,2))/Krd(0,0);
+    hPr_d(1) = depth * (vv-Krd(1,2))/Krd(1,1);
+    hPr_d(2) = depth;
+    hPr_d(3) = 1;
+
+    // 3d point in reference grey camera (homogenized).
+    // If depth and grey cameras are aligned, Tgd_ = I4.
+    const Eigen::Vector4d hPr_g =
+        aligned_ ? hPr_d : Eigen::Vector4d(Tgd_.matrix() * hPr_d);
+
+    // Project to reference grey camera's image coordinate.
+    Eigen::Vector2d pr_g;
+    if (aligned_) {
+      pr_g << uu, vv;
+    } else {
+      pr_g(0) = (hPr_g(0)*Krg(0,0)/hPr_g(2)) + Krg(0,2);
+      pr_g(1) = (hPr_g(1)*Krg(1,1)/hPr_g(2)) + Krg(1,2);
+    }
+
+    // Check if point is out of bounds.
+    if (pr_g(0) < 2 || pr_g(0) >= ref_grey_img.cols-3
+       || pr_g(1) < 2 || pr_g(1) >= ref_grey_img.rows-3) {
+      return;
+    }
+
+    // For semi-dense: Check if point is not an edge.
+    if (options_.do_semi_dense_tracking && !use_edge_pixels) {
+      const double edge =
+          interp<unsigned char>(pr_g(0), pr_g(1),
+                                ref_grey_edges_[pyramid_lvl].data,
+                                ref_grey_edges_[pyramid_lvl].cols,
+                                ref_grey_edges_[pyramid_lvl].rows);
+      if (edge == 0) {
+        return;
+      }
+    }
+
+    // Get intensity and image derivative.
+    const Eigen::Vector3d Ir_dIr =
+        interp_packed(pr_g(0), pr_g(1),
+                      reinterpret_cast<float*>(ref_packed.data),
+                      ref_packed.cols);
+    const double Ir = Ir_dIr(0);
+
+    // Discard under/over-saturated pixels.
+    if (discard_saturated) {
+      if (Ir == 0.0 || Ir == 255.0) {
+        return;
+      }
+    }
+
+    const Eigen::Matrix<double, 1, 2> dIr = Ir_dIr.tail<2>().transpose();
+
+    ///-------------------- Depth Derivative
+    // Derivative of the grey camera point wrt depth:
+    // dPd = Tgd * dPinv * Kdinv * pr_d
+    Eigen::Vector3d hpr_d;
+    hpr_d << uu, vv, 1;
+    const Eigen::Vector3d dPd = Rgd * Krd_inv * hpr_d;
+
+    // Depth derivative on reference image.
+    // Projection & dehomogenization derivative.
+    Eigen::Vector3d KrPr = Krg * hPr_g.head(3);
+
+    Eigen::Matrix<double, 2, 3> dPr;
+    dPr << 1.0/KrPr(2), 0, -KrPr(0)/(KrPr(2)*KrPr(2)),
+        0, 1.0/KrPr(2), -KrPr(1)/(KrPr(2)*KrPr(2));
+
+    // Jdr = dIr * dPr * Kr * Tgd * dPinv * Kdinv * pr_d
+    // Zero if aligned, since then Kr * dPd is parallel to KrPr.
+    const double Jdr = aligned_ ? 0.0 : double(dIr * dPr * Krg * dPd);
+
+    // Store point.
+    points.x.push_back(hPr_g(0));
+    points.y.push_back(hPr_g(1));
+    points.z.push_back(hPr_g(2));
+    points.xd.push_back(hPr_d(0));
+    points.yd.push_back(hPr_d(1));
+    points.zd.push_back(hPr_d(2));
+    points.Ir.push_back(Ir);
+    points.dIr_x.push_back(dIr(0));
+    points.dIr_y.push_back(dIr(1));
+    points.dPd_x.push_back(dPd(0));
+    points.dPd_y.push_back(dPd(1));
+    points.dPd_z.push_back(dPd(2));
+    points.Jdr.push_back(Jdr);
+
+    if (options_.pixel_budget > 0) {
+      pixels.push_back(vv*ref_depth_img.cols + uu);
+    }
+  };
+
+  if (use_edge_pixels) {
+    for (const EdgePixel& edge_pixel : ref_edge_pixels_[pyramid_lvl]) {
+      add_point(edge_pixel.u, edge_pixel.v, edge_pixel.depth);
+    }
+  } else {
+    for (int vv = 0; vv < ref_depth_img.rows; ++vv) {
+      for (int uu = 0; uu < ref_depth_img.cols; ++uu) {
+        add_point(uu, vv, ref_depth_img.at<float>(vv, uu));
+      }
+    }
+  }
+
+  // Keep the strongest gradients of each grid cell if over budget.
+  if (options_.pixel_budget > 0 && points.Size() > options_.pixel_budget) {
+    _SelectPoints(pixels, ref_depth_img.cols, ref_depth_img.rows, points);
+  }
+
+  ///-------------------- Inverse Compositional
+  if (options_.use_inverse_compositional) {
+    points.Jic.resize(6*points.Size());
+    for (size_t ii = 0; ii < points.Size(); ++ii) {
+      const Eigen::Vector3d Pr_g(points.x[ii], points.y[ii], points.z[ii]);
+      const Eigen::Matrix<double, 1, 2> dIr(points.dIr_x[ii], points.dIr_y[ii]);
+
+      // Projection & dehomogenization derivative.
+      const Eigen::Vector3d KrPr = Krg * Pr_g;
+
+      Eigen::Matrix<double, 2, 3> dPr;
+      dPr << 1.0/KrPr(2), 0, -KrPr(0)/(KrPr(2)*KrPr(2)),
+          0, 1.0/KrPr(2), -KrPr(1)/(KrPr(2)*KrPr(2));
+
+      const Eigen::Vector4d dIr_dPr_KrgTgd = dIr*dPr*KrgTgd;
+
+      // Point the pose derivative is taken at.
+      const Eigen::Vector3d Pr = options_.optimize_wrt_depth_camera ?
+            Eigen::Vector3d(points.xd[ii], points.yd[ii], points.zd[ii]) : Pr_g;
+
+      // J = dIr_dPr_KrgTgd * gen_i * Pr
+      Eigen::Map<Eigen::Vector6d> J(&points.Jic[6*ii]);
+      J << dIr_dPr_KrgTgd(0),
+           dIr_dPr_KrgTgd(1),
+           dIr_dPr_KrgTgd(2),
+          -dIr_dPr_KrgTgd(1)*Pr(2) + dIr_dPr_KrgTgd(2)*Pr(1),
+          +dIr_dPr_KrgTgd(0)*Pr(2) - dIr_dPr_KrgTgd(2)*Pr(0),
+          -dIr_dPr_KrgTgd(0)*Pr(1) + dIr_dPr_KrgTgd(1)*Pr(0);
+
+      // The depth uncertainty term depends on the live gradient, so only
+      // the grey sigma is used to keep the Hessian pose independent.
+      points.hessian += J * J.transpose() / (kGreySigma*kGreySigma);
+
+      // Brightness Jacobian is constant too.
+      if (options_.estimate_brightness) {
+        const Eigen::Vector2d Jb(-points.Ir[ii], -1);
+        points.hessian_pb += J * Jb.transpose() / (kGreySigma*kGreySigma);
+        points.hessian_bb += Jb * Jb.transpose() / (kGreySigma*kGreySigma);
+      }
+    }
+  }
+
+  // Single precision copy for SIMD and float kernels.
+  if (kernel_ != kKernelScalar) {
+    const size_t kPad = dtrack_simd::kPadding;
+    const size_t stride = ((points.Size() + kPad - 1) / kPad) * kPad;
+    points.simd_stride = stride;
+    points.simd_data.assign(dtrack_simd::kNumFields * stride, 0.0f);
+
+    const std::vector<double>* fields[dtrack_simd::kNumFields] = {
+      &points.x, &points.y, &points.z, &points.xd, &points.yd, &points.zd,
+      &points.Ir, &points.dIr_x, &points.dIr_y,
+      &points.dPd_x, &points.dPd_y, &points.dPd_z, &points.Jdr };
+    for (int ff = 0; ff < dtrack_simd::kNumFields; ++ff) {
+      std::copy(fields[ff]->begin(), fields[ff]->end(),
+                points.simd_data.begin() + ff*stride);
+    }
+  } else {
+    points.simd_data.clear();
+    points.simd_stride = 0;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Reference points per BuildProblem tile. Points are stored row by row, so
+/// each tile is a band of image rows. Multiple of the SIMD padding.
+static const size_t kTileSize = 2048;
+static_assert(kTileSize % dtrack_simd::kPadding == 0,
+              "Tiles must be aligned to the SIMD padding.");
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::Accumulator::SetZero()
+{
+  LHS.setZero();
+  RHS.setZero();
+  LHS_pb.setZero();
+  LHS_bb.setZero();
+  RHS_b.setZero();
+  squared_error = 0;
+  num_obs       = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+template<typename Task>
+void DTrack::_ParallelFor(
+    size_t                                num_tasks,
+    const Task&                           task
+    ) {
+#ifdef VIDTRACK_USE_TBB
+  if (tbb_arena_) {
+    tbb_arena_->execute([&] {
+      tbb::parallel_for(static_cast<size_t>(0), num_tasks, task);
+    });
+    return;
+  }
+#else
+  if (thread_pool_) {
+    thread_pool_->ParallelFor(num_tasks, task);
+    return;
+  }
+#endif
+  for (size_t ii = 0; ii < num_tasks; ++ii) {
+    task(ii);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::BuildProblem(
+    const Sophus::SE3d& Tlr,
+    Eigen::Matrix6d&    LHS,
+    Eigen::Vector6d&    RHS,
+    double&             squared_error,
+    double&             number_observations,
+    uint                pyramid_lvl
+    ) {
+  Accumulator problem;
+  _BuildProblem(Tlr, pyramid_lvl, problem);
+  LHS                 += problem.LHS;
+  RHS                 += problem.RHS;
+  squared_error       += problem.squared_error;
+  number_observations += problem.num_obs;
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::_BuildProblem(
+    const Sophus::SE3d& Tlr,
+    uint                pyramid_lvl,
+    Accumulator&        problem
+    ) {
+  const KeyframePoints& points = ref_points_[pyramid_lvl];
+
+  if (options_.use_inverse_compositional) {
+    CHECK_EQ(points.Jic.size(), 6*points.Size())
+        << "Keyframe was not prepared for inverse compositional mode.";
+  } else {
+    CHECK(live_packed_valid_[pyramid_lvl]);
+    if (kernel_ != kKernelScalar) {
+      CHECK_EQ(points.simd_data.size(),
+               dtrack_simd::kNumFields*points.simd_stride)
+          << "Keyframe was not prepared for single precision kernels.";
+    }
+  }
+
+  const size_t num_tiles = (points.Size() + kTileSize - 1) / kTileSize;
+  tile_accumulators_.resize(num_tiles);
+
+  _ParallelFor(num_tiles, [&](size_t tile) {
+    const size_t begin = tile * kTileSize;
+    const size_t end   = std::min(begin + kTileSize, points.Size());
+    Accumulator& acc   = tile_accumulators_[tile];
+    acc.SetZero();
+    if (options_.use_inverse_compositional) {
+      _BuildProblemIC(Tlr, pyramid_lvl, begin, end, acc);
+    } else if (kernel_ == kKernelScalar) {
+      if (aligned_) {
+        _BuildProblemESM<double, true>(Tlr, pyramid_lvl, begin, end, acc);
+      } else {
+        _BuildProblemESM<double, false>(Tlr, pyramid_lvl, begin, end, acc);
+      }
+    } else if (kernel_ == kKernelFloat) {
+      if (aligned_) {
+        _BuildProblemESM<float, true>(Tlr, pyramid_lvl, begin, end, acc);
+      } else {
+        _BuildProblemESM<float, false>(Tlr, pyramid_lvl, begin, end, acc);
+      }
+    } else {
+      _BuildProblemSIMD(Tlr, pyramid_lvl, begin, end, acc);
+    }
+  });
+
+  problem.SetZero();
+
+  // Inverse compositional starts from the keyframe Hessian, with the pose
+  // Jacobians scaled by the gain; tiles only hold the points rejected at
+  // this pose.
+  if (options_.use_inverse_compositional) {
+    problem.LHS    += gain_ * gain_ * points.hessian;
+    problem.LHS_pb += gain_ * points.hessian_pb;
+    problem.LHS_bb += points.hessian_bb;
+  }
+
+  // Reduce in tile order so the sum does not depend on scheduling.
+  for (const Accumulator& acc : tile_accumulators_) {
+    problem.LHS           += acc.LHS;
+    problem.RHS           += acc.RHS;
+    problem.squared_error += acc.squared_error;
+    problem.num_obs       += acc.num_obs;
+    if (options_.estimate_brightness) {
+      problem.LHS_pb      += acc.LHS_pb;
+      problem.LHS_bb      += acc.LHS_bb;
+      problem.RHS_b       += acc.RHS_b;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+template<typename Scalar, bool kAligned>
+void DTrack::_BuildProblemESM(
+    const Sophus::SE3d& Tlr,
+    uint                pyramid_lvl,
+    size_t              begin,
+    size_t              end,
+    Accumulator&        acc
+    ) {
+  typedef Eigen::Matrix<Scalar, 1, 2> Vector2T;
+  typedef Eigen::Matrix<Scalar, 3, 1> Vector3T;
+  typedef Eigen::Matrix<Scalar, 4, 1> Vector4T;
+  typedef Eigen::Matrix<Scalar, 3, 4> Matrix3x4T;
+
+  // Options.
+  const bool   discard_saturated = options_.discard_saturated;
+  const double norm_c            = options_.norm_param;
+
+  // Set pyramid norm parameter.
+  const Scalar norm_c_pyr = norm_c * (pyramid_lvl + 1);
+
+  const cv::Mat& live_grey_img = live_grey_pyramid_[pyramid_lvl];
+
+  const Eigen::Matrix3d& Klg_d = ref_grey_cam_model_[pyramid_lvl];
+  const Eigen::Matrix<Scalar, 3, 3> Klg = Klg_d.cast<Scalar>();
+
+  const KeyframePoints& points = ref_points_[pyramid_lvl];
+  const Scalar* Pr_x  = point_field<Scalar>(points, dtrack_simd::kX);
+  const Scalar* Pr_y  = point_field<Scalar>(points, dtrack_simd::kY);
+  const Scalar* Pr_z  = point_field<Scalar>(points, dtrack_simd::kZ);
+  const Scalar* Prd_x = point_field<Scalar>(points, dtrack_simd::kXd);
+  const Scalar* Prd_y = point_field<Scalar>(points, dtrack_simd::kYd);
+  const Scalar* Prd_z = point_field<Scalar>(points, dtrack_simd::kZd);
+  const Scalar* Ir    = point_field<Scalar>(points, dtrack_simd::kIr);
+  const Scalar* dIr_x = point_field<Scalar>(points, dtrack_simd::kdIrX);
+  const Scalar* dIr_y = point_field<Scalar>(points, dtrack_simd::kdIrY);
+  const Scalar* dPd_x = point_field<Scalar>(points, dtrack_simd::kdPdX);
+  const Scalar* dPd_y = point_field<Scalar>(points, dtrack_simd::kdPdY);
+  const Scalar* dPd_z = point_field<Scalar>(points, dtrack_simd::kdPdZ);
+  const Scalar* Jdr   = point_field<Scalar>(points, dtrack_simd::kJdr);
+
+  // Inverse transform.
+  const Matrix3x4T KlgTlr = options_.optimize_wrt_depth_camera ?
+        (Klg_d * (Tgd_ * Tlr).matrix3x4()).cast<Scalar>() :
+        (Klg_d * Tlr.matrix3x4()).cast<Scalar>();
+  const Matrix3x4T Tlr3x4 = Tlr.matrix3x4().cast<Scalar>();
+  const Vector3T   KlgTlr_t = KlgTlr.col(3);
+
+  const Scalar depth_sigma = kDepthSigma;
+  const Scalar grey_sigma2 = kGreySigma*kGreySigma;
+
+  // Affine brightness of the live image. Exact no-op if not estimated.
+  const Scalar gain = gain_;
+  const Scalar bias = bias_;
+
+  const cv::Mat& live_packed_img = live_packed_pyramid_[pyramid_lvl];
+  const float* live_packed =
+      reinterpret_cast<const float*>(live_packed_img.data);
+
+  for (size_t ii = begin; ii < end; ++ii) {
+    // 3d point in reference grey camera.
+    const Vector4T hPr_g(Pr_x[ii], Pr_y[ii], Pr_z[ii], 1);
+
+    // 3d point in live grey camera.
+    const Vector3T Pl_g = Tlr3x4 * hPr_g;
+
+    // Discard points behind the live camera.
+    if (!(Pl_g(2) > 0)) {
+      continue;
+    }
+
+    // Project to live grey camera's image coordinate.
+    Eigen::Matrix<Scalar, 2, 1> pl_g;
+    pl_g(0) = (Pl_g(0)*Klg(0,0)/Pl_g(2)) + Klg(0,2);
+    pl_g(1) = (Pl_g(1)*Klg(1,1)/Pl_g(2)) + Klg(1,2);
+
+    // Check if point is out of bounds (written so NaN is out too).
+    if (!(pl_g(0) >= 2 && pl_g(0) < live_grey_img.cols-3
+          && pl_g(1) >= 2 && pl_g(1) < live_grey_img.rows-3)) {
+      continue;
+    }
+
+    // Get intensities and live image derivative in one fetch.
+    const Vector3T Il_dIl =
+        interp_packed(pl_g(0), pl_g(1), live_packed, live_packed_img.cols);
+    const Scalar Il = Il_dIl(0);
+
+    // Discard under/over-saturated pixels.
+    if (discard_saturated) {
+      if (Il == 0 || Il == 255) {
+        continue;
+      }
+    }
+
+    // Calculate error.
+    const Scalar y = Il-(gain*Ir[ii]+bias);
+
+
+    ///-------------------- Forward Compositional
+    // Image derivative.
+    const Vector2T dIl = Il_dIl.template tail<2>().transpose();
+
+
+    ///-------------------- Inverse Compositional
+    // Image derivative.
+    Vector2T dIr;
+    dIr << gain*dIr_x[ii], gain*dIr_y[ii];
+
+
+    // Projection & dehomogenization derivative.
+    Vector3T KlPl = Klg * Pl_g;
+
+    Eigen::Matrix<Scalar, 2, 3> dPl;
+    dPl  << 1/KlPl(2), 0, -KlPl(0)/(KlPl(2)*KlPl(2)),
+        0, 1/KlPl(2), -KlPl(1)/(KlPl(2)*KlPl(2));
+
+    const Vector4T dIesm_dPl_KlgTlr = ((dIl+dIr)/2)*dPl*KlgTlr;
+
+    // J = dIesm_dPl_KlgTlr * gen_i * Pr
+    Eigen::Matrix<Scalar, 1, 6> J;
+    if (options_.optimize_wrt_depth_camera && !kAligned) {
+      J << dIesm_dPl_KlgTlr(0),
+           dIesm_dPl_KlgTlr(1),
+           dIesm_dPl_KlgTlr(2),
+          -dIesm_dPl_KlgTlr(1)*Prd_z[ii] + dIesm_dPl_KlgTlr(2)*Prd_y[ii],
+          +dIesm_dPl_KlgTlr(0)*Prd_z[ii] - dIesm_dPl_KlgTlr(2)*Prd_x[ii],
+          -dIesm_dPl_KlgTlr(0)*Prd_y[ii] + dIesm_dPl_KlgTlr(1)*Prd_x[ii];
+    } else {
+      J << dIesm_dPl_KlgTlr(0),
+           dIesm_dPl_KlgTlr(1),
+           dIesm_dPl_KlgTlr(2),
+          -dIesm_dPl_KlgTlr(1)*hPr_g(2) + dIesm_dPl_KlgTlr(2)*hPr_g(1),
+          +dIesm_dPl_KlgTlr(0)*hPr_g(2) - dIesm_dPl_KlgTlr(2)*hPr_g(0),
+          -dIesm_dPl_KlgTlr(0)*hPr_g(1) + dIesm_dPl_KlgTlr(1)*hPr_g(0);
+    }
+
+
+    ///-------------------- Depth Derivative
+    Scalar Jd;
+    if (kAligned) {
+      // dPd = Pr/depth and dPl * KlPl = 0, so only the translation part of
+      // KlgTlr is left. Jdr vanishes the same way on the reference image.
+      Jd = -(dIl * dPl * KlgTlr_t)(0) / hPr_g(2);
+    } else {
+      // Depth derivative on live image.
+      // Jdl = dIl * dPl * Kl * Tlr * Tgd * dPinv * Kdinv * pr_d
+      const Vector3T dPd(dPd_x[ii], dPd_y[ii], dPd_z[ii]);
+      const Scalar Jdl =
+          dIl * dPl * KlgTlr.template block<3,3>(0,0) * dPd;
+
+      // Final depth Jacobian: Jd = Jdl - Jdr
+      Jd = Jdl - Jdr[ii];
+    }
+    if (Jd == 0) {
+      Jd = FLT_MIN;
+    }
+
+
+    ///-------------------- Robust Norm
+    const Scalar w = _NormTukey(y, norm_c_pyr);
+
+    // Uncertainties.
+//          const double depth_sigma = depth/20.0;
+
+    // Error prop: NewSigma = J * Sigma * J_transpose
+    const Scalar depth_unc = Jd * (depth_sigma*depth_sigma) * Jd;
+
+    // Try gradient as uncertainty. Makes more sense for ELAS.
+    // Do finite differences on edge pixel to test all the way.
+    const Scalar inv_sigma = 1/(grey_sigma2+depth_unc);
+//          const double inv_sigma = 1.0/(kGreySigma*kGreySigma);
+//          const double inv_sigma = 1.0;
+
+    // Summed in double whatever the per-point precision.
+    acc.LHS           += (J.transpose() * w * inv_sigma * J).template cast<double>();
+    acc.RHS           += (J.transpose() * w * inv_sigma * y).template cast<double>();
+    acc.squared_error += y * y;
+    acc.num_obs++;
+
+    ///-------------------- Brightness
+    if (options_.estimate_brightness) {
+      const Vector2T Jb(-Ir[ii], -1);
+      acc.LHS_pb += (J.transpose() * w * inv_sigma * Jb).template cast<double>();
+      acc.LHS_bb += (Jb.transpose() * w * inv_sigma * Jb).template cast<double>();
+      acc.RHS_b  += (Jb.transpose() * w * inv_sigma * y).template cast<double>();
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////
+void DTrack::_BuildProblemSIMD(
+    const Sophus::SE3d& Tlr,
+    uint                pyramid_lvl,
+    size_t              begin,
+    size_t              end,
+    Accumulator&        acc
+    ) {
+  const cv::Mat& live_grey_img = live_grey_pyramid_[pyramid_lvl];
+
+  const Eigen::Matrix3d& Klg = ref_grey_cam_model_[pyramid_lvl];
+
+  const KeyframePoints& points = ref_points_[pyramid_lvl];
+
+  // Inverse transform.
+  const Eigen::Matrix3x4d KlgTlr = options_.optimize_wrt_depth_camera ?
+        Klg * (Tgd_ * Tlr).matrix3x4() :
+        Klg * Tlr.matrix3x4();
+  const Eigen::Matrix3x4d Tlr3x4 = Tlr.matrix3x4();
+
+  dtrack_simd::Params params;
+  for (int rr = 0; rr < 3; ++rr) {
+    for (int cc = 0; cc < 4; ++cc) {
+      params.Tlr[4*rr+cc]    = Tlr3x4(rr, cc);
+      params.KlgTlr[4*rr+cc] = KlgTlr(rr, cc);
+    }
+  }
+  params.fx                 = Klg(0,0);
+  params.fy                 = Klg(1,1);
+  params.cx                 = Klg(0,2);
+  params.cy                 = Klg(1,2);
+  params.live_packed        =
+      reinterpret_cast<float*>(live_packed_pyramid_[pyramid_lvl].data);
+  params.width              = live_grey_img.cols;
+  params.height             = live_grey_img.rows;
+  params.norm_c             = options_.norm_param * (pyramid_lvl + 1);
+  params.grey_sigma2        = kGreySigma*kGreySigma;
+  params.depth_sigma2       = kDepthSigma*kDepthSigma;
+  params.discard_saturated  = options_.discard_saturated;
+  params.aligned            = aligned_;
+  params.brightness         = options_.estimate_brightness;
+  params.gain               = gain_;
+  params.bias               = bias_;
+
+  // Tiles start at a multiple of the padding, so the padded tail of the
+  // buffer still covers the last step of the kernel.
+  const float* data = points.simd_data.data() + begin;
+  const size_t stride = points.simd_stride;
+  dtrack_simd::Points soa;
+  soa.x     = data + dtrack_simd::kX*stride;
+  soa.y     = data + dtrack_simd::kY*stride;
+  soa.z     = data + dtrack_simd::kZ*stride;
+  if (options_.optimize_wrt_depth_camera && !aligned_) {
+    soa.gx  = data + dtrack_simd::kXd*stride;
+    soa.gy  = data + dtrack_simd::kYd*stride;
+    soa.gz  = data + dtrack_simd::kZd*stride;
+  } else {
+    soa.gx  = soa.x;
+    soa.gy  = soa.y;
+    soa.gz  = soa.z;
+  }
+  soa.Ir    = data + dtrack_simd::kIr*stride;
+  soa.dIr_x = data + dtrack_simd::kdIrX*stride;
+  soa.dIr_y = data + dtrack_simd::kdIrY*stride;
+  soa.dPd_x = data + dtrack_simd::kdPdX*stride;
+  soa.dPd_y = data + dtrack_simd::kdPdY*stride;
+  soa.dPd_z = data + dtrack_simd::kdPdZ*stride;
+  soa.Jdr   = data + dtrack_simd::kJdr*stride;
+  soa.size  = end - begin;
+
+  dtrack_simd::Result result;
+  dtrack_simd::BuildProblem(
+        static_cast<dtrack_simd::Isa>(kernel_ - kKernelSSE4 + 1),
+        soa, params, result);
+
+  // Unpack upper triangle.
+  int kk = 0;
+  for (int rr = 0; rr < 6; ++rr) {
+    for (int cc = rr; cc < 6; ++cc) {
+      acc.LHS(rr, cc) += result.LHS[kk];
+      if (cc != rr) {
+        acc.LHS(cc, rr) += result.LHS[kk];
+      }
+      ++kk;
+    }
+    acc.RHS(rr) += result.RHS[rr];
+  }
+  acc.squared_error += result.squared_error;
+  acc.num_obs       += result.num_obs;
 
-  // Pre-calculate gradients so we don't do it each iteration.
-  gradient_x_live_.create(live_grey_img.rows, live_grey_img.cols, CV_32FC1);
-  gradient_y_live_.create(live_grey_img.rows, live_grey_img.cols, CV_32FC1);
-  gradient_x_ref_.create(ref_grey_img.rows, ref_grey_img.cols, CV_32FC1);
-  gradient_y_ref_.create(ref_grey_img.rows, ref_grey_img.cols, CV_32FC1);
-  _CalculateGradients(
-        live_grey_img.data, live_grey_img.cols, live_grey_img.rows,
-        reinterpret_cast<float*>(gradient_x_live_.data),
-        reinterpret_cast<float*>(gradient_y_live_.data));
-  _CalculateGradients(
-        ref_grey_img.data, ref_grey_img.cols, ref_grey_img.rows,
-        reinterpret_cast<float*>(gradient_x_ref_.data),
-        reinterpret_cast<float*>(gradient_y_ref_.data));
+  if (options_.estimate_brightness) {
+    for (int rr = 0; rr < 6; ++rr) {
+      acc.LHS_pb(rr, 0) += result.LHS_pb[2*rr];
+      acc.LHS_pb(rr, 1) += result.LHS_pb[2*rr+1];
+    }
+    acc.LHS_bb(0, 0) += result.LHS_bb[0];
+    acc.LHS_bb(0, 1) += result.LHS_bb[1];
+    acc.LHS_bb(1, 0) += result.LHS_bb[1];
+    acc.LHS_bb(1, 1) += result.LHS_bb[2];
+    acc.RHS_b(0)     += result.RHS_b[0];
+    acc.RHS_b(1)     += result.RHS_b[1];
+  }
 }
 
-void DTrack::BuildProblem(
+///////////////////////////////////////////////////////////////////////////
+void DTrack::_BuildProblemIC(
     const Sophus::SE3d& Tlr,
-    Eigen::Matrix6d&    LHS,
-    Eigen::Vector6d&    RHS,
-    double&             squared_error,
-    double&             number_observations,
-    uint                pyramid_lvl
+    uint                pyramid_lvl,
+    size_t              begin,
+    size_t              end,
+    Accumulator&        acc
     ) {
   // Options.
-  const bool   discard_saturated = FLAGS_discard_saturated;
-  const float  min_depth         = FLAGS_min_depth;
-  const float  max_depth         = FLAGS_max_depth;
-  const double norm_c            = FLAGS_norm_param;
+  const bool   discard_saturated = options_.discard_saturated;
+  const double norm_c            = options_.norm_param;
 
   // Set pyramid norm parameter.
   const double norm_c_pyr = norm_c * (pyramid_lvl + 1);
 
   const cv::Mat& live_grey_img = live_grey_pyramid_[pyramid_lvl];
-  const cv::Mat& ref_grey_img  = ref_grey_pyramid_[pyramid_lvl];
-  const cv::Mat& ref_depth_img = ref_depth_pyramid_[pyramid_lvl];
 
   const Eigen::Matrix3d& Klg = ref_grey_cam_model_[pyramid_lvl];
-  const Eigen::Matrix3d& Krg = ref_grey_cam_model_[pyramid_lvl];
-  const Eigen::Matrix3d& Krd = ref_depth_cam_model_[pyramid_lvl];
 
-  CHECK_EQ(gradient_x_live_.rows, live_grey_img.rows);
-
-  // Inverse transform.
-  const Eigen::Matrix3x4d KlgTlr = options_.optimize_wrt_depth_camera ?
-        Klg * (Tgd_ * Tlr).matrix3x4() :
-        Klg * Tlr.matrix3x4();
+  const KeyframePoints& points = ref_points_[pyramid_lvl];
 
-  for (int vv = 0; vv < ref_depth_img.rows; ++vv) {
-    for (int uu = 0; uu < ref_depth_img.cols; ++uu) {
+  const double inv_sigma = 1.0/(kGreySigma*kGreySigma);
 
-      // 2d point in reference depth camera.
-      Eigen::Vector2d pr_d;
-      pr_d << uu, vv;
+  const Eigen::Matrix3x4d Tlr3x4 = Tlr.matrix3x4();
 
-      // Get depth.
-      const double depth = ref_depth_img.at<float>(vv, uu);
+  // Affine brightness of the live image. Exact no-op if not estimated.
+  const double gain = gain_;
+  const double bias = bias_;
 
-      // Check if depth is NAN.
-      if (depth != depth) {
-        continue;
+  // The keyframe Hessian is added by the caller; remove rejected points.
+  for (size_t ii = begin; ii < end; ++ii) {
+    // The residual is Il - (gain*Ir + bias), so the reference gradient
+    // is scaled by the gain.
+    const Eigen::Vector6d J =
+        gain * Eigen::Map<const Eigen::Vector6d>(&points.Jic[6*ii]);
+    const Eigen::Vector2d Jb(-points.Ir[ii], -1);
+    auto reject = [&]() {
+      acc.LHS -= J * J.transpose() * inv_sigma;
+      if (options_.estimate_brightness) {
+        acc.LHS_pb -= J * Jb.transpose() * inv_sigma;
+        acc.LHS_bb -= Jb * Jb.transpose() * inv_sigma;
       }
+    };
 
-      if (depth < min_depth || depth > max_depth) {
-        continue;
-      }
+    // 3d point in live grey camera.
+    const Eigen::Vector3d Pl_g =
+        Tlr3x4 * Eigen::Vector4d(points.x[ii], points.y[ii], points.z[ii], 1);
 
-      // 3d point in reference depth camera.
-      Eigen::Vector4d hPr_d;
-      hPr_d(0) = depth * (pr_d(0)-Krd(0,2))/Krd(0,0);
-      hPr_d(1) = depth * (pr_d(1)-Krd(1,2))/Krd(1,1);
-      hPr_d(2) = depth;
-      hPr_d(3) = 1;
+    // Discard points behind the live camera.
+    if (!(Pl_g(2) > 0)) {
+      reject();
+      continue;
+    }
 
-      // 3d point in reference grey camera (homogenized).
-      // If depth and grey cameras are aligned, Tgd_ = I4.
-      const Eigen::Vector4d hPr_g = Tgd_.matrix() * hPr_d;
+    // Project to live grey camera's image coordinate.
+    Eigen::Vector2d pl_g;
+    pl_g(0) = (Pl_g(0)*Klg(0,0)/Pl_g(2)) + Klg(0,2);
+    pl_g(1) = (Pl_g(1)*Klg(1,1)/Pl_g(2)) + Klg(1,2);
 
-      // Project to reference grey camera's image coordinate.
-      Eigen::Vector2d pr_g;
-      pr_g(0) = (hPr_g(0)*Krg(0,0)/hPr_g(2)) + Krg(0,2);
-      pr_g(1) = (hPr_g(1)*Krg(1,1)/hPr_g(2)) + Krg(1,2);
+    // Check if point is out of bounds (written so NaN is out too).
+    if (!(pl_g(0) >= 2 && pl_g(0) < live_grey_img.cols-3
+          && pl_g(1) >= 2 && pl_g(1) < live_grey_img.rows-3)) {
+      reject();
+      continue;
+    }
 
-      // Check if point is out of bounds.
-      if (pr_g(0) < 2 || pr_g(0) >= ref_grey_img.cols-3
-         || pr_g(1) < 2 || pr_g(1) >= ref_grey_img.rows-3) {
+    // Get intensities.
+    const double Il =
+        interp<unsigned char>(pl_g(0), pl_g(1), live_grey_img.data,
+                              live_grey_img.cols, live_grey_img.rows);
+
+    // Discard under/over-saturated pixels.
+    if (discard_saturated) {
+      if (Il == 0.0 || Il == 255.0) {
+        reject();
         continue;
       }
+    }
 
-      // For semi-dense: Check if point is not an edge.
-      if (FLAGS_semi_dense) {
-        const double edge =
-            interp<unsigned char>(pr_g(0), pr_g(1),
-                                  ref_grey_edges_[pyramid_lvl].data,
-                                  ref_grey_edges_[pyramid_lvl].cols,
-                                  ref_grey_edges_[pyramid_lvl].rows);
-        if (edge == 0) {
-          continue;
-        }
-      }
+    // Calculate error.
+    const double y = Il-(gain*points.Ir[ii]+bias);
+
+    ///-------------------- Robust Norm
+    // Only the RHS is weighted. The LHS is the keyframe Hessian and is left
+    // unweighted on purpose, as in classic inverse compositional:
+    // reweighting it would cost a rank one update per point, which is the
+    // work the precomputed Hessian saves.
+    const double w = _NormTukey(y, norm_c_pyr);
+
+    acc.RHS           += J * w * inv_sigma * y;
+    if (options_.estimate_brightness) {
+      acc.RHS_b       += Jb * w * inv_sigma * y;
+    }
+    acc.squared_error += y * y;
+    acc.num_obs++;
+  }
+}
 
-      // Homogenized 3d point in live grey camera.
-      const Eigen::Vector4d hPl_g = Tlr.matrix() * hPr_g;
+///////////////////////////////////////////////////////////////////////////
+template<bool kAligned>
+void DTrack::_BuildHypothesesESM(
+    uint                pyramid_lvl,
+    size_t              begin,
+    size_t              end,
+    Accumulator*        accs
+    ) {
+  const size_t kBlock = kHypothesisBlock;
 
-      // Project to live grey camera's image coordinate.
-      Eigen::Vector2d pl_g;
-      pl_g(0) = (hPl_g(0)*Klg(0,0)/hPl_g(2)) + Klg(0,2);
-      pl_g(1) = (hPl_g(1)*Klg(1,1)/hPl_g(2)) + Klg(1,2);
+  // Options.
+  const bool   discard_saturated = options_.discard_saturated;
+  const double norm_c            = options_.norm_param;
 
-      // Check if point is out of bounds.
-      if (pl_g(0) < 2 || pl_g(0) >= live_grey_img.cols-3
-         || pl_g(1) < 2 || pl_g(1) >= live_grey_img.rows-3) {
-        continue;
+  // Set pyramid norm parameter.
+  const double norm_c_pyr = norm_c * (pyramid_lvl + 1);
+
+  const HypothesisBatch& batch = hypothesis_batch_;
+  const size_t stride = batch.stride;
+  const int    live_width  = batch.live_width;
+  const int    live_height = batch.live_height;
+
+  const Eigen::Matrix3d& Klg = ref_grey_cam_model_[pyramid_lvl];
+  const double fu = Klg(0,0);
+  const double fv = Klg(1,1);
+  const double cu = Klg(0,2);
+  const double cv = Klg(1,2);
+
+  const KeyframePoints& points = ref_points_[pyramid_lvl];
+
+  const double depth_sigma = kDepthSigma;
+  const double grey_sigma2 = kGreySigma*kGreySigma;
+
+  // Warp of the current point by one block of hypotheses.
+  double Pl_x[kHypothesisBlock], Pl_y[kHypothesisBlock], Pl_z[kHypothesisBlock];
+  double pl_u[kHypothesisBlock], pl_v[kHypothesisBlock];
+
+  for (size_t ii = begin; ii < end; ++ii) {
+    // 3d point in reference grey camera, loaded once for all hypotheses.
+    const double Pr_x = points.x[ii];
+    const double Pr_y = points.y[ii];
+    const double Pr_z = points.z[ii];
+    const double Ir   = points.Ir[ii];
+    const Eigen::Matrix<double, 1, 2> dIr(points.dIr_x[ii], points.dIr_y[ii]);
+
+    for (size_t k0 = 0; k0 < batch.size; k0 += kBlock) {
+      const double* T = batch.Tlr.data() + k0;
+
+      // 3d point in live grey camera and its projection. Same arithmetic
+      // for the whole block, so the compiler vectorizes across hypotheses.
+      // Padding lanes are zero and never read back.
+      for (size_t kk = 0; kk < kBlock; ++kk) {
+        Pl_x[kk] = T[0*stride+kk]*Pr_x + T[1*stride+kk]*Pr_y
+            + T[2*stride+kk]*Pr_z + T[3*stride+kk];
+        Pl_y[kk] = T[4*stride+kk]*Pr_x + T[5*stride+kk]*Pr_y
+            + T[6*stride+kk]*Pr_z + T[7*stride+kk];
+        Pl_z[kk] = T[8*stride+kk]*Pr_x + T[9*stride+kk]*Pr_y
+            + T[10*stride+kk]*Pr_z + T[11*stride+kk];
+        pl_u[kk] = (Pl_x[kk]*fu/Pl_z[kk]) + cu;
+        pl_v[kk] = (Pl_y[kk]*fv/Pl_z[kk]) + cv;
       }
 
-      // Get intensities.
-      const double Il =
-          interp<unsigned char>(pl_g(0), pl_g(1), live_grey_img.data,
-                                live_grey_img.cols, live_grey_img.rows);
-      const double Ir =
-          interp<unsigned char>(pr_g(0), pr_g(1), ref_grey_img.data,
-                                ref_grey_img.cols, ref_grey_img.rows);
-
-      // Discard under/over-saturated pixels.
-      if (discard_saturated) {
-        if (Il == 0.0 || Il == 255.0 || Ir == 0.0 || Ir == 255.0) {
+      const size_t block_end = batch.size - k0 < kBlock ?
+            batch.size - k0 : kBlock;
+      for (size_t kk = 0; kk < block_end; ++kk) {
+        // Check if point is behind the camera or out of bounds (NaN is out).
+        if (!(Pl_z[kk] > 0 && pl_u[kk] >= 2 && pl_u[kk] < live_width-3
+              && pl_v[kk] >= 2 && pl_v[kk] < live_height-3)) {
           continue;
         }
-      }
 
-      // Calculate error.
-      const double y = Il-Ir;
+        // Get intensities and live image derivative in one fetch.
+        const Eigen::Vector3d Il_dIl = interp_packed(
+              pl_u[kk], pl_v[kk], batch.live_packed[k0+kk], live_width);
+        const double Il = Il_dIl(0);
 
+        // Discard under/over-saturated pixels.
+        if (discard_saturated) {
+          if (Il == 0 || Il == 255) {
+            continue;
+          }
+        }
 
-      ///-------------------- Forward Compositional
-      // Image derivative.
-      Eigen::Matrix<double, 1, 2> dIl;
-      dIl(0) = interp<float>(pl_g(0), pl_g(1),
-                             reinterpret_cast<float*>(gradient_x_live_.data),
-                             gradient_x_live_.cols, gradient_x_live_.rows);
-      dIl(1) = interp<float>(pl_g(0), pl_g(1),
-                             reinterpret_cast<float*>(gradient_y_live_.data),
-                             gradient_y_live_.cols, gradient_y_live_.rows);
-
+        // Calculate error.
+        const double y = Il-Ir;
 
-      ///-------------------- Inverse Compositional
-      // Image derivative.
-      Eigen::Matrix<double, 1, 2> dIr;
-      dIr(0) = interp<float>(pr_g(0), pr_g(1),
-                             reinterpret_cast<float*>(gradient_x_ref_.data),
-                             gradient_x_ref_.cols, gradient_x_ref_.rows);
-      dIr(1) = interp<float>(pr_g(0), pr_g(1),
-                             reinterpret_cast<float*>(gradient_y_ref_.data),
-                             gradient_y_ref_.cols, gradient_y_ref_.rows);
+        // ESM image derivative.
+        const Eigen::Matrix<double, 1, 2> dIl = Il_dIl.tail<2>().transpose();
 
+        // Projection & dehomogenization derivative.
+        const Eigen::Vector3d Pl_g(Pl_x[kk], Pl_y[kk], Pl_z[kk]);
+        const Eigen::Vector3d KlPl = Klg * Pl_g;
 
-      // Projection & dehomogenization derivative.
-      Eigen::Vector3d KlPl = Klg * hPl_g.head(3);
+        Eigen::Matrix<double, 2, 3> dPl;
+        dPl  << 1/KlPl(2), 0, -KlPl(0)/(KlPl(2)*KlPl(2)),
+            0, 1/KlPl(2), -KlPl(1)/(KlPl(2)*KlPl(2));
 
-      Eigen::Matrix2x3d dPl;
-      dPl  << 1.0/KlPl(2), 0, -KlPl(0)/(KlPl(2)*KlPl(2)),
-          0, 1.0/KlPl(2), -KlPl(1)/(KlPl(2)*KlPl(2));
+        const Eigen::Matrix3x4d& KlgTlr = batch.KlgTlr[k0+kk];
+        const Eigen::Vector4d dIesm_dPl_KlgTlr = ((dIl+dIr)/2)*dPl*KlgTlr;
 
-      const Eigen::Vector4d dIesm_dPl_KlgTlr = ((dIl+dIr)/2.0)*dPl*KlgTlr;
+        // Point the pose derivative is taken at.
+        double Px = Pr_x, Py = Pr_y, Pz = Pr_z;
+        if (options_.optimize_wrt_depth_camera && !kAligned) {
+          Px = points.xd[ii];
+          Py = points.yd[ii];
+          Pz = points.zd[ii];
+        }
 
-      // J = dIesm_dPl_KlgTlr * gen_i * Pr
-      Eigen::Matrix<double, 1, 6> J;
-      if (options_.optimize_wrt_depth_camera) {
+        // J = dIesm_dPl_KlgTlr * gen_i * Pr
+        Eigen::Matrix<double, 1, 6> J;
         J << dIesm_dPl_KlgTlr(0),
              dIesm_dPl_KlgTlr(1),
              dIesm_dPl_KlgTlr(2),
-            -dIesm_dPl_KlgTlr(1)*hPr_d(2) + dIesm_dPl_KlgTlr(2)*hPr_d(1),
-            +dIesm_dPl_KlgTlr(0)*hPr_d(2) - dIesm_dPl_KlgTlr(2)*hPr_d(0),
-            -dIesm_dPl_KlgTlr(0)*hPr_d(1) + dIesm_dPl_KlgTlr(1)*hPr_d(0);
-      } else {
-        J << dIesm_dPl_KlgTlr(0),
-             dIesm_dPl_KlgTlr(1),
-             dIesm_dPl_KlgTlr(2),
-            -dIesm_dPl_KlgTlr(1)*hPr_g(2) + dIesm_dPl_KlgTlr(2)*hPr_g(1),
-            +dIesm_dPl_KlgTlr(0)*hPr_g(2) - dIesm_dPl_KlgTlr(2)*hPr_g(0),
-            -dIesm_dPl_KlgTlr(0)*hPr_g(1) + dIesm_dPl_KlgTlr(1)*hPr_g(0);
-      }
-
-
-      ///-------------------- Depth Derivative
-      // Homogenization derivative.
-      Eigen::Matrix<double, 4, 3> dPinv4;
-      dPinv4 << 1, 0, 0,
-                0, 1, 0,
-                0, 0, 1,
-                0, 0, 0;
-
-      // Homogenized depth pixel.
-      Eigen::Vector3d hpr_d;
-      hpr_d << pr_d(0), pr_d(1), 1;
-
-      // Depth derivative on live image.
-      // Jdl = dIl * dPl * Kl * Tlr * Tgd * dPinv * Kdinv * pr_d
-      const double Jdl = dIl * dPl * KlgTlr * Tgd_.matrix() * dPinv4
-                             * Krd.inverse() * hpr_d;
-
-      // Depth derivative on reference image.
-      // Projection & dehomogenization derivative.
-      Eigen::Vector3d KrPr = Krg * hPr_g.head(3);
-
-      Eigen::Matrix<double, 2, 3> dPr;
-      dPr << 1.0/KrPr(2), 0, -KrPr(0)/(KrPr(2)*KrPr(2)),
-          0, 1.0/KrPr(2), -KrPr(1)/(KrPr(2)*KrPr(2));
-
-      // Jdr = dIr * dPr * Kr * Tgd * dPinv * Kdinv * pr_d
-      const double Jdr = dIr * dPr * Krg * Tgd_.matrix3x4() * dPinv4
-                         * Krd.inverse() * hpr_d;
-
-
-      if (dIl(0) != 0 && dIl(1) != 0 && uu == 10 && vv == 10 && false) {
-        std::cout << "----------------------------" << std::endl;
-        std::cout << "Jd-a: " << Jdl - Jdr << std::endl;
-        Eigen::Vector2d tmp = dPl * KlgTlr * Tgd_.matrix() * dPinv4
-                              * Krd.inverse() * hpr_d;
-//        std::cout << "Jd-a Pix: " << tmp.transpose() << std::endl;
-
-        double epsilon = 1e-6;
-
-        // Get depth.
-        const double depthf = depth + epsilon;
-        const double depthb = depth - epsilon;
-
-        // 3d point in reference depth camera.
-        Eigen::Vector4d hPr_df;
-        hPr_df(0) = depthf * (pr_d(0)-Krd(0,2))/Krd(0,0);
-        hPr_df(1) = depthf * (pr_d(1)-Krd(1,2))/Krd(1,1);
-        hPr_df(2) = depthf;
-        hPr_df(3) = 1;
-        Eigen::Vector4d hPr_db;
-        hPr_db(0) = depthb * (pr_d(0)-Krd(0,2))/Krd(0,0);
-        hPr_db(1) = depthb * (pr_d(1)-Krd(1,2))/Krd(1,1);
-        hPr_db(2) = depthb;
-        hPr_db(3) = 1;
-
-        // 3d point in reference grey camera (homogenized).
-        // If depth and grey cameras are aligned, Tgd_ = I4.
-        const Eigen::Vector4d hPr_gf = Tgd_.matrix() * hPr_df;
-        const Eigen::Vector4d hPr_gb = Tgd_.matrix() * hPr_db;
-
-        // Project to reference grey camera's image coordinate.
-        Eigen::Vector2d pr_gf;
-        pr_gf(0) = (hPr_gf(0)*Krg(0,0)/hPr_gf(2)) + Krg(0,2);
-        pr_gf(1) = (hPr_gf(1)*Krg(1,1)/hPr_gf(2)) + Krg(1,2);
-        Eigen::Vector2d pr_gb;
-        pr_gb(0) = (hPr_gb(0)*Krg(0,0)/hPr_gb(2)) + Krg(0,2);
-        pr_gb(1) = (hPr_gb(1)*Krg(1,1)/hPr_gb(2)) + Krg(1,2);
-
-        // Homogenized 3d point in live grey camera.
-        const Eigen::Vector4d hPl_gf = Tlr.matrix() * hPr_gf;
-        const Eigen::Vector4d hPl_gb = Tlr.matrix() * hPr_gb;
-
-        // Project to live grey camera's image coordinate.
-        Eigen::Vector2d pl_gf;
-        pl_gf(0) = (hPl_gf(0)*Klg(0,0)/hPl_gf(2)) + Klg(0,2);
-        pl_gf(1) = (hPl_gf(1)*Klg(1,1)/hPl_gf(2)) + Klg(1,2);
-        Eigen::Vector2d pl_gb;
-        pl_gb(0) = (hPl_gb(0)*Klg(0,0)/hPl_gb(2)) + Klg(0,2);
-        pl_gb(1) = (hPl_gb(1)*Klg(1,1)/hPl_gb(2)) + Klg(1,2);
-
-        // Get intensities.
-        const double Ilf =
-            interp(pl_gf(0), pl_gf(1), live_grey_img.data,
-                   live_grey_img.cols, live_grey_img.rows);
-        const double Irf =
-            interp(pr_gf(0), pr_gf(1), ref_grey_img.data,
-                   ref_grey_img.cols, ref_grey_img.rows);
-        const double Ilb =
-            interp(pl_gb(0), pl_gb(1), live_grey_img.data,
-                   live_grey_img.cols, live_grey_img.rows);
-        const double Irb =
-            interp(pr_gb(0), pr_gb(1), ref_grey_img.data,
-                   ref_grey_img.cols, ref_grey_img.rows);
-
-
-        std::cout << "Jd-fd: " << ((Ilf-Irf) - (Ilb-Irb))/(depthf-depthb) << std::endl;
-//        std::cout << "Jd-fd Pix: " << ((pl_gf-pl_gb)/(depthf-depthb)).transpose() << std::endl;
-      }
-
+            -dIesm_dPl_KlgTlr(1)*Pz + dIesm_dPl_KlgTlr(2)*Py,
+            +dIesm_dPl_KlgTlr(0)*Pz - dIesm_dPl_KlgTlr(2)*Px,
+            -dIesm_dPl_KlgTlr(0)*Py + dIesm_dPl_KlgTlr(1)*Px;
+
+        // Depth derivative, as in _BuildProblemESM.
+        double Jd;
+        if (kAligned) {
+          Jd = -(dIl * dPl * KlgTlr.col(3))(0) / Pr_z;
+        } else {
+          const Eigen::Vector3d dPd(points.dPd_x[ii], points.dPd_y[ii],
+                                    points.dPd_z[ii]);
+          const double Jdl = dIl * dPl * KlgTlr.block<3,3>(0,0) * dPd;
+          Jd = Jdl - points.Jdr[ii];
+        }
+        if (Jd == 0) {
+          Jd = FLT_MIN;
+        }
 
-      // Final depth Jacobian: Jd = Jdl - Jdr
-      double Jd = Jdl - Jdr;
-      if (Jd == 0) {
-        Jd = FLT_MIN;
+        // Robust norm and uncertainties.
+        const double w = _NormTukey(y, norm_c_pyr);
+        const double depth_unc = Jd * (depth_sigma*depth_sigma) * Jd;
+        const double inv_sigma = 1/(grey_sigma2+depth_unc);
+
+        // Upper triangle only, mirrored once per tile.
+        Accumulator& acc = accs[k0+kk];
+        const Eigen::Matrix<double, 6, 1> wJ = J.transpose() * w * inv_sigma;
+        for (int cc = 0; cc < 6; ++cc) {
+          for (int rr = 0; rr <= cc; ++rr) {
+            acc.LHS(rr, cc) += wJ(rr) * J(cc);
+          }
+        }
+        acc.RHS           += wJ * y;
+        acc.squared_error += y * y;
+        acc.num_obs++;
       }
+    }
+  }
+}
 
+///////////////////////////////////////////////////////////////////////////
+void DTrack::_BuildHypothesisProblems(uint pyramid_lvl)
+{
+  const KeyframePoints& points = ref_points_[pyramid_lvl];
+  const HypothesisBatch& batch = hypothesis_batch_;
+
+  const size_t num_tiles = (points.Size() + kTileSize - 1) / kTileSize;
+  hypothesis_accumulators_.resize(num_tiles * batch.size);
+
+  _ParallelFor(num_tiles, [&](size_t tile) {
+    const size_t begin = tile * kTileSize;
+    const size_t end   = std::min(begin + kTileSize, points.Size());
+    Accumulator* accs  = &hypothesis_accumulators_[tile * batch.size];
+    for (size_t kk = 0; kk < batch.size; ++kk) {
+      accs[kk].SetZero();
+    }
+    if (aligned_) {
+      _BuildHypothesesESM<true>(pyramid_lvl, begin, end, accs);
+    } else {
+      _BuildHypothesesESM<false>(pyramid_lvl, begin, end, accs);
+    }
+    for (size_t kk = 0; kk < batch.size; ++kk) {
+      accs[kk].LHS.triangularView<Eigen::StrictlyLower>() =
+          accs[kk].LHS.transpose();
+    }
+  });
+
+  // Reduce in tile order so the sum does not depend on scheduling.
+  hypothesis_problems_.resize(batch.size);
+  for (size_t kk = 0; kk < batch.size; ++kk) {
+    Accumulator& problem = hypothesis_problems_[kk];
+    problem.SetZero();
+    for (size_t tile = 0; tile < num_tiles; ++tile) {
+      const Accumulator& acc = hypothesis_accumulators_[tile*batch.size + kk];
+      problem.LHS           += acc.LHS;
+      problem.RHS           += acc.RHS;
+      problem.squared_error += acc.squared_error;
+      problem.num_obs       += acc.num_obs;
+    }
+  }
+}
 
-      ///-------------------- Robust Norm
-      const double w = _NormTukey(y, norm_c_pyr);
-
-      // Uncertainties.
-//          const double depth_sigma = depth/20.0;
-      const double depth_sigma = kDepthSigma;
-
-      // Error prop: NewSigma = J * Sigma * J_transpose
-      const double depth_unc = Jd * (depth_sigma*depth_sigma) * Jd;
+///////////////////////////////////////////////////////////////////////////
+void DTrack::BuildPyramid(const cv::Mat& live_grey) {
+  cv::Mat& live_grey_img = live_grey_pyramid_[0];
+  live_grey.copyTo(live_grey_img);
+  if (!options_.estimate_brightness) {
+    _BrightnessCorrectionImagePair(live_grey_img.data,
+                                   ref_grey_pyramid_[0].data,
+                                   live_grey_img.cols * live_grey_img.rows);
+  }
 
-      // Try gradient as uncertainty. Makes more sense for ELAS.
-      // Do finite differences on edge pixel to test all the way.
-      const double inv_sigma = 1.0/((kGreySigma*kGreySigma)+depth_unc);
-//          const double inv_sigma = 1.0/(kGreySigma*kGreySigma);
-//          const double inv_sigma = 1.0;
+  // Gradients are only needed by ESM. Otherwise they are computed on demand,
+  // e.g. if the frame is promoted to keyframe.
+  _BuildGreyPyramid(live_grey_pyramid_, live_packed_pyramid_,
+                    live_packed_valid_, !options_.use_inverse_compositional);
+  has_live_frame_ = true;
+}
 
-      LHS           += J.transpose() * w * inv_sigma * J;
-      RHS           += J.transpose() * w * inv_sigma * y;
-      squared_error += y * y;
-      number_observations++;
+///////////////////////////////////////////////////////////////////////////
+void DTrack::_InitBrightness()
+{
+  // Coarsest level is a few thousand pixels, so this is cheap.
+  const cv::Mat& live_img = live_grey_pyramid_[kPyramidLevels-1];
+  const cv::Mat& ref_img  = ref_grey_pyramid_[kPyramidLevels-1];
+
+  double live_sum = 0, live_sum_sqrd = 0;
+  double ref_sum  = 0, ref_sum_sqrd  = 0;
+  for (int vv = 0; vv < live_img.rows; ++vv) {
+    const unsigned char* live_row = live_img.ptr<unsigned char>(vv);
+    for (int uu = 0; uu < live_img.cols; ++uu) {
+      live_sum      += live_row[uu];
+      live_sum_sqrd += live_row[uu] * live_row[uu];
+    }
+  }
+  for (int vv = 0; vv < ref_img.rows; ++vv) {
+    const unsigned char* ref_row = ref_img.ptr<unsigned char>(vv);
+    for (int uu = 0; uu < ref_img.cols; ++uu) {
+      ref_sum      += ref_row[uu];
+      ref_sum_sqrd += ref_row[uu] * ref_row[uu];
     }
   }
-}
 
-void DTrack::BuildPyramid(const cv::Mat& live_grey) {
-#if 1
-  cv::Mat live_grey_copy = live_grey.clone();
-  _BrightnessCorrectionImagePair(live_grey_copy.data,
-                                 ref_grey_pyramid_[0].data,
-                                 live_grey_copy.cols * live_grey_copy.rows);
-  cv::buildPyramid(live_grey_copy, live_grey_pyramid_, kPyramidLevels);
-#else
-  cv::buildPyramid(live_grey, live_grey_pyramid_, kPyramidLevels);
-#endif
+  const double live_num  = live_img.rows * live_img.cols;
+  const double ref_num   = ref_img.rows * ref_img.cols;
+  const double live_mean = live_sum / live_num;
+  const double ref_mean  = ref_sum / ref_num;
+  const double live_std  =
+      sqrt(std::max(live_sum_sqrd / live_num - live_mean*live_mean, 0.0));
+  const double ref_std   =
+      sqrt(std::max(ref_sum_sqrd / ref_num - ref_mean*ref_mean, 0.0));
+
+  // Live = gain * ref + bias. Flat images only get an offset.
+  gain_ = ref_std > 1e-3 ? live_std / ref_std : 1.0;
+  bias_ = live_mean - gain_ * ref_mean;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -948,16 +1543,18 @@ double DTrack::Estimate(
     const cv::Mat&            live_grey,
     Sophus::SE3d&             Trl,
     Eigen::Matrix6d&          covariance,
-    unsigned int&             num_obs
+    unsigned int&             num_obs,
+    EstimateReport*           report
   )
 {
-  // Reset output parameters.
-  num_obs = 0;
-  covariance.setZero();
-
-  // Set pyramid max-iterations and full estimate mask. The pyramid is
-  // constructed with the largest image first.
+  return Estimate(default_policies_[use_pyramid], live_grey, Trl, covariance,
+                  num_obs, report);
+}
 
+///////////////////////////////////////////////////////////////////////////
+DTrack::EstimatePolicy DTrack::DefaultPolicy(bool use_pyramid) const
+{
+  // The pyramid is constructed with the largest image first.
   // 0 is rotation only, 1 is both rotation and translation
   std::vector<bool>         vec_full_estimate  = {1, 1, 1, 0};
 #if DECIMATE
@@ -977,25 +1574,120 @@ double DTrack::Estimate(
   CHECK_GE(vec_full_estimate.size(), kPyramidLevels);
   CHECK_GE(vec_max_iterations.size(), kPyramidLevels);
 
+  EstimatePolicy policy;
+  policy.levels.resize(kPyramidLevels);
+  for (size_t ii = 0; ii < kPyramidLevels; ++ii) {
+    policy.levels[ii].max_iterations = vec_max_iterations[ii];
+    policy.levels[ii].full_estimate  = vec_full_estimate[ii];
+  }
+  return policy;
+}
+
+///////////////////////////////////////////////////////////////////////////
+double DTrack::Estimate(
+    const EstimatePolicy&     policy,
+    const cv::Mat&            live_grey,
+    Sophus::SE3d&             Trl,
+    Eigen::Matrix6d&          covariance,
+    unsigned int&             num_obs,
+    EstimateReport*           report
+  )
+{
+  typedef std::chrono::steady_clock Clock;
+  typedef std::chrono::duration<double> Seconds;
+
+  CHECK_EQ(policy.levels.size(), kPyramidLevels);
+
+  const Clock::time_point estimate_start = Clock::now();
+
+  // Reset output parameters.
+  num_obs = 0;
+  covariance.setZero();
+  if (report != nullptr) {
+    // Copied, not moved, so step_norms keeps its capacity.
+    const EstimateReport::Level empty_level;
+    report->levels.resize(kPyramidLevels);
+    for (EstimateReport::Level& level_report : report->levels) {
+      level_report = empty_level;
+    }
+    report->deadline_reached = false;
+  }
+
   // Build live pyramid.
   BuildPyramid(live_grey);
 
+  // Brightness starts from image statistics, or is fixed to identity.
+  if (options_.estimate_brightness) {
+    _InitBrightness();
+  } else {
+    gain_ = 1;
+    bias_ = 0;
+  }
+
+  if (report != nullptr) {
+    report->pyramid_time = Seconds(Clock::now() - estimate_start).count();
+  }
+
   // Aux variables.
+  Accumulator       problem;
   Eigen::Matrix6d   LHS;
   Eigen::Vector6d   RHS;
   double            squared_error;
   double            number_observations;
   double            last_error = FLT_MAX;
 
+  // Duration of the slowest iteration of the last level, and its points.
+  Clock::duration   iteration_time = Clock::duration::zero();
+  size_t            iteration_points = 0;
+  bool              deadline_reached = false;
+
   // Iterate through pyramid levels.
-  for (int pyramid_lvl = kPyramidLevels-1; pyramid_lvl >= 0; pyramid_lvl--) {
-    ComputeGradient(pyramid_lvl);
-    // Reset error.
-    last_error = FLT_MAX;
+  for (int pyramid_lvl = kPyramidLevels-1;
+       pyramid_lvl >= 0 && !deadline_reached; pyramid_lvl--) {
+    const LevelPolicy& level_policy = policy.levels[pyramid_lvl];
+    if (level_policy.max_iterations == 0) {
+      continue;
+    }
+
+    // Per level report, filled as the level runs.
+    EstimateReport::Level* level_report =
+        report != nullptr ? &report->levels[pyramid_lvl] : nullptr;
+    if (level_report != nullptr) {
+      // So a frame needing more iterations than the last does not allocate.
+      level_report->step_norms.reserve(level_policy.max_iterations);
+    }
+
+    // Live gradients are only needed by ESM.
+    if (!options_.use_inverse_compositional) {
+      const Clock::time_point gradient_start = Clock::now();
+      ComputeGradient(pyramid_lvl);
+      if (level_report != nullptr) {
+        level_report->gradient_time =
+            Seconds(Clock::now() - gradient_start).count();
+      }
+    }
+
+    // Predicted iteration cost scales with the number of points.
+    const size_t num_points = ref_points_[pyramid_lvl].Size();
+    if (iteration_points > 0) {
+      iteration_time = iteration_time * num_points / iteration_points;
+    }
+    iteration_points = num_points;
+
+    StopReason stop_reason = kStopMaxIterations;
+    double level_error = FLT_MAX;
+    unsigned int num_iters = 0;
+
+    for (; num_iters < level_policy.max_iterations; ++num_iters) {
+      const Clock::time_point iteration_start = Clock::now();
+      if (iteration_start + iteration_time > policy.deadline) {
+        VLOG(1) << "[@L:" << pyramid_lvl << " I:"
+                << num_iters << "] Out of time. Breaking early!";
+        stop_reason = kStopDeadline;
+        deadline_reached = true;
+        break;
+      }
 
-    for (unsigned int num_iters = 0;
-         num_iters < vec_max_iterations[pyramid_lvl];
-         ++num_iters) {
       // Reset.
       LHS.setZero();
       RHS.setZero();
@@ -1011,78 +1703,102 @@ double DTrack::Estimate(
       cu_dtrack_->Estimate(live_grey_img, ref_grey_img, ref_depth_img, Klg,
                            Krg, Krd, Tgd_.matrix(), Tlr.matrix(), KlgTlr,
                            norm_c_pyr, discard_saturated, min_depth, max_depth);
-#elif defined(VIDTRACK_USE_TBB)
-      // Launch TBB.
-      PoseRefine pose_ref(live_grey_img, ref_grey_img, ref_depth_img,
-                          gradient_x_live, gradient_y_live,
-                          gradient_x_ref, gradient_y_ref,
-                          Klg, Krg, Krd, Tgd_.matrix(),
-                          Tlr.matrix(), KlgTlr, kSigma, norm_c_pyr,
-                          discard_saturated, min_depth, max_depth);
-
-      tbb::parallel_reduce(tbb::blocked_range<size_t>(0,
-                    ref_depth_img.cols*ref_depth_img.rows), pose_ref);
-
-      LHS                  = pose_ref.LHS;
-      RHS                  = pose_ref.RHS;
-      squared_error        = pose_ref.error;
-      number_observations  = pose_ref.num_obs;
-      hessian              = pose_ref.hessian;
-
 #else
       // Iterate through depth map.
-      BuildProblem(Tlr, LHS, RHS, squared_error, number_observations,
-                   pyramid_lvl);
+      _BuildProblem(Tlr, pyramid_lvl, problem);
+      LHS                 = problem.LHS;
+      RHS                 = problem.RHS;
+      squared_error       = problem.squared_error;
+      number_observations = problem.num_obs;
 #endif
 
+      const Clock::time_point solve_start = Clock::now();
+      bool rank_deficient = false;
+
       Eigen::Matrix6d hessian = LHS;
 
       // Solution.
       Eigen::Vector6d X;
+      Eigen::Vector2d X_b = Eigen::Vector2d::Zero();
+
+      // The brightness block is singular if the points seen have no
+      // intensity spread (e.g. a blank wall); pose is then solved alone.
+      bool solve_brightness = false;
+      Eigen::LDLT<Eigen::Matrix2d> ldlt_bb;
+      if (options_.estimate_brightness) {
+        ldlt_bb.compute(problem.LHS_bb);
+        const Eigen::Vector2d D = ldlt_bb.vectorD();
+        solve_brightness = ldlt_bb.info() == Eigen::Success
+            && D.minCoeff() > DBL_EPSILON * D.maxCoeff();
+        LOG_IF(WARNING, !solve_brightness)
+            << "[@L:" << pyramid_lvl << " I:" << num_iters
+            << "] Brightness block singular. Solving pose only.";
+      }
 
       // Check if we are solving only for rotation, or full estimate.
-      if (vec_full_estimate[pyramid_lvl]) {
-        // Decompose matrix.
-        Eigen::FullPivLU<Eigen::Matrix<double, 6, 6> > lu_JTJ(LHS);
-
-        // Check degenerate system.
-        if (lu_JTJ.rank() < 6) {
-          LOG(WARNING) << "[@L:" << pyramid_lvl << " I:"
-                       << num_iters << "] LS trashed. Rank deficient!";
+      if (solve_brightness) {
+        // Pose and brightness solved together.
+        Eigen::Matrix<double, 8, 8> H;
+        H << LHS, problem.LHS_pb,
+             problem.LHS_pb.transpose(), problem.LHS_bb;
+        Eigen::Matrix<double, 8, 1> g;
+        g << RHS, problem.RHS_b;
+
+        // Pose covariance is the inverse of the Schur complement.
+        hessian -= problem.LHS_pb * ldlt_bb.solve(problem.LHS_pb.transpose());
+
+        // Rotation only: lock translation.
+        if (!level_policy.full_estimate) {
+          H.topRows<3>().setZero();
+          H.leftCols<3>().setZero();
+          H.topLeftCorner<3, 3>().setIdentity();
+          g.head<3>().setZero();
         }
 
-        X = -(lu_JTJ.solve(RHS));
-      } else {
-        // Extract rotation information only.
-        Eigen::Matrix3d rLHS = LHS.block<3, 3>(3, 3);
-        Eigen::Vector3d rRHS = RHS.tail(3);
-
-        Eigen::FullPivLU<Eigen::Matrix<double, 3, 3> > lu_JTJ(rLHS);
+        Eigen::FullPivLU<Eigen::Matrix<double, 8, 8> > lu_JTJ(H);
 
         // Check degenerate system.
-        if (lu_JTJ.rank() < 3) {
+        if (lu_JTJ.rank() < 8) {
           LOG(WARNING) << "[@L:" << pyramid_lvl << " I:"
                        << num_iters << "] LS trashed. Rank deficient!";
+          rank_deficient = true;
         }
 
-        Eigen::Vector3d rX;
-        rX = -(lu_JTJ.solve(rRHS));
-
-        // Pack solution.
-        X.setZero();
-        X.tail(3) = rX;
+        const Eigen::Matrix<double, 8, 1> X8 = -(lu_JTJ.solve(g));
+        X   = X8.head<6>();
+        X_b = X8.tail<2>();
+      } else {
+        X = _SolvePose(LHS, RHS, level_policy.full_estimate, pyramid_lvl,
+                       num_iters, rank_deficient);
       }
 
 //      std::cout << "-- LHS: " << std::endl << LHS << std::endl;
 //      std::cout << "-- RHS: " << RHS.transpose() << std::endl;
 //      std::cout << "-- Solved X: " << X.transpose() << std::endl;
 
+      // Slowest iteration so far, to stay on the safe side of the deadline.
+      iteration_time =
+          std::max<Clock::duration>(iteration_time, Clock::now() - iteration_start);
+
       // Get RMSE.
       const double new_error = sqrt(squared_error/number_observations);
 
-      if (new_error < last_error) {
+      if (level_report != nullptr) {
+        if (num_iters == 0) {
+          level_report->initial_error = new_error;
+        }
+        level_report->step_norms.push_back(X.norm());
+        level_report->rank_deficient += rank_deficient;
+        level_report->build_problem_time +=
+            Seconds(solve_start - iteration_start).count();
+      }
+
+      if (new_error < level_error) {
+        const double error_decrease =
+            (level_error - new_error) / level_error;
+
         // Update error.
-        last_error = new_error;
+        level_error = new_error;
 
         // Update number of observations used in estimation.
         num_obs = number_observations;
@@ -1093,23 +1809,318 @@ double DTrack::Estimate(
         // Update Trl.
         Trl = (Tlr*Sophus::SE3Group<double>::exp(X)).inverse();
 
-        if (X.norm() < 1e-5) {
+        // Update brightness.
+        gain_ += X_b(0);
+        bias_ += X_b(1);
+
+        if (level_report != nullptr) {
+          level_report->num_obs     = number_observations;
+          level_report->final_error = new_error;
+          level_report->solve_time +=
+              Seconds(Clock::now() - solve_start).count();
+        }
+
+        if (X.norm() < level_policy.min_update
+            || error_decrease < level_policy.min_error_decrease) {
           VLOG(1) << "[@L:" << pyramid_lvl << " I:"
                   << num_iters << "] Update is too small. Breaking early!";
+          stop_reason = kStopConverged;
+          ++num_iters;
           break;
         }
       } else {
+        if (level_report != nullptr) {
+          level_report->solve_time +=
+              Seconds(Clock::now() - solve_start).count();
+        }
         VLOG(1) << "[@L:" << pyramid_lvl << " I:"
                 << num_iters << "] Error is increasing. Breaking early!";
+        stop_reason = kStopErrorIncreased;
+        ++num_iters;
         break;
       }
     }
+
+    // Error of the finest level that ran.
+    if (num_iters > 0) {
+      last_error = level_error;
+    }
+
+    if (level_report != nullptr) {
+      level_report->iterations  = num_iters;
+      level_report->stop_reason = num_iters > 0 ? stop_reason : kStopNotRun;
+    }
+  }
+
+  if (report != nullptr) {
+    report->deadline_reached = deadline_reached;
+    report->gain             = gain_;
+    report->bias             = bias_;
+    report->total_time       = Seconds(Clock::now() - estimate_start).count();
   }
 
   return last_error;
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+void DTrack::EstimateHypotheses(
+    const EstimatePolicy&         policy,
+    const std::vector<cv::Mat>&   live_greys,
+    std::vector<Sophus::SE3d>&    Trls,
+    std::vector<double>&          errors,
+    std::vector<unsigned int>&    num_obs,
+    std::vector<Eigen::Matrix6d,
+        Eigen::aligned_allocator<Eigen::Matrix6d> >& covariances,
+    unsigned int                  max_survivors
+  )
+{
+  typedef std::chrono::steady_clock Clock;
+
+  const size_t num_hypotheses = Trls.size();
+  CHECK_EQ(policy.levels.size(), kPyramidLevels);
+  CHECK(live_greys.size() == 1 || live_greys.size() == num_hypotheses)
+      << "Expected one live image, or one per hypothesis.";
+
+  // Reset output parameters.
+  errors.assign(num_hypotheses, FLT_MAX);
+  num_obs.assign(num_hypotheses, 0);
+  covariances.assign(num_hypotheses, Eigen::Matrix6d::Zero());
+  if (num_hypotheses == 0) {
+    return;
+  }
+
+  // Build live pyramids. Levels are packed once a hypothesis that uses them
+  // gets there. Buffers are kept for the next call.
+  if (hypothesis_images_.size() < live_greys.size()) {
+    hypothesis_images_.resize(live_greys.size());
+  }
+  for (size_t ii = 0; ii < live_greys.size(); ++ii) {
+    CHECK(live_greys[ii].size() == live_greys[0].size())
+        << "Live images must have the same size.";
+    HypothesisImage& image = hypothesis_images_[ii];
+    image.grey_pyramid.resize(kPyramidLevels);
+    image.packed_pyramid.resize(kPyramidLevels);
+    image.packed_valid.resize(kPyramidLevels);
+
+    cv::Mat& live_grey_img = image.grey_pyramid[0];
+    live_greys[ii].copyTo(live_grey_img);
+    _BrightnessCorrectionImagePair(live_grey_img.data,
+                                   ref_grey_pyramid_[0].data,
+                                   live_grey_img.cols * live_grey_img.rows);
+    _BuildGreyPyramid(image.grey_pyramid, image.packed_pyramid,
+                      image.packed_valid, false);
+  }
+
+  // Hypotheses not pruned, those still iterating on the current level, and
+  // their state.
+  std::vector<size_t>   alive;
+  std::vector<size_t>   active;
+  std::vector<double>   level_errors(num_hypotheses);
+  alive.reserve(num_hypotheses);
+  active.reserve(num_hypotheses);
+  for (size_t kk = 0; kk < num_hypotheses; ++kk) {
+    alive.push_back(kk);
+  }
+  bool any_level_ran = false;
+
+  // Duration of the slowest iteration of the last level, and its points.
+  Clock::duration   iteration_time = Clock::duration::zero();
+  size_t            iteration_points = 0;
+  bool              deadline_reached = false;
+
+  // Iterate through pyramid levels.
+  for (int pyramid_lvl = kPyramidLevels-1;
+       pyramid_lvl >= 0 && !deadline_reached; pyramid_lvl--) {
+    const LevelPolicy& level_policy = policy.levels[pyramid_lvl];
+    if (level_policy.max_iterations == 0) {
+      continue;
+    }
+
+    // Predicted iteration cost scales with the number of points.
+    const size_t num_points = ref_points_[pyramid_lvl].Size();
+    if (iteration_points > 0) {
+      iteration_time = iteration_time * num_points / iteration_points;
+    }
+    iteration_points = num_points;
+
+    // Only the best hypotheses of the last level go on. Errors of pruned
+    // ones would come from a coarser level, so they are dropped.
+    if (max_survivors > 0 && any_level_ran && alive.size() > max_survivors) {
+      std::stable_sort(alive.begin(), alive.end(),
+                       [&errors](size_t lhs, size_t rhs) {
+        return errors[lhs] < errors[rhs];
+      });
+      for (size_t ii = max_survivors; ii < alive.size(); ++ii) {
+        errors[alive[ii]]  = FLT_MAX;
+        num_obs[alive[ii]] = 0;
+        covariances[alive[ii]].setZero();
+      }
+      alive.resize(max_survivors);
+      std::sort(alive.begin(), alive.end());
+    }
+
+    // Live gradients of the images still in use.
+    for (size_t kk : alive) {
+      HypothesisImage& image =
+          hypothesis_images_[live_greys.size() == 1 ? 0 : kk];
+      if (!image.packed_valid[pyramid_lvl]) {
+        const cv::Mat& grey_img = image.grey_pyramid[pyramid_lvl];
+        cv::Mat& packed_img = image.packed_pyramid[pyramid_lvl];
+        packed_img.create(grey_img.rows, grey_img.cols, CV_32FC4);
+        _CalculatePackedImage(grey_img.data, grey_img.cols, grey_img.rows,
+                              reinterpret_cast<float*>(packed_img.data));
+        image.packed_valid[pyramid_lvl] = true;
+      }
+    }
+
+    active = alive;
+    level_errors.assign(num_hypotheses, FLT_MAX);
+
+    const Eigen::Matrix3d& Klg = ref_grey_cam_model_[pyramid_lvl];
+    const cv::Mat& live_grey_img =
+        hypothesis_images_[0].grey_pyramid[pyramid_lvl];
+
+    unsigned int num_iters = 0;
+    for (; num_iters < level_policy.max_iterations && !active.empty();
+         ++num_iters) {
+      const Clock::time_point iteration_start = Clock::now();
+      if (iteration_start + iteration_time > policy.deadline) {
+        VLOG(1) << "[@L:" << pyramid_lvl << " I:"
+                << num_iters << "] Out of time. Breaking early!";
+        deadline_reached = true;
+        break;
+      }
+
+      // Pack the hypotheses still running.
+      HypothesisBatch& batch = hypothesis_batch_;
+      batch.size   = active.size();
+      batch.stride = ((batch.size + kHypothesisBlock - 1) / kHypothesisBlock)
+          * kHypothesisBlock;
+      batch.Tlr.assign(12 * batch.stride, 0.0);
+      batch.KlgTlr.resize(batch.size);
+      batch.live_packed.resize(batch.size);
+      batch.live_width  = live_grey_img.cols;
+      batch.live_height = live_grey_img.rows;
+      for (size_t aa = 0; aa < batch.size; ++aa) {
+        const size_t kk = active[aa];
+        const Sophus::SE3d Tlr = Trls[kk].inverse();
+        const Eigen::Matrix3x4d Tlr3x4 = Tlr.matrix3x4();
+        for (int cc = 0; cc < 12; ++cc) {
+          batch.Tlr[cc*batch.stride + aa] = Tlr3x4(cc/4, cc%4);
+        }
+        batch.KlgTlr[aa] = options_.optimize_wrt_depth_camera ?
+              Klg * (Tgd_ * Tlr).matrix3x4() : Klg * Tlr3x4;
+        const HypothesisImage& image =
+            hypothesis_images_[live_greys.size() == 1 ? 0 : kk];
+        batch.live_packed[aa] = reinterpret_cast<const float*>(
+              image.packed_pyramid[pyramid_lvl].data);
+      }
+
+      // One pass over the reference points for all of them.
+      _BuildHypothesisProblems(pyramid_lvl);
+
+      // Step each hypothesis as Estimate would, and keep those that go on.
+      size_t num_active = 0;
+      for (size_t aa = 0; aa < batch.size; ++aa) {
+        const size_t kk = active[aa];
+        const Accumulator& problem = hypothesis_problems_[aa];
+
+        bool rank_deficient;
+        const Eigen::Vector6d X = _SolvePose(problem.LHS, problem.RHS,
+                                             level_policy.full_estimate,
+                                             pyramid_lvl, num_iters,
+                                             rank_deficient);
+
+        // Get RMSE.
+        const double new_error = sqrt(problem.squared_error/problem.num_obs);
+
+        if (new_error < level_errors[kk]) {
+          const double error_decrease =
+              (level_errors[kk] - new_error) / level_errors[kk];
+
+          level_errors[kk] = new_error;
+          num_obs[kk]      = problem.num_obs;
+          covariances[kk]  = problem.LHS.inverse();
+          Trls[kk] = (Trls[kk].inverse()*Sophus::SE3Group<double>::exp(X))
+              .inverse();
+
+          if (X.norm() >= level_policy.min_update
+              && error_decrease >= level_policy.min_error_decrease) {
+            active[num_active++] = kk;
+          }
+        }
+      }
+      active.resize(num_active);
+
+      // Slowest iteration so far, to stay on the safe side of the deadline.
+      iteration_time =
+          std::max<Clock::duration>(iteration_time, Clock::now() - iteration_start);
+    }
+
+    // Errors of the finest level that ran. All hypotheses alive take part
+    // in the first iteration of a level.
+    if (num_iters > 0) {
+      for (size_t kk : alive) {
+        errors[kk] = level_errors[kk];
+      }
+      any_level_ran = true;
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+Eigen::Vector6d DTrack::_SolvePose(
+    const Eigen::Matrix6d&    LHS,
+    const Eigen::Vector6d&    RHS,
+    bool                      full_estimate,
+    int                       pyramid_lvl,
+    unsigned int              iteration,
+    bool&                     rank_deficient
+  )
+{
+  Eigen::Vector6d X;
+  rank_deficient = false;
+
+  // Check if we are solving only for rotation, or full estimate.
+  if (full_estimate) {
+    // Decompose matrix.
+    Eigen::FullPivLU<Eigen::Matrix<double, 6, 6> > lu_JTJ(LHS);
+
+    // Check degenerate system.
+    if (lu_JTJ.rank() < 6) {
+      LOG(WARNING) << "[@L:" << pyramid_lvl << " I:"
+                   << iteration << "] LS trashed. Rank deficient!";
+      rank_deficient = true;
+    }
+
+    X = -(lu_JTJ.solve(RHS));
+  } else {
+    // Extract rotation information only.
+    Eigen::Matrix3d rLHS = LHS.block<3, 3>(3, 3);
+    Eigen::Vector3d rRHS = RHS.tail(3);
+
+    Eigen::FullPivLU<Eigen::Matrix<double, 3, 3> > lu_JTJ(rLHS);
+
+    // Check degenerate system.
+    if (lu_JTJ.rank() < 3) {
+      LOG(WARNING) << "[@L:" << pyramid_lvl << " I:"
+                   << iteration << "] LS trashed. Rank deficient!";
+      rank_deficient = true;
+    }
+
+    Eigen::Vector3d rX;
+    rX = -(lu_JTJ.solve(rRHS));
+
+    // Pack solution.
+    X.setZero();
+    X.tail(3) = rX;
+  }
+  return X;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 Eigen::Matrix3d  DTrack::_ScaleCM(
     const Eigen::Matrix3d&    K,
@@ -1130,102 +2141,57 @@ Eigen::Matrix3d  DTrack::_ScaleCM(
 
 
 /////////////////////////////////////////////////////////////////////////////
-void DTrack::_CalculateGradients(
+void DTrack::_CalculatePackedImage(
     const unsigned char*      image_ptr,
     int                       image_width,
     int                       image_height,
-    float*                    gradX_ptr,
-    float*                    gradY_ptr
+    float*                    packed_ptr
   )
 {
-#if 0
-  for (int vv = 1; vv < image_height-1; ++vv) {
-    for (int uu = 1; uu < image_width-1; ++uu) {
-      unsigned char pix = image_ptr[uu + vv*image_width];
-      unsigned char pix_left = image_ptr[uu-1 + vv*image_width];
-      unsigned char pix_right = image_ptr[uu+1 + vv*image_width];
-      unsigned char pix_above = image_ptr[uu + (vv-1)*image_width];
-      unsigned char pix_below = image_ptr[uu + (vv+1)*image_width];
-//      gradX_ptr[uu + vv*image_width] = ((pix_right-pix)+(pix-pix_left))/2.0;
-//      gradY_ptr[uu + vv*image_width] = ((pix_below-pix)+(pix-pix_above))/2.0;
-      gradX_ptr[uu + vv*image_width] = ((pix_right-pix_left))/2.0;
-      gradY_ptr[uu + vv*image_width] = ((pix_below-pix_above))/2.0;
-    }
-  }
-#else
+  static const dtrack_simd::Isa isa = dtrack_simd::DetectIsa();
+
   const int image_width_M1  = image_width - 1;
   const int image_height_M1 = image_height - 1;
 
-  const unsigned char* row_ptr, *bottom_row_ptr, *top_row_ptr;
-
-  row_ptr         = image_ptr;
-  bottom_row_ptr  = image_ptr + image_width;
-  float* rowX_ptr = gradX_ptr;
-  float* rowY_ptr = gradY_ptr;
+  for (int vv = 0; vv < image_height; ++vv) {
+    const unsigned char* row_ptr = image_ptr + vv*image_width;
 
-  // Work on the first row.
-  rowX_ptr[0] = row_ptr[1] - row_ptr[0];
-  rowY_ptr[0] = bottom_row_ptr[0] - row_ptr[0];
-  for (int uu = 1; uu < image_width_M1; ++uu) {
-    rowX_ptr[uu] = (row_ptr[uu+1] - row_ptr[uu-1])/2.0;
-    rowY_ptr[uu] = bottom_row_ptr[uu] - row_ptr[uu];
-  }
-  rowX_ptr[image_width_M1] = row_ptr[image_width_M1] - row_ptr[image_width_M1-1];
-  rowY_ptr[image_width_M1] = bottom_row_ptr[image_width_M1] - row_ptr[image_width_M1];
+    // First and last rows use one sided differences.
+    const unsigned char* top_row_ptr =
+        (vv == 0) ? row_ptr : row_ptr - image_width;
+    const unsigned char* bottom_row_ptr =
+        (vv == image_height_M1) ? row_ptr : row_ptr + image_width;
+    const float scale_y = (vv == 0 || vv == image_height_M1) ? 1.0f : 0.5f;
 
-  row_ptr        = image_ptr + image_width;
-  bottom_row_ptr = image_ptr + 2*image_width;
-  top_row_ptr    = image_ptr;
-  rowX_ptr       = gradX_ptr + image_width;
-  rowY_ptr       = gradY_ptr + image_width;
+    float* out_ptr = packed_ptr + 4*vv*image_width;
 
-  // Work from the second to the "last-1" row.
-  for (int vv = 1; vv < image_height_M1; ++vv) {
     // First column.
-    *rowX_ptr++ = row_ptr[1] - row_ptr[0];
-    *rowY_ptr++ = (bottom_row_ptr[0] - top_row_ptr[0])/2.0;
-
-    for (int uu = 1; uu < image_width_M1; ++uu) {
-      *rowX_ptr++ = (row_ptr[uu+1] - row_ptr[uu-1])/2.0;
-      *rowY_ptr++ = (bottom_row_ptr[uu] - top_row_ptr[uu])/2.0;
+    out_ptr[0] = row_ptr[0];
+    out_ptr[1] = row_ptr[1] - row_ptr[0];
+    out_ptr[2] = scale_y * (bottom_row_ptr[0] - top_row_ptr[0]);
+    out_ptr[3] = 0;
+
+    // Bulk of the interior in SIMD, remainder below.
+    const int num_packed = dtrack_simd::PackRow(
+          isa, row_ptr+1, top_row_ptr+1, bottom_row_ptr+1, scale_y,
+          image_width-2, out_ptr+4);
+
+    for (int uu = 1+num_packed; uu < image_width_M1; ++uu) {
+      float* pixel_ptr = out_ptr + 4*uu;
+      pixel_ptr[0] = row_ptr[uu];
+      pixel_ptr[1] = 0.5f * (row_ptr[uu+1] - row_ptr[uu-1]);
+      pixel_ptr[2] = scale_y * (bottom_row_ptr[uu] - top_row_ptr[uu]);
+      pixel_ptr[3] = 0;
     }
 
     // Last column.
-    *rowX_ptr++ = row_ptr[image_width_M1] - row_ptr[image_width_M1-1];
-    *rowY_ptr++ = (bottom_row_ptr[image_width_M1] - top_row_ptr[image_width_M1])/2.0;
-
-    // Move to next rows.
-    row_ptr        += image_width;
-    bottom_row_ptr += image_width;
-    top_row_ptr    += image_width;
-  }
-
-  // Last row.
-  top_row_ptr  = image_ptr + (image_height_M1 - 1) * image_width;
-  row_ptr     = image_ptr + image_height_M1 * image_width;
-  rowX_ptr    = gradX_ptr + image_height_M1 * image_width;
-  rowY_ptr    = gradY_ptr + image_height_M1 * image_width;
-  rowX_ptr[0] = row_ptr[1] - row_ptr[0];
-  rowY_ptr[0] = row_ptr[0] - top_row_ptr[0];
-
-  for (int uu = 1; uu < image_width_M1; ++uu) {
-    rowX_ptr[uu] = (row_ptr[uu+1] - row_ptr[uu-1])/2.0;
-    rowY_ptr[uu] = row_ptr[uu] - top_row_ptr[uu];
+    float* pixel_ptr = out_ptr + 4*image_width_M1;
+    pixel_ptr[0] = row_ptr[image_width_M1];
+    pixel_ptr[1] = row_ptr[image_width_M1] - row_ptr[image_width_M1-1];
+    pixel_ptr[2] = scale_y * (bottom_row_ptr[image_width_M1]
+                              - top_row_ptr[image_width_M1]);
+    pixel_ptr[3] = 0;
   }
-  rowX_ptr[image_width_M1] = row_ptr[image_width_M1] - row_ptr[image_width_M1-1];
-  rowY_ptr[image_width_M1] = row_ptr[image_width_M1] - top_row_ptr[image_width_M1];
-#endif
-}
-
-
-///////////////////////////////////////////////////////////////////////////
-inline double DTrack::_NormTukey(double r,
-                                 double c)
-{
-  const double roc    = r/c;
-  const double omroc2 = 1.0f-roc*roc;
-
-  return (fabs(r) <= c) ? omroc2*omroc2 : 0.0f;
 }
 
 
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dtrack_simd.h"
+
+
+/////////////////////////////////////////////////////////////////////////////
+dtrack_simd::Isa dtrack_simd::DetectIsa()
+{
+#ifdef VIDTRACK_USE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return kIsaAVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return kIsaAVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return kIsaSSE4;
+  }
+#endif
+  return kIsaScalar;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void dtrack_simd::BuildProblem(
+    Isa             isa,
+    const Points&   points,
+    const Params&   params,
+    Result&         result
+  )
+{
+  switch (isa) {
+#ifdef VIDTRACK_USE_SIMD
+    case kIsaAVX512:
+      BuildProblemAVX512(points, params, result);
+      break;
+    case kIsaAVX2:
+      BuildProblemAVX2(points, params, result);
+      break;
+    case kIsaSSE4:
+      BuildProblemSSE4(points, params, result);
+      break;
+#endif
+    default:
+      // Callers run the double precision loop instead.
+      break;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+size_t dtrack_simd::PackRow(
+    Isa                   isa,
+    const unsigned char*  row,
+    const unsigned char*  top,
+    const unsigned char*  bottom,
+    float                 scale_y,
+    size_t                num_pixels,
+    float*                packed
+  )
+{
+  switch (isa) {
+#ifdef VIDTRACK_USE_SIMD
+    // Bound by the 16 byte per pixel stores; wider kernels are no faster.
+    case kIsaAVX512:
+    case kIsaAVX2:
+    case kIsaSSE4:
+      return PackRowSSE4(row, top, bottom, scale_y, num_pixels, packed);
+#endif
+    default:
+      return 0;
+  }
+}
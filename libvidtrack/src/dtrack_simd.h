@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include <vidtrack/config.h>
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Single precision SIMD kernels for the ESM loop of DTrack::BuildProblem
+/// and for packing images into interleaved {I, gx, gy, 0} pixels.
+/// Each instruction set lives in its own translation unit compiled with the
+/// matching flags. Only plain pointers cross this interface, so no inline
+/// Eigen/STL code is ever shared between units built for different CPUs.
+namespace dtrack_simd {
+
+/////////////////////////////////////////////////////////////////////////////
+enum Isa {
+  kIsaScalar = 0,
+  kIsaSSE4,
+  kIsaAVX2,
+  kIsaAVX512
+};
+
+/// Points per step of the widest kernel. Point arrays are padded to this.
+const size_t kPadding = 16;
+
+/// Fields of the padded single precision point buffer, in storage order.
+enum Field {
+  kX, kY, kZ,           // 3d point in reference grey camera.
+  kXd, kYd, kZd,        // 3d point in reference depth camera.
+  kIr,                  // Reference intensity.
+  kdIrX, kdIrY,         // Reference image gradient.
+  kdPdX, kdPdY, kdPdZ,  // Grey point derivative wrt depth.
+  kJdr,                 // Depth derivative on reference image.
+  kNumFields
+};
+
+/////////////////////////////////////////////////////////////////////////////
+struct Points {
+  const float*  x;      // Points warped into the live image.
+  const float*  y;
+  const float*  z;
+  const float*  gx;     // Points the pose derivative is taken at.
+  const float*  gy;
+  const float*  gz;
+  const float*  Ir;
+  const float*  dIr_x;
+  const float*  dIr_y;
+  const float*  dPd_x;
+  const float*  dPd_y;
+  const float*  dPd_z;
+  const float*  Jdr;
+  size_t        size;   // Number of valid points (arrays are padded).
+};
+
+/////////////////////////////////////////////////////////////////////////////
+struct Params {
+  float                 Tlr[12];      // Row major 3x4.
+  float                 KlgTlr[12];   // Row major 3x4.
+  float                 fx, fy, cx, cy;
+  const float*          live_packed;  // Interleaved {I, gx, gy, 0} pixels.
+  int                   width;
+  int                   height;
+  float                 norm_c;
+  float                 grey_sigma2;
+  float                 depth_sigma2;
+  bool                  discard_saturated;
+  bool                  aligned;      // Registered depth: dPd and Jdr unused.
+  bool                  brightness;   // Fill the brightness blocks of Result.
+  float                 gain;         // Live = gain * ref + bias.
+  float                 bias;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+struct Result {
+  double  LHS[21];      // Upper triangle, row major.
+  double  RHS[6];
+  double  squared_error;
+  double  num_obs;
+  double  LHS_pb[12];   // Pose-brightness block, row major 6x2.
+  double  LHS_bb[3];    // Brightness block upper triangle.
+  double  RHS_b[2];
+};
+
+/////////////////////////////////////////////////////////////////////////////
+/// Widest instruction set supported by both the build and the running CPU.
+Isa DetectIsa();
+
+/////////////////////////////////////////////////////////////////////////////
+/// Runs the kernel for the given instruction set. Result is overwritten.
+void BuildProblem(Isa isa, const Points& points, const Params& params,
+                  Result& result);
+
+/////////////////////////////////////////////////////////////////////////////
+/// Packs num_pixels interior pixels of a row into {I, gx, gy, 0} with
+/// central differences in x and scale_y * (bottom - top) in y. Pointers are
+/// at the first pixel, which must have a left neighbour. Only whole vectors
+/// are written; returns how many pixels were packed so the caller finishes
+/// the tail. Output is bit-identical to the scalar code.
+size_t PackRow(Isa isa, const unsigned char* row, const unsigned char* top,
+               const unsigned char* bottom, float scale_y, size_t num_pixels,
+               float* packed);
+
+#ifdef VIDTRACK_USE_SIMD
+void BuildProblemSSE4(const Points& points, const Params& params,
+                      Result& result);
+void BuildProblemAVX2(const Points& points, const Params& params,
+                      Result& result);
+void BuildProblemAVX512(const Points& points, const Params& params,
+                        Result& result);
+size_t PackRowSSE4(const unsigned char* row, const unsigned char* top,
+                   const unsigned char* bottom, float scale_y,
+                   size_t num_pixels, float* packed);
+#endif
+
+}  // namespace dtrack_simd
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compiled with -mavx2 -mfma.
+
+#include <immintrin.h>
+
+
+namespace {
+
+/////////////////////////////////////////////////////////////////////////////
+struct V {
+  typedef __m256  F;
+  typedef __m256i I;
+  typedef __m256  M;
+  static const int kWidth = 8;
+
+  static inline F Load(const float* p)  { return _mm256_loadu_ps(p); }
+  static inline void Store(float* p, F a) { _mm256_storeu_ps(p, a); }
+  static inline F Set1(float a)         { return _mm256_set1_ps(a); }
+  static inline F Zero()                { return _mm256_setzero_ps(); }
+  static inline F Lanes()     { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+  static inline F Add(F a, F b)         { return _mm256_add_ps(a, b); }
+  static inline F Sub(F a, F b)         { return _mm256_sub_ps(a, b); }
+  static inline F Mul(F a, F b)         { return _mm256_mul_ps(a, b); }
+  static inline F Div(F a, F b)         { return _mm256_div_ps(a, b); }
+  static inline F Min(F a, F b)         { return _mm256_min_ps(a, b); }
+  static inline F Max(F a, F b)         { return _mm256_max_ps(a, b); }
+  static inline F Fmadd(F a, F b, F c)  { return _mm256_fmadd_ps(a, b, c); }
+  static inline F Abs(F a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+  static inline M Lt(F a, F b)  { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  static inline M Le(F a, F b)  { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+  static inline M Ge(F a, F b)  { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+  static inline M Neq(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+  static inline M And(M a, M b)         { return _mm256_and_ps(a, b); }
+  static inline F Select(M m, F a)      { return _mm256_and_ps(m, a); }
+  static inline I Trunc(F a)            { return _mm256_cvttps_epi32(a); }
+  static inline F ToFloat(I a)          { return _mm256_cvtepi32_ps(a); }
+  static inline I Index(I row, I col, int width) {
+    return _mm256_add_epi32(_mm256_mullo_epi32(row, _mm256_set1_epi32(width)),
+                            col);
+  }
+  static inline void StoreIndex(int* p, I a) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), a);
+  }
+};
+
+}  // namespace
+
+#include "dtrack_simd_kernel.h"
+
+
+/////////////////////////////////////////////////////////////////////////////
+void dtrack_simd::BuildProblemAVX2(
+    const Points&   points,
+    const Params&   params,
+    Result&         result
+  )
+{
+  BuildProblemDispatch<V>(points, params, result);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compiled with -mavx512f.
+
+#include <immintrin.h>
+
+
+namespace {
+
+/////////////////////////////////////////////////////////////////////////////
+struct V {
+  typedef __m512    F;
+  typedef __m512i   I;
+  typedef __mmask16 M;
+  static const int kWidth = 16;
+
+  static inline F Load(const float* p)  { return _mm512_loadu_ps(p); }
+  static inline void Store(float* p, F a) { _mm512_storeu_ps(p, a); }
+  static inline F Set1(float a)         { return _mm512_set1_ps(a); }
+  static inline F Zero()                { return _mm512_setzero_ps(); }
+  static inline F Lanes() {
+    return _mm512_set_ps(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  }
+  static inline F Add(F a, F b)         { return _mm512_add_ps(a, b); }
+  static inline F Sub(F a, F b)         { return _mm512_sub_ps(a, b); }
+  static inline F Mul(F a, F b)         { return _mm512_mul_ps(a, b); }
+  static inline F Div(F a, F b)         { return _mm512_div_ps(a, b); }
+  // Min, Max, Trunc and ToFloat use the masked forms with every lane set.
+  // The plain ones pass _mm512_undefined_*() through, which GCC 12 falsely
+  // reports as maybe-uninitialized once inlined.
+  static inline F Min(F a, F b) { return _mm512_mask_min_ps(a, 0xFFFF, a, b); }
+  static inline F Max(F a, F b) { return _mm512_mask_max_ps(a, 0xFFFF, a, b); }
+  static inline F Fmadd(F a, F b, F c)  { return _mm512_fmadd_ps(a, b, c); }
+  static inline F Abs(F a)              { return _mm512_abs_ps(a); }
+  static inline M Lt(F a, F b)  { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+  static inline M Le(F a, F b)  { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+  static inline M Ge(F a, F b)  { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+  static inline M Neq(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ); }
+  static inline M And(M a, M b)         { return a & b; }
+  static inline F Select(M m, F a)      { return _mm512_maskz_mov_ps(m, a); }
+  static inline I Trunc(F a) {
+    return _mm512_mask_cvttps_epi32(_mm512_setzero_si512(), 0xFFFF, a);
+  }
+  static inline F ToFloat(I a) {
+    return _mm512_mask_cvtepi32_ps(_mm512_setzero_ps(), 0xFFFF, a);
+  }
+  static inline I Index(I row, I col, int width) {
+    return _mm512_add_epi32(_mm512_mullo_epi32(row, _mm512_set1_epi32(width)),
+                            col);
+  }
+  static inline void StoreIndex(int* p, I a) { _mm512_storeu_si512(p, a); }
+};
+
+}  // namespace
+
+#include "dtrack_simd_kernel.h"
+
+
+/////////////////////////////////////////////////////////////////////////////
+void dtrack_simd::BuildProblemAVX512(
+    const Points&   points,
+    const Params&   params,
+    Result&         result
+  )
+{
+  BuildProblemDispatch<V>(points, params, result);
+}
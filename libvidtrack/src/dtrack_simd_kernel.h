@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Included once by each dtrack_simd_<isa>.cpp after defining the vector
+// traits class V. Everything here has internal linkage on purpose.
+
+#pragma once
+
+#include <xmmintrin.h>
+
+#include "dtrack_simd.h"
+
+
+namespace {
+
+/////////////////////////////////////////////////////////////////////////////
+/// Number of steps accumulated in single precision before flushing into the
+/// double precision result.
+const int kFlushSteps = 64;
+
+/////////////////////////////////////////////////////////////////////////////
+template<typename V>
+inline void Flush(typename V::F* acc, int num_acc,
+                  dtrack_simd::Result& result)
+{
+  float lanes[V::kWidth];
+  for (int kk = 0; kk < num_acc; ++kk) {
+    V::Store(lanes, acc[kk]);
+    double sum = 0;
+    for (int ll = 0; ll < V::kWidth; ++ll) {
+      sum += lanes[ll];
+    }
+    if (kk < 21) {
+      result.LHS[kk] += sum;
+    } else if (kk < 27) {
+      result.RHS[kk-21] += sum;
+    } else if (kk == 27) {
+      result.squared_error += sum;
+    } else if (kk == 28) {
+      result.num_obs += sum;
+    } else if (kk < 41) {
+      result.LHS_pb[kk-29] += sum;
+    } else if (kk < 44) {
+      result.LHS_bb[kk-41] += sum;
+    } else {
+      result.RHS_b[kk-44] += sum;
+    }
+    acc[kk] = V::Zero();
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Bilinear sample of a packed {I, gx, gy, 0} image. Each lane reads both
+/// horizontal taps of a row with two adjacent 16 byte loads, so the 2x2
+/// neighbourhood of all three channels costs four loads. Groups of four
+/// lanes are transposed back into I, gx and gy vectors.
+template<typename V>
+inline void SamplePacked(
+    const float*          packed,
+    typename V::I         idx,
+    int                   width,
+    typename V::F         ax,
+    typename V::F         ay,
+    typename V::F&        I,
+    typename V::F&        gx,
+    typename V::F&        gy
+  )
+{
+  int   offsets[V::kWidth];
+  float wx[V::kWidth], wy[V::kWidth];
+  float out_I[V::kWidth], out_gx[V::kWidth], out_gy[V::kWidth];
+  V::StoreIndex(offsets, idx);
+  V::Store(wx, ax);
+  V::Store(wy, ay);
+
+  const int stride = 4*width;
+  const __m128 one = _mm_set1_ps(1.0f);
+  for (int ll = 0; ll < V::kWidth; ll += 4) {
+    __m128 r[4];
+    for (int kk = 0; kk < 4; ++kk) {
+      const float* p = packed + 4*offsets[ll+kk];
+      const __m128 ax0 = _mm_set1_ps(wx[ll+kk]);
+      const __m128 ay0 = _mm_set1_ps(wy[ll+kk]);
+      const __m128 ax1 = _mm_sub_ps(one, ax0);
+      const __m128 ay1 = _mm_sub_ps(one, ay0);
+      const __m128 left  = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p), ay1),
+                                      _mm_mul_ps(_mm_loadu_ps(p+stride), ay0));
+      const __m128 right = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p+4), ay1),
+                                      _mm_mul_ps(_mm_loadu_ps(p+stride+4), ay0));
+      r[kk] = _mm_add_ps(_mm_mul_ps(left, ax1), _mm_mul_ps(right, ax0));
+    }
+    _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+    _mm_storeu_ps(out_I+ll,  r[0]);
+    _mm_storeu_ps(out_gx+ll, r[1]);
+    _mm_storeu_ps(out_gy+ll, r[2]);
+  }
+  I  = V::Load(out_I);
+  gx = V::Load(out_gx);
+  gy = V::Load(out_gy);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Same math as the scalar ESM loop of DTrack::BuildProblem, V::kWidth
+/// points at a time. Invalid lanes are masked to zero before accumulation.
+/// kAligned computes the depth derivative from z instead of loading it.
+/// kBrightness applies gain and bias and fills the brightness blocks.
+template<typename V, bool kAligned, bool kBrightness>
+void BuildProblemKernel(
+    const dtrack_simd::Points&  pts,
+    const dtrack_simd::Params&  prm,
+    dtrack_simd::Result&        result
+  )
+{
+  typedef typename V::F F;
+  typedef typename V::I I;
+  typedef typename V::M M;
+
+  for (int kk = 0; kk < 21; ++kk) result.LHS[kk] = 0;
+  for (int kk = 0; kk < 6; ++kk)  result.RHS[kk] = 0;
+  result.squared_error = 0;
+  result.num_obs       = 0;
+  for (int kk = 0; kk < 12; ++kk) result.LHS_pb[kk] = 0;
+  for (int kk = 0; kk < 3; ++kk)  result.LHS_bb[kk] = 0;
+  for (int kk = 0; kk < 2; ++kk)  result.RHS_b[kk] = 0;
+
+  // Transform.
+  const F t00 = V::Set1(prm.Tlr[0]), t01 = V::Set1(prm.Tlr[1]);
+  const F t02 = V::Set1(prm.Tlr[2]), t03 = V::Set1(prm.Tlr[3]);
+  const F t10 = V::Set1(prm.Tlr[4]), t11 = V::Set1(prm.Tlr[5]);
+  const F t12 = V::Set1(prm.Tlr[6]), t13 = V::Set1(prm.Tlr[7]);
+  const F t20 = V::Set1(prm.Tlr[8]), t21 = V::Set1(prm.Tlr[9]);
+  const F t22 = V::Set1(prm.Tlr[10]), t23 = V::Set1(prm.Tlr[11]);
+
+  // Rotation block of Klg * Tlr.
+  const F m00 = V::Set1(prm.KlgTlr[0]), m01 = V::Set1(prm.KlgTlr[1]);
+  const F m02 = V::Set1(prm.KlgTlr[2]);
+  const F m10 = V::Set1(prm.KlgTlr[4]), m11 = V::Set1(prm.KlgTlr[5]);
+  const F m12 = V::Set1(prm.KlgTlr[6]);
+  const F m20 = V::Set1(prm.KlgTlr[8]), m21 = V::Set1(prm.KlgTlr[9]);
+  const F m22 = V::Set1(prm.KlgTlr[10]);
+
+  // Translation of Klg * Tlr.
+  const F k0 = V::Set1(prm.KlgTlr[3]);
+  const F k1 = V::Set1(prm.KlgTlr[7]);
+  const F k2 = V::Set1(prm.KlgTlr[11]);
+
+  const F fx = V::Set1(prm.fx), fy = V::Set1(prm.fy);
+  const F cx = V::Set1(prm.cx), cy = V::Set1(prm.cy);
+
+  // Valid interval is [2, size-3).
+  const F lo    = V::Set1(2.0f);
+  const F u_hi  = V::Set1(static_cast<float>(prm.width-3));
+  const F v_hi  = V::Set1(static_cast<float>(prm.height-3));
+
+  const F zero  = V::Zero();
+  const F one   = V::Set1(1.0f);
+  const F half  = V::Set1(0.5f);
+  const F c255  = V::Set1(255.0f);
+  const F norm_c      = V::Set1(prm.norm_c);
+  const F inv_norm_c  = V::Set1(1.0f/prm.norm_c);
+  const F grey_sigma2 = V::Set1(prm.grey_sigma2);
+  const F depth_sigma2 = V::Set1(prm.depth_sigma2);
+  const F lanes       = V::Lanes();
+  const F num_points  = V::Set1(static_cast<float>(pts.size));
+
+  const F gain = V::Set1(prm.gain);
+  const F bias = V::Set1(prm.bias);
+
+  // Pose problem, then brightness blocks.
+  const int kNumAcc = kBrightness ? 46 : 29;
+  F acc[46];
+  for (int kk = 0; kk < kNumAcc; ++kk) {
+    acc[kk] = zero;
+  }
+
+  int steps = 0;
+  for (size_t ii = 0; ii < pts.size; ii += V::kWidth) {
+    M valid = V::Lt(V::Add(lanes, V::Set1(static_cast<float>(ii))),
+                    num_points);
+
+    const F x = V::Load(pts.x+ii);
+    const F y = V::Load(pts.y+ii);
+    const F z = V::Load(pts.z+ii);
+
+    // 3d point in live grey camera.
+    const F X = V::Fmadd(t00, x, V::Fmadd(t01, y, V::Fmadd(t02, z, t03)));
+    const F Y = V::Fmadd(t10, x, V::Fmadd(t11, y, V::Fmadd(t12, z, t13)));
+    const F Z = V::Fmadd(t20, x, V::Fmadd(t21, y, V::Fmadd(t22, z, t23)));
+
+    // Project to live grey camera's image coordinate.
+    const F inv_z = V::Div(one, Z);
+    const F u = V::Fmadd(V::Mul(fx, X), inv_z, cx);
+    const F v = V::Fmadd(V::Mul(fy, Y), inv_z, cy);
+
+    // Check if point is behind the camera or out of bounds. Ordered
+    // compares, so NaN is out too.
+    valid = V::And(valid, V::Lt(zero, Z));
+    valid = V::And(valid, V::And(V::And(V::Ge(u, lo), V::Lt(u, u_hi)),
+                                 V::And(V::Ge(v, lo), V::Lt(v, v_hi))));
+
+    // Clamp so masked lanes still gather inside the image. NaN maps to lo.
+    const F uc = V::Min(V::Max(u, lo), u_hi);
+    const F vc = V::Min(V::Max(v, lo), v_hi);
+    const I px = V::Trunc(uc);
+    const I py = V::Trunc(vc);
+    const F ax = V::Sub(uc, V::ToFloat(px));
+    const F ay = V::Sub(vc, V::ToFloat(py));
+    const I idx = V::Index(py, px, prm.width);
+
+    // Get intensity and live image derivative.
+    F Il, dIl_x, dIl_y;
+    SamplePacked<V>(prm.live_packed, idx, prm.width, ax, ay, Il, dIl_x, dIl_y);
+
+    // Discard under/over-saturated pixels.
+    if (prm.discard_saturated) {
+      valid = V::And(valid, V::And(V::Neq(Il, zero), V::Neq(Il, c255)));
+    }
+
+    // Calculate error.
+    const F Ir = V::Load(pts.Ir+ii);
+    F e = kBrightness ? V::Sub(Il, V::Fmadd(gain, Ir, bias)) : V::Sub(Il, Ir);
+
+    // Projection & dehomogenization derivative.
+    const F KlPl0  = V::Fmadd(fx, X, V::Mul(cx, Z));
+    const F KlPl1  = V::Fmadd(fy, Y, V::Mul(cy, Z));
+    const F inv_z2 = V::Mul(inv_z, inv_z);
+
+    // dIesm * dPl * KlgTlr.
+    F dIr_x = V::Load(pts.dIr_x+ii);
+    F dIr_y = V::Load(pts.dIr_y+ii);
+    if (kBrightness) {
+      dIr_x = V::Mul(gain, dIr_x);
+      dIr_y = V::Mul(gain, dIr_y);
+    }
+    const F g_x = V::Mul(V::Add(dIl_x, dIr_x), half);
+    const F g_y = V::Mul(V::Add(dIl_y, dIr_y), half);
+    const F a0 = V::Mul(g_x, inv_z);
+    const F a1 = V::Mul(g_y, inv_z);
+    const F a2 = V::Sub(zero, V::Mul(V::Fmadd(g_x, KlPl0, V::Mul(g_y, KlPl1)),
+                                     inv_z2));
+    const F d0 = V::Fmadd(a0, m00, V::Fmadd(a1, m10, V::Mul(a2, m20)));
+    const F d1 = V::Fmadd(a0, m01, V::Fmadd(a1, m11, V::Mul(a2, m21)));
+    const F d2 = V::Fmadd(a0, m02, V::Fmadd(a1, m12, V::Mul(a2, m22)));
+
+    // J = dIesm_dPl_KlgTlr * gen_i * Pr
+    const F gx = V::Load(pts.gx+ii);
+    const F gy = V::Load(pts.gy+ii);
+    const F gz = V::Load(pts.gz+ii);
+    F J[6];
+    J[0] = d0;
+    J[1] = d1;
+    J[2] = d2;
+    J[3] = V::Sub(V::Mul(d2, gy), V::Mul(d1, gz));
+    J[4] = V::Sub(V::Mul(d0, gz), V::Mul(d2, gx));
+    J[5] = V::Sub(V::Mul(d1, gx), V::Mul(d0, gy));
+
+    // Depth derivative on live image: dIl * dPl * KlgTlr * dPd.
+    const F b0 = V::Mul(dIl_x, inv_z);
+    const F b1 = V::Mul(dIl_y, inv_z);
+    const F b2 = V::Sub(zero, V::Mul(V::Fmadd(dIl_x, KlPl0,
+                                              V::Mul(dIl_y, KlPl1)), inv_z2));
+    F Jd;
+    if (kAligned) {
+      // dPd = P/z and b * KlPl = 0: only the translation is left, Jdr = 0.
+      Jd = V::Div(V::Fmadd(b0, k0, V::Fmadd(b1, k1, V::Mul(b2, k2))),
+                  V::Sub(zero, z));
+    } else {
+      const F c0 = V::Fmadd(b0, m00, V::Fmadd(b1, m10, V::Mul(b2, m20)));
+      const F c1 = V::Fmadd(b0, m01, V::Fmadd(b1, m11, V::Mul(b2, m21)));
+      const F c2 = V::Fmadd(b0, m02, V::Fmadd(b1, m12, V::Mul(b2, m22)));
+      const F Jdl = V::Fmadd(c0, V::Load(pts.dPd_x+ii),
+                             V::Fmadd(c1, V::Load(pts.dPd_y+ii),
+                                      V::Mul(c2, V::Load(pts.dPd_z+ii))));
+      Jd = V::Sub(Jdl, V::Load(pts.Jdr+ii));
+    }
+
+    // Tukey robust norm.
+    const F roc    = V::Mul(e, inv_norm_c);
+    const F omroc2 = V::Sub(one, V::Mul(roc, roc));
+    const F w = V::Select(V::Le(V::Abs(e), norm_c), V::Mul(omroc2, omroc2));
+
+    // Uncertainties.
+    const F inv_sigma = V::Div(one, V::Fmadd(V::Mul(Jd, Jd), depth_sigma2,
+                                             grey_sigma2));
+
+    // Mask out invalid lanes (may hold NaN/Inf).
+    const F wi = V::Select(valid, V::Mul(w, inv_sigma));
+    e = V::Select(valid, e);
+    F wJ[6];
+    for (int jj = 0; jj < 6; ++jj) {
+      J[jj]  = V::Select(valid, J[jj]);
+      wJ[jj] = V::Mul(wi, J[jj]);
+    }
+
+    int kk = 0;
+    for (int rr = 0; rr < 6; ++rr) {
+      for (int cc = rr; cc < 6; ++cc) {
+        acc[kk] = V::Fmadd(J[rr], wJ[cc], acc[kk]);
+        ++kk;
+      }
+    }
+    for (int rr = 0; rr < 6; ++rr) {
+      acc[21+rr] = V::Fmadd(wJ[rr], e, acc[21+rr]);
+    }
+    acc[27] = V::Fmadd(e, e, acc[27]);
+    acc[28] = V::Add(acc[28], V::Select(valid, one));
+
+    // Brightness Jacobian is [-Ir, -1]. wi is already masked.
+    if (kBrightness) {
+      const F wi_Ir = V::Mul(wi, Ir);
+      for (int rr = 0; rr < 6; ++rr) {
+        acc[29+2*rr] = V::Sub(acc[29+2*rr], V::Mul(J[rr], wi_Ir));
+        acc[30+2*rr] = V::Sub(acc[30+2*rr], wJ[rr]);
+      }
+      acc[41] = V::Fmadd(wi_Ir, Ir, acc[41]);
+      acc[42] = V::Add(acc[42], wi_Ir);
+      acc[43] = V::Add(acc[43], wi);
+      acc[44] = V::Sub(acc[44], V::Mul(wi_Ir, e));
+      acc[45] = V::Sub(acc[45], V::Mul(wi, e));
+    }
+
+    if (++steps == kFlushSteps) {
+      Flush<V>(acc, kNumAcc, result);
+      steps = 0;
+    }
+  }
+  Flush<V>(acc, kNumAcc, result);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Picks the BuildProblemKernel instantiation matching the parameters.
+template<typename V>
+void BuildProblemDispatch(
+    const dtrack_simd::Points&  pts,
+    const dtrack_simd::Params&  prm,
+    dtrack_simd::Result&        result
+  )
+{
+  if (prm.aligned) {
+    if (prm.brightness) {
+      BuildProblemKernel<V, true, true>(pts, prm, result);
+    } else {
+      BuildProblemKernel<V, true, false>(pts, prm, result);
+    }
+  } else {
+    if (prm.brightness) {
+      BuildProblemKernel<V, false, true>(pts, prm, result);
+    } else {
+      BuildProblemKernel<V, false, false>(pts, prm, result);
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Same math as the interior of DTrack::_CalculatePackedImage. Differences
+/// of 8-bit values times 0.5 are exact in single precision.
+template<typename V>
+size_t PackRowKernel(
+    const unsigned char*  row,
+    const unsigned char*  top,
+    const unsigned char*  bottom,
+    float                 scale_y,
+    size_t                num_pixels,
+    float*                packed
+  )
+{
+  typedef typename V::F F;
+
+  const F half = V::Set1(0.5f);
+  const F sy   = V::Set1(scale_y);
+
+  float I[V::kWidth], gx[V::kWidth], gy[V::kWidth];
+
+  size_t uu = 0;
+  for (; uu + V::kWidth <= num_pixels; uu += V::kWidth) {
+    V::Store(I, V::LoadU8(row+uu));
+    V::Store(gx, V::Mul(half, V::Sub(V::LoadU8(row+uu+1),
+                                     V::LoadU8(row+uu-1))));
+    V::Store(gy, V::Mul(sy, V::Sub(V::LoadU8(bottom+uu), V::LoadU8(top+uu))));
+
+    // Interleave four pixels at a time.
+    for (int ll = 0; ll < V::kWidth; ll += 4) {
+      __m128 r0 = _mm_loadu_ps(I+ll);
+      __m128 r1 = _mm_loadu_ps(gx+ll);
+      __m128 r2 = _mm_loadu_ps(gy+ll);
+      __m128 r3 = _mm_setzero_ps();
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      float* out = packed + 4*(uu+ll);
+      _mm_storeu_ps(out,    r0);
+      _mm_storeu_ps(out+4,  r1);
+      _mm_storeu_ps(out+8,  r2);
+      _mm_storeu_ps(out+12, r3);
+    }
+  }
+  return uu;
+}
+
+}  // namespace
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compiled with -msse4.1.
+
+#include <cstring>
+
+#include <smmintrin.h>
+
+
+namespace {
+
+/////////////////////////////////////////////////////////////////////////////
+struct V {
+  typedef __m128  F;
+  typedef __m128i I;
+  typedef __m128  M;
+  static const int kWidth = 4;
+
+  static inline F Load(const float* p)  { return _mm_loadu_ps(p); }
+  static inline void Store(float* p, F a) { _mm_storeu_ps(p, a); }
+  static inline F Set1(float a)         { return _mm_set1_ps(a); }
+  static inline F Zero()                { return _mm_setzero_ps(); }
+  static inline F Lanes()               { return _mm_setr_ps(0, 1, 2, 3); }
+  static inline F Add(F a, F b)         { return _mm_add_ps(a, b); }
+  static inline F Sub(F a, F b)         { return _mm_sub_ps(a, b); }
+  static inline F Mul(F a, F b)         { return _mm_mul_ps(a, b); }
+  static inline F Div(F a, F b)         { return _mm_div_ps(a, b); }
+  static inline F Min(F a, F b)         { return _mm_min_ps(a, b); }
+  static inline F Max(F a, F b)         { return _mm_max_ps(a, b); }
+  static inline F Fmadd(F a, F b, F c)  { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+  static inline F Abs(F a)  { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+  static inline M Lt(F a, F b)          { return _mm_cmplt_ps(a, b); }
+  static inline M Le(F a, F b)          { return _mm_cmple_ps(a, b); }
+  static inline M Ge(F a, F b)          { return _mm_cmpge_ps(a, b); }
+  static inline M Neq(F a, F b)         { return _mm_cmpneq_ps(a, b); }
+  static inline M And(M a, M b)         { return _mm_and_ps(a, b); }
+  static inline F Select(M m, F a)      { return _mm_and_ps(m, a); }
+  static inline I Trunc(F a)            { return _mm_cvttps_epi32(a); }
+  static inline F ToFloat(I a)          { return _mm_cvtepi32_ps(a); }
+  static inline I Index(I row, I col, int width) {
+    return _mm_add_epi32(_mm_mullo_epi32(row, _mm_set1_epi32(width)), col);
+  }
+  static inline void StoreIndex(int* p, I a) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), a);
+  }
+  static inline F LoadU8(const unsigned char* p) {
+    int bytes;
+    std::memcpy(&bytes, p, 4);
+    return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+  }
+};
+
+}  // namespace
+
+#include "dtrack_simd_kernel.h"
+
+
+/////////////////////////////////////////////////////////////////////////////
+void dtrack_simd::BuildProblemSSE4(
+    const Points&   points,
+    const Params&   params,
+    Result&         result
+  )
+{
+  BuildProblemDispatch<V>(points, params, result);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+size_t dtrack_simd::PackRowSSE4(
+    const unsigned char*  row,
+    const unsigned char*  top,
+    const unsigned char*  bottom,
+    float                 scale_y,
+    size_t                num_pixels,
+    float*                packed
+  )
+{
+  return PackRowKernel<V>(row, top, bottom, scale_y, num_pixels, packed);
+}
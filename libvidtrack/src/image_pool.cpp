@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vidtrack/image_pool.h>
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+cv::Mat& ImagePool::Get(
+    unsigned int    level,
+    int             rows,
+    int             cols,
+    int             type
+  )
+{
+  // Only a handful of keys are alive, so a linear search is enough.
+  for (Buffer& buffer : buffers_) {
+    if (buffer.level == level && buffer.rows == rows && buffer.cols == cols
+        && buffer.type == type) {
+      return buffer.image;
+    }
+  }
+  buffers_.push_back(Buffer());
+  Buffer& buffer = buffers_.back();
+  buffer.level  = level;
+  buffer.rows   = rows;
+  buffer.cols   = cols;
+  buffer.type   = type;
+  buffer.image.create(rows, cols, type);
+  return buffer.image;
+}
+
+} /* vid namespace */
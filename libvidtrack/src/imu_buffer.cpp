@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vidtrack/imu_buffer.h>
+
+#include <cfloat>
+
+#include <glog/logging.h>
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+inline ImuBuffer::ImuMeasurement interpolate(
+    const ImuBuffer::ImuMeasurement&    prev,
+    const ImuBuffer::ImuMeasurement&    next,
+    double                              time
+  )
+{
+  const double alpha = (time - prev.time) / (next.time - prev.time);
+  ImuBuffer::ImuMeasurement measurement = prev * (1.0 - alpha) + next * alpha;
+  measurement.time = time;
+  return measurement;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+ImuBuffer::ImuBuffer(size_t capacity)
+  : count_(0), first_(0), end_time_(-DBL_MAX)
+{
+  CHECK_GT(capacity, 1u);
+  size_t size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+  slots_.reset(new Slot[size]);
+  for (size_t ii = 0; ii < size; ++ii) {
+    slots_[ii].sequence.store(0, std::memory_order_relaxed);
+  }
+  mask_ = size - 1;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+bool ImuBuffer::Push(const ImuMeasurement& measurement)
+{
+  if (measurement.time <= end_time_.load(std::memory_order_relaxed)) {
+    return false;
+  }
+
+  const uint64_t index = count_.load(std::memory_order_relaxed);
+  Slot& slot = slots_[index & mask_];
+  slot.sequence.store(2*index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.time.store(measurement.time, std::memory_order_relaxed);
+  for (int ii = 0; ii < 3; ++ii) {
+    slot.w[ii].store(measurement.w[ii], std::memory_order_relaxed);
+    slot.a[ii].store(measurement.a[ii], std::memory_order_relaxed);
+  }
+  slot.sequence.store(2*index + 2, std::memory_order_release);
+
+  // Count first: a reader that sees the new end time also sees the sample
+  // in GetRange.
+  count_.store(index + 1, std::memory_order_release);
+  end_time_.store(measurement.time, std::memory_order_release);
+  return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+double ImuBuffer::StartTime() const
+{
+  ImuMeasurement measurement;
+  while (true) {
+    uint64_t begin, end;
+    _Bounds(begin, end);
+    if (begin == end) {
+      return -DBL_MAX;
+    }
+    if (_Read(begin, measurement)) {
+      return measurement.time;
+    }
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void ImuBuffer::GetRange(
+    double                        start_time,
+    double                        end_time,
+    std::vector<ImuMeasurement>&  measurements
+  ) const
+{
+  // A retry only happens if the writer lapped a sample being read, which
+  // moves the oldest sample held forward.
+  measurements.clear();
+  while (!_GetRange(start_time, end_time, measurements)) {
+    measurements.clear();
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void ImuBuffer::EvictBefore(double time)
+{
+  uint64_t begin, end, index;
+  _Bounds(begin, end);
+  if (begin == end || !_UpperBound(begin, end, time, index)
+      || index <= begin + 1) {
+    return;
+  }
+
+  // Keep the last sample not after time to interpolate at it.
+  const uint64_t first = index - 1;
+  uint64_t current = first_.load(std::memory_order_relaxed);
+  while (current < first
+         && !first_.compare_exchange_weak(current, first,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+bool ImuBuffer::_Read(
+    uint64_t          index,
+    ImuMeasurement&   measurement
+  ) const
+{
+  const Slot& slot = slots_[index & mask_];
+  const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+  if (sequence != 2*index + 2) {
+    return false;
+  }
+  measurement.time = slot.time.load(std::memory_order_relaxed);
+  for (int ii = 0; ii < 3; ++ii) {
+    measurement.w[ii] = slot.w[ii].load(std::memory_order_relaxed);
+    measurement.a[ii] = slot.a[ii].load(std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot.sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void ImuBuffer::_Bounds(
+    uint64_t&   begin,
+    uint64_t&   end
+  ) const
+{
+  // first_ is never ahead of a count loaded after it.
+  begin = first_.load(std::memory_order_acquire);
+  end = count_.load(std::memory_order_acquire);
+  if (end - begin > mask_ + 1) {
+    begin = end - (mask_ + 1);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+bool ImuBuffer::_UpperBound(
+    uint64_t    begin,
+    uint64_t    end,
+    double      time,
+    uint64_t&   index
+  ) const
+{
+  ImuMeasurement measurement;
+  while (begin < end) {
+    const uint64_t middle = begin + (end - begin) / 2;
+    if (!_Read(middle, measurement)) {
+      return false;
+    }
+    if (measurement.time <= time) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  index = begin;
+  return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+bool ImuBuffer::_GetRange(
+    double                        start_time,
+    double                        end_time,
+    std::vector<ImuMeasurement>&  measurements
+  ) const
+{
+  uint64_t begin, end;
+  _Bounds(begin, end);
+  if (begin == end) {
+    return true;
+  }
+
+  ImuMeasurement prev, next;
+  if (!_Read(begin, prev)) {
+    return false;
+  }
+  if (start_time <= prev.time) {
+    return true;
+  }
+
+  // First sample after start_time.
+  uint64_t index;
+  if (!_UpperBound(begin, end, start_time, index)
+      || !_Read(index - 1, prev)) {
+    return false;
+  }
+  if (index == end) {
+    measurements.push_back(prev);
+  } else {
+    if (!_Read(index, next)) {
+      return false;
+    }
+    measurements.push_back(interpolate(prev, next, start_time));
+  }
+
+  // Samples in between, then the one interpolated at end_time.
+  for (; index < end; ++index) {
+    if (!_Read(index, next)) {
+      return false;
+    }
+    if (next.time >= end_time) {
+      measurements.push_back(interpolate(prev, next, end_time));
+      return true;
+    }
+    measurements.push_back(next);
+    prev = next;
+  }
+  measurements.push_back(prev);
+  return true;
+}
+
+} /* vid namespace */
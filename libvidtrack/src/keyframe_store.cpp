@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vidtrack/keyframe_store.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <string>
+
+#include <glog/logging.h>
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+inline size_t image_bytes(const cv::Mat& image)
+{
+  return image.total() * image.elemSize();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+KeyframeStore::KeyframeStore()
+  : hot_bytes_(0), warm_bytes_(0), cold_bytes_(0), first_hot_(0),
+    first_warm_(0), cold_fd_(-1)
+{
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+KeyframeStore::~KeyframeStore()
+{
+  if (cold_fd_ >= 0) {
+    close(cold_fd_);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void KeyframeStore::SetOptions(const Options& options)
+{
+  LOG_IF(WARNING, cold_fd_ >= 0 && options.cold_path != options_.cold_path)
+      << "Cold keyframe file is already open. Ignoring new path.";
+  const std::string cold_path = options_.cold_path;
+  options_ = options;
+  if (cold_fd_ >= 0) {
+    options_.cold_path = cold_path;
+  }
+  _Enforce();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void KeyframeStore::Add(
+    const Frame&      frame,
+    const cv::Mat&    grey,
+    const cv::Mat&    depth
+  )
+{
+  CHECK_EQ(grey.type(), CV_8UC1);
+  CHECK_EQ(depth.type(), CV_32FC1);
+
+  frames_.push_back(Entry());
+  Entry& entry = frames_.back();
+  entry.frame = frame;
+  entry.tier  = kHot;
+  entry.grey  = grey.clone();
+  entry.depth = depth.clone();
+  hot_bytes_ += image_bytes(entry.grey) + image_bytes(entry.depth);
+
+  _Enforce();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void KeyframeStore::GetImages(
+    size_t            id,
+    cv::Mat&          grey,
+    cv::Mat&          depth
+  ) const
+{
+  CHECK_LT(id, frames_.size());
+  const Entry& entry = frames_[id];
+  switch (entry.tier) {
+    case kHot:
+      grey  = entry.grey;
+      depth = entry.depth;
+      break;
+    case kWarm:
+      _DecodeGrey(entry.grey_png.data(), entry.grey_png.size(), grey);
+      _DecodeDepth(entry.depth_png.data(), entry.depth_png.size(), depth);
+      break;
+    case kCold:
+      _ReadCold(entry, grey, &depth);
+      break;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+cv::Mat KeyframeStore::GetGrey(size_t id) const
+{
+  CHECK_LT(id, frames_.size());
+  const Entry& entry = frames_[id];
+  cv::Mat grey;
+  switch (entry.tier) {
+    case kHot:
+      grey = entry.grey;
+      break;
+    case kWarm:
+      _DecodeGrey(entry.grey_png.data(), entry.grey_png.size(), grey);
+      break;
+    case kCold:
+      _ReadCold(entry, grey, nullptr);
+      break;
+  }
+  return grey;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void KeyframeStore::_Enforce()
+{
+  while (hot_bytes_ > options_.max_hot_bytes && first_hot_ < frames_.size()) {
+    _ToWarm(frames_[first_hot_]);
+    ++first_hot_;
+  }
+  while (warm_bytes_ > options_.max_warm_bytes && first_warm_ < first_hot_) {
+    _ToCold(frames_[first_warm_]);
+    ++first_warm_;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void KeyframeStore::_ToWarm(Entry& entry)
+{
+  CHECK_EQ(entry.tier, kHot);
+  std::vector<int> params;
+  params.push_back(cv::IMWRITE_PNG_COMPRESSION);
+  params.push_back(options_.png_compression);
+
+  CHECK(cv::imencode(".png", entry.grey, entry.grey_png, params));
+
+  // Millimeters, 0 for invalid, clamped to the 16 bit range.
+  const cv::Mat& depth = entry.depth;
+  quantized_.create(depth.rows, depth.cols, CV_16UC1);
+  const float kMaxMillimeters = std::numeric_limits<unsigned short>::max();
+  for (int vv = 0; vv < depth.rows; ++vv) {
+    const float* src = depth.ptr<float>(vv);
+    unsigned short* dst = quantized_.ptr<unsigned short>(vv);
+    for (int uu = 0; uu < depth.cols; ++uu) {
+      // Rounded, so half a millimeter would round up to a valid 1.
+      const float millimeters = src[uu] * 1000.0f + 0.5f;
+      if (!std::isfinite(src[uu]) || src[uu] <= 0.0005f) {
+        dst[uu] = 0;
+      } else {
+        dst[uu] = static_cast<unsigned short>(
+              std::min(millimeters, kMaxMillimeters));
+      }
+    }
+  }
+  CHECK(cv::imencode(".png", quantized_, entry.depth_png, params));
+
+  hot_bytes_  -= image_bytes(entry.grey) + image_bytes(entry.depth);
+  warm_bytes_ += entry.grey_png.size() + entry.depth_png.size();
+  entry.grey.release();
+  entry.depth.release();
+  entry.tier = kWarm;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void KeyframeStore::_ToCold(Entry& entry)
+{
+  CHECK_EQ(entry.tier, kWarm);
+  if (cold_fd_ < 0) {
+    if (options_.cold_path.empty()) {
+      const char* tmp_dir = getenv("TMPDIR");
+      std::string path = tmp_dir != nullptr && tmp_dir[0] != '\0' ?
+            tmp_dir : "/tmp";
+      path += "/vidtrack_keyframes_XXXXXX";
+      cold_fd_ = mkstemp(&path[0]);
+      PCHECK(cold_fd_ >= 0) << "Cannot create cold keyframe file in "
+                            << path.substr(0, path.rfind('/'));
+      unlink(path.c_str());
+    } else {
+      cold_fd_ = open(options_.cold_path.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                      0644);
+      PCHECK(cold_fd_ >= 0) << "Cannot open " << options_.cold_path;
+    }
+  }
+
+  entry.offset     = cold_bytes_;
+  entry.grey_size  = entry.grey_png.size();
+  entry.depth_size = entry.depth_png.size();
+  for (const std::vector<unsigned char>* blob
+       : {&entry.grey_png, &entry.depth_png}) {
+    size_t written = 0;
+    while (written < blob->size()) {
+      const ssize_t bytes = pwrite(cold_fd_, blob->data() + written,
+                                   blob->size() - written,
+                                   cold_bytes_ + written);
+      PCHECK(bytes >= 0) << "Cannot write cold keyframe file";
+      written += bytes;
+    }
+    cold_bytes_ += blob->size();
+  }
+
+  warm_bytes_ -= entry.grey_size + entry.depth_size;
+  std::vector<unsigned char>().swap(entry.grey_png);
+  std::vector<unsigned char>().swap(entry.depth_png);
+  entry.tier = kCold;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void KeyframeStore::_ReadCold(
+    const Entry&      entry,
+    cv::Mat&          grey,
+    cv::Mat*          depth
+  ) const
+{
+  // Only the pages holding this entry are mapped. Offsets must be page
+  // aligned, so the range starts at the page the entry starts in.
+  static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+  const size_t size = entry.grey_size
+      + (depth != nullptr ? entry.depth_size : 0);
+  const size_t begin  = entry.offset - entry.offset % kPageSize;
+  const size_t length = entry.offset + size - begin;
+  void* map = mmap(nullptr, length, PROT_READ, MAP_SHARED, cold_fd_, begin);
+  PCHECK(map != MAP_FAILED) << "Cannot map cold keyframe file";
+
+  const unsigned char* data =
+      static_cast<const unsigned char*>(map) + (entry.offset - begin);
+  _DecodeGrey(data, entry.grey_size, grey);
+  if (depth != nullptr) {
+    _DecodeDepth(data + entry.grey_size, entry.depth_size, *depth);
+  }
+  munmap(map, length);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void KeyframeStore::_DecodeGrey(
+    const unsigned char*  data,
+    size_t                size,
+    cv::Mat&              grey
+  )
+{
+  const cv::Mat png(1, size, CV_8UC1, const_cast<unsigned char*>(data));
+  grey = cv::imdecode(png, cv::IMREAD_UNCHANGED);
+  CHECK_EQ(grey.type(), CV_8UC1);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void KeyframeStore::_DecodeDepth(
+    const unsigned char*  data,
+    size_t                size,
+    cv::Mat&              depth
+  )
+{
+  const cv::Mat png(1, size, CV_8UC1, const_cast<unsigned char*>(data));
+  const cv::Mat quantized = cv::imdecode(png, cv::IMREAD_UNCHANGED);
+  CHECK_EQ(quantized.type(), CV_16UC1);
+
+  // A new buffer: depth may still share one with a hot frame.
+  depth = cv::Mat(quantized.rows, quantized.cols, CV_32FC1);
+  const float kNaN = std::numeric_limits<float>::quiet_NaN();
+  for (int vv = 0; vv < depth.rows; ++vv) {
+    const unsigned short* src = quantized.ptr<unsigned short>(vv);
+    float* dst = depth.ptr<float>(vv);
+    for (int uu = 0; uu < depth.cols; ++uu) {
+      dst[uu] = src[uu] == 0 ? kNaN : src[uu] / 1000.0f;
+    }
+  }
+}
+
+} /* vid namespace */
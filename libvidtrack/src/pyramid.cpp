@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vidtrack/pyramid.h>
+
+#include <limits>
+
+#include <glog/logging.h>
+
+#include <vidtrack/config.h>
+
+#if defined(VIDTRACK_USE_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+/// Index of pixel ii under OpenCV's BORDER_REFLECT_101.
+inline int Reflect101(int ii, int size)
+{
+  if (size == 1) {
+    return 0;
+  }
+  while (ii < 0 || ii >= size) {
+    ii = ii < 0 ? -ii : 2*size - 2 - ii;
+  }
+  return ii;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Horizontal [1 4 6 4 1] pass of a source row, sampled every other pixel.
+template<typename T>
+inline void PyrDownRow(
+    const T*    src_row,
+    int         src_cols,
+    float*      row,
+    int         dst_cols
+  )
+{
+  for (int uu = 0; uu < dst_cols; ++uu) {
+    const int cc = 2*uu;
+    if (cc >= 2 && cc + 2 < src_cols) {
+      row[uu] = src_row[cc]*6.0f + (src_row[cc-1] + src_row[cc+1])*4.0f
+          + src_row[cc-2] + src_row[cc+2];
+    } else {
+      row[uu] = src_row[Reflect101(cc, src_cols)]*6.0f
+          + (src_row[Reflect101(cc-1, src_cols)]
+             + src_row[Reflect101(cc+1, src_cols)])*4.0f
+          + src_row[Reflect101(cc-2, src_cols)]
+          + src_row[Reflect101(cc+2, src_cols)];
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Sums are at most 255*256, so they are exact in float and rounding matches
+/// OpenCV's fixed point cast.
+inline void PyrDownCast(float sum, unsigned char& out)
+{
+  out = static_cast<unsigned char>((static_cast<int>(sum) + 128) >> 8);
+}
+
+inline void PyrDownCast(float sum, float& out)
+{
+  out = sum * (1.0f/256.0f);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+template<typename T>
+void PyrDownImpl(const cv::Mat& src, cv::Mat& dst, cv::Mat& rows)
+{
+  // Each filtered source row is needed by up to three output rows. The five
+  // rows in use are always consecutive, so row % 5 picks a free slot.
+  int slot_row[5] = {-1, -1, -1, -1, -1};
+  const float* taps[5];
+  for (int vv = 0; vv < dst.rows; ++vv) {
+    for (int kk = 0; kk < 5; ++kk) {
+      const int src_row = Reflect101(2*vv - 2 + kk, src.rows);
+      const int slot = src_row % 5;
+      if (slot_row[slot] != src_row) {
+        PyrDownRow(src.ptr<T>(src_row), src.cols, rows.ptr<float>(slot),
+                   dst.cols);
+        slot_row[slot] = src_row;
+      }
+      taps[kk] = rows.ptr<float>(slot);
+    }
+
+    T* dst_row = dst.ptr<T>(vv);
+    for (int uu = 0; uu < dst.cols; ++uu) {
+      PyrDownCast(taps[2][uu]*6.0f + (taps[1][uu] + taps[3][uu])*4.0f
+                  + taps[0][uu] + taps[4][uu], dst_row[uu]);
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void PyrDown(
+    const cv::Mat&    src,
+    cv::Mat&          dst,
+    unsigned int      level,
+    ImagePool&        pool
+  )
+{
+  CHECK_EQ(src.channels(), 1);
+  CHECK(!src.empty());
+
+  const int dst_rows = (src.rows + 1) / 2;
+  const int dst_cols = (src.cols + 1) / 2;
+  dst.create(dst_rows, dst_cols, src.type());
+  cv::Mat& rows = pool.Get(level, 5, dst_cols, CV_32FC1);
+
+  if (src.type() == CV_8UC1) {
+    PyrDownImpl<unsigned char>(src, dst, rows);
+  } else if (src.type() == CV_32FC1) {
+    PyrDownImpl<float>(src, dst, rows);
+  } else {
+    LOG(FATAL) << "PyrDown: unsupported image type " << src.type();
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void HalfSampleGrey(
+    const cv::Mat&    src,
+    cv::Mat&          dst
+  )
+{
+  CHECK_EQ(src.type(), CV_8UC1);
+  dst.create(src.rows / 2, src.cols / 2, CV_8UC1);
+
+  for (int vv = 0; vv < dst.rows; ++vv) {
+    const unsigned char* row0 = src.ptr<unsigned char>(2*vv);
+    const unsigned char* row1 = src.ptr<unsigned char>(2*vv + 1);
+    unsigned char*       out  = dst.ptr<unsigned char>(vv);
+    int uu = 0;
+
+#if defined(VIDTRACK_USE_SIMD) && defined(__SSE2__)
+    // 16 outputs per step. Bytes are split into their even and odd halves
+    // as 16 bit lanes, so the sum is exact.
+    const __m128i kLowBytes = _mm_set1_epi16(0x00FF);
+    const __m128i kTwo      = _mm_set1_epi16(2);
+    for (; uu + 16 <= dst.cols; uu += 16) {
+      __m128i sums[2];
+      for (int hh = 0; hh < 2; ++hh) {
+        const __m128i top = _mm_loadu_si128(
+              reinterpret_cast<const __m128i*>(row0 + 2*uu + 16*hh));
+        const __m128i bottom = _mm_loadu_si128(
+              reinterpret_cast<const __m128i*>(row1 + 2*uu + 16*hh));
+        const __m128i sum = _mm_add_epi16(
+              _mm_add_epi16(_mm_and_si128(top, kLowBytes),
+                            _mm_srli_epi16(top, 8)),
+              _mm_add_epi16(_mm_and_si128(bottom, kLowBytes),
+                            _mm_srli_epi16(bottom, 8)));
+        sums[hh] = _mm_srli_epi16(_mm_add_epi16(sum, kTwo), 2);
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + uu),
+                       _mm_packus_epi16(sums[0], sums[1]));
+    }
+#endif
+
+    for (; uu < dst.cols; ++uu) {
+      out[uu] = (row0[2*uu] + row0[2*uu+1] + row1[2*uu] + row1[2*uu+1] + 2)
+          >> 2;
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// Scalar reference of the SIMD depth path. Operations are done in the same
+/// order so both give identical results.
+inline float HalfSampleDepthBlock(float d0, float d1, float d2, float d3)
+{
+  const float kInf = std::numeric_limits<float>::infinity();
+
+  // Not positive covers NaN too.
+  const float m0 = d0 > 0 ? d0 : kInf;
+  const float m1 = d1 > 0 ? d1 : kInf;
+  const float m2 = d2 > 0 ? d2 : kInf;
+  const float m3 = d3 > 0 ? d3 : kInf;
+  const float nearest = std::min(std::min(m0, m1), std::min(m2, m3));
+  if (!(nearest < kInf)) {
+    return std::numeric_limits<float>::quiet_NaN();
+  }
+
+  const float limit = nearest * (1.0f + kMaxDepthSpread);
+  const float sum = ((m0 <= limit ? m0 : 0.0f) + (m1 <= limit ? m1 : 0.0f))
+      + ((m2 <= limit ? m2 : 0.0f) + (m3 <= limit ? m3 : 0.0f));
+  const float count =
+      ((m0 <= limit ? 1.0f : 0.0f) + (m1 <= limit ? 1.0f : 0.0f))
+      + ((m2 <= limit ? 1.0f : 0.0f) + (m3 <= limit ? 1.0f : 0.0f));
+  return sum / count;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void HalfSampleDepth(
+    const cv::Mat&    src,
+    cv::Mat&          dst
+  )
+{
+  CHECK_EQ(src.type(), CV_32FC1);
+  dst.create(src.rows / 2, src.cols / 2, CV_32FC1);
+
+  for (int vv = 0; vv < dst.rows; ++vv) {
+    const float* row0 = src.ptr<float>(2*vv);
+    const float* row1 = src.ptr<float>(2*vv + 1);
+    float*       out  = dst.ptr<float>(vv);
+    int uu = 0;
+
+#if defined(VIDTRACK_USE_SIMD) && defined(__SSE2__)
+    // 4 outputs per step, branch free version of HalfSampleDepthBlock.
+    const __m128 kZero  = _mm_setzero_ps();
+    const __m128 kOne   = _mm_set1_ps(1.0f);
+    const __m128 kInf   = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    const __m128 kNaN   = _mm_set1_ps(std::numeric_limits<float>::quiet_NaN());
+    const __m128 kScale = _mm_set1_ps(1.0f + kMaxDepthSpread);
+    for (; uu + 4 <= dst.cols; uu += 4) {
+      const __m128 top_a    = _mm_loadu_ps(row0 + 2*uu);
+      const __m128 top_b    = _mm_loadu_ps(row0 + 2*uu + 4);
+      const __m128 bottom_a = _mm_loadu_ps(row1 + 2*uu);
+      const __m128 bottom_b = _mm_loadu_ps(row1 + 2*uu + 4);
+      __m128 m[4] = {
+        _mm_shuffle_ps(top_a, top_b, _MM_SHUFFLE(2, 0, 2, 0)),
+        _mm_shuffle_ps(top_a, top_b, _MM_SHUFFLE(3, 1, 3, 1)),
+        _mm_shuffle_ps(bottom_a, bottom_b, _MM_SHUFFLE(2, 0, 2, 0)),
+        _mm_shuffle_ps(bottom_a, bottom_b, _MM_SHUFFLE(3, 1, 3, 1))
+      };
+      for (int ii = 0; ii < 4; ++ii) {
+        const __m128 valid = _mm_cmpgt_ps(m[ii], kZero);
+        m[ii] = _mm_or_ps(_mm_and_ps(valid, m[ii]), _mm_andnot_ps(valid, kInf));
+      }
+      const __m128 nearest = _mm_min_ps(_mm_min_ps(m[0], m[1]),
+                                        _mm_min_ps(m[2], m[3]));
+      const __m128 limit = _mm_mul_ps(nearest, kScale);
+
+      __m128 keep[4];
+      for (int ii = 0; ii < 4; ++ii) {
+        keep[ii] = _mm_cmple_ps(m[ii], limit);
+      }
+      const __m128 sum = _mm_add_ps(
+            _mm_add_ps(_mm_and_ps(keep[0], m[0]), _mm_and_ps(keep[1], m[1])),
+            _mm_add_ps(_mm_and_ps(keep[2], m[2]), _mm_and_ps(keep[3], m[3])));
+      const __m128 count = _mm_add_ps(
+            _mm_add_ps(_mm_and_ps(keep[0], kOne), _mm_and_ps(keep[1], kOne)),
+            _mm_add_ps(_mm_and_ps(keep[2], kOne), _mm_and_ps(keep[3], kOne)));
+
+      const __m128 any_valid = _mm_cmplt_ps(nearest, kInf);
+      const __m128 mean = _mm_div_ps(sum, count);
+      _mm_storeu_ps(out + uu, _mm_or_ps(_mm_and_ps(any_valid, mean),
+                                        _mm_andnot_ps(any_valid, kNaN)));
+    }
+#endif
+
+    for (; uu < dst.cols; ++uu) {
+      out[uu] = HalfSampleDepthBlock(row0[2*uu], row0[2*uu+1],
+                                     row1[2*uu], row1[2*uu+1]);
+    }
+  }
+}
+
+} /* vid namespace */
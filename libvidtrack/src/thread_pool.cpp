@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vidtrack/thread_pool.h>
+
+#include <glog/logging.h>
+
+
+namespace vid {
+
+/////////////////////////////////////////////////////////////////////////////
+ThreadPool::ThreadPool(unsigned int num_threads) :
+  task_function_(nullptr), task_(nullptr), num_tasks_(0), next_task_(0),
+  num_busy_(0), generation_(0), stop_(false)
+{
+  if (num_threads == 0) {
+    num_threads = HardwareThreads();
+  }
+  for (unsigned int ii = 1; ii < num_threads; ++ii) {
+    workers_.emplace_back(&ThreadPool::_WorkerLoop, this);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_cv_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+unsigned int ThreadPool::HardwareThreads()
+{
+  const unsigned int num_threads = std::thread::hardware_concurrency();
+  return num_threads == 0 ? 1 : num_threads;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void ThreadPool::_ParallelFor(
+    size_t                                  num_tasks,
+    TaskFunction                            function,
+    const void*                             task
+  )
+{
+  if (workers_.empty() || num_tasks < 2) {
+    for (size_t ii = 0; ii < num_tasks; ++ii) {
+      function(task, ii);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CHECK_EQ(num_busy_, 0u) << "ParallelFor is not re-entrant.";
+    task_function_  = function;
+    task_           = task;
+    num_tasks_      = num_tasks;
+    next_task_      = 0;
+    num_busy_       = workers_.size();
+    ++generation_;
+  }
+  start_cv_.notify_all();
+
+  _RunTasks();
+
+  // Wait for workers to drain the job before task goes out of scope.
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return num_busy_ == 0; });
+  task_function_ = nullptr;
+  task_ = nullptr;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void ThreadPool::_WorkerLoop()
+{
+  unsigned int generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_cv_.wait(lock, [&] { return stop_ || generation_ != generation; });
+      if (stop_) {
+        return;
+      }
+      generation = generation_;
+    }
+
+    _RunTasks();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --num_busy_;
+    }
+    done_cv_.notify_one();
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void ThreadPool::_RunTasks()
+{
+  for (size_t ii = next_task_++; ii < num_tasks_; ii = next_task_++) {
+    task_function_(task_, ii);
+  }
+}
+
+} /* vid namespace */
@@ -16,17 +16,14 @@
  * limitations under the License.
  */
 
+#include <chrono>
 #include <fstream>
 
 #include <vidtrack/tracker.h>
+#include <vidtrack/pyramid.h>
 
 #include <glog/logging.h>
 
-DEFINE_bool(imu_seeding, true,
-            "Seed visual odometry with IMU measurements instead of using pyramid");
-DEFINE_bool(use_imu, true,
-            "Use IMU measurements within a BA window to aid localization");
-
 using namespace vid;
 
 inline Eigen::Vector3d R2Cart(const Eigen::Matrix3d& R) {
@@ -141,13 +138,13 @@ void Tracker::FindLoopClosureCandidates(
 {
   CHECK_GE(margin, 0);
   CHECK_GE(id, 0);
-  CHECK_LE(static_cast<size_t>(id), dtrack_vector_.size());
+  CHECK_LE(static_cast<size_t>(id), keyframe_store_.Size());
 
   const float max_score = max_intensity_change
                           * (thumbnail.rows * thumbnail.cols);
-  for (unsigned int ii = 0; ii < dtrack_vector_.size(); ++ii) {
+  for (unsigned int ii = 0; ii < keyframe_store_.Size(); ++ii) {
     if (abs(id - ii) >= margin) {
-      DTrackPoseOut& dtrack_estimate = dtrack_vector_[ii];
+      const KeyframeStore::Frame& dtrack_estimate = keyframe_store_[ii];
 
       float score = ScoreImages<unsigned char>(thumbnail,
                                                dtrack_estimate.thumbnail);
@@ -163,19 +160,53 @@ void Tracker::FindLoopClosureCandidates(
 }
 
 
-
 ///////////////////////////////////////////////////////////////////////////
 Tracker::Tracker(unsigned int window_size, unsigned int pyramid_levels)
   : kWindowSize(window_size), kMinWindowSize(10), kPyramidLevels(pyramid_levels),
+    imu_buffer_(kImuBufferSize),
     config_ba_(false), config_dtrack_(false), ba_has_converged_(false),
-    dtrack_(pyramid_levels), dtrack_refine_(pyramid_levels)
+    dtrack_(pyramid_levels), dtrack_refine_(pyramid_levels),
+    keyframe_time_(0), keyframe_num_obs_(0), is_keyframe_(false),
+    back_end_stop_(false), back_end_pause_(false), edge_queue_(kBackEndQueueSize),
+    result_queue_(kBackEndQueueSize)
 {
+  SetOptions(Options());
+  SetMotionPrior(MotionPrior());
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+void Tracker::SetOptions(const Options& options)
+{
+  _StopBackEnd();
+  tracker_options_ = options;
+  dtrack_.SetOptions(options.dtrack);
+  dtrack_refine_.SetOptions(options.dtrack);
+  keyframe_store_.SetOptions(options.keyframes);
+  if (options.async_ba) {
+    back_end_ = std::thread(&Tracker::_BackEndLoop, this);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+void Tracker::SetMotionPrior(const MotionPrior& prior)
+{
+  CHECK_LT(prior.start_level, kPyramidLevels);
+  motion_prior_ = prior;
+
+  // Built once so trusted frames do not allocate a policy.
+  motion_prior_policy_ = dtrack_.DefaultPolicy(true);
+  for (size_t ii = prior.start_level+1; ii < kPyramidLevels; ++ii) {
+    motion_prior_policy_.levels[ii].max_iterations = 0;
+  }
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 Tracker::~Tracker()
 {
+  _StopBackEnd();
 }
 
 
@@ -210,6 +241,11 @@ void Tracker::ConfigureDTrack(
     dtrack_.SetParams(live_grey_cmod, ref_grey_cmod, ref_depth_cmod, Tgd);
     dtrack_.SetKeyframe(keyframe_grey, keyframe_depth);
     current_time_ = time;
+    Tkc_ = Sophus::SE3d();
+    Tkc_covariance_.setZero();
+    keyframe_time_ = time;
+    keyframe_num_obs_ = 0;
+    is_keyframe_ = true;
 
     // Add initial pose to BA.
     ba::PoseT<double> initial_pose;
@@ -217,16 +253,15 @@ void Tracker::ConfigureDTrack(
     initial_pose.t_wp = Sophus::SE3d();
     initial_pose.time = time + kTimeOffset;
     ba_window_.push_back(initial_pose);
+    ba_result_.pose = initial_pose;
 
     // NOTE(jfalquez) This first one is not used during optimization.
     // It is only required to store the images of the first pose.
-    DTrackPoseOut dtrack_rel_pose_out;
+    KeyframeStore::Frame dtrack_rel_pose_out;
     dtrack_rel_pose_out.time_a      = 0;
     dtrack_rel_pose_out.time_b      = 0;
-    dtrack_rel_pose_out.grey_img    = keyframe_grey.clone();
-    dtrack_rel_pose_out.depth_img   = keyframe_depth.clone();
     dtrack_rel_pose_out.thumbnail   = GenerateThumbnail(keyframe_grey).clone();
-    dtrack_vector_.push_back(dtrack_rel_pose_out);
+    keyframe_store_.Add(dtrack_rel_pose_out, keyframe_grey, keyframe_depth);
 
     config_dtrack_ = true;
   }
@@ -307,6 +342,9 @@ void Tracker::ConfigureBA(const std::shared_ptr<calibu::Rig<double>>& rig,
 //    gravity << 0, 0, -9.806; // Rig
     bundle_adjuster_.SetGravity(gravity);
 
+    // Copy for IMU seeding, which must not read BA while the back-end runs.
+    gravity_ = bundle_adjuster_.GetImuCalibration().g_vec;
+
     // Set up BA options.
     options_ = options;
 
@@ -337,31 +375,65 @@ void Tracker::Estimate(
 
   Sophus::SE3d        rel_pose_estimate;
 
+  // Edge from the last frame to this one. Its IMU measurements are fetched
+  // here if seeding needs them, and handed over to the BA window. Without a
+  // back-end, they go in the buffer of the last edge the window popped.
+  DTrackPose dtrack_rel_pose;
+  if (!tracker_options_.async_ba) {
+    dtrack_rel_pose.imu_measurements.swap(spare_imu_measurements_);
+  }
+
   ///--------------------
   /// If BA has converged, integrate IMU measurements (if available) instead
   /// of doing full pyramid.
   bool use_pyramid = true;
-  if (ba_has_converged_ && FLAGS_imu_seeding) {
+  if (ba_result_.converged && tracker_options_.imu_seeding) {
     // Get IMU measurements between keyframe and current frame.
     CHECK_LT(current_time_, time);
-    std::vector<ImuMeasurement> imu_measurements =
-        imu_buffer_.GetRange(current_time_, time);
+    std::vector<ImuMeasurement>& imu_measurements =
+        dtrack_rel_pose.imu_measurements;
+    // End time first: samples pushed after it was read may be missing.
+    dtrack_rel_pose.imu_complete = imu_buffer_.EndTime() >= time;
+    imu_buffer_.GetRange(current_time_, time, imu_measurements);
+
+    // The adjusted pose lags the last frame while the BA back-end catches
+    // up. Its velocity is stale by then, so it is brought up to the last
+    // frame with the IMU too, not with the DTrack edges.
+    const ba::PoseT<double>& adjusted_pose = ba_result_.pose;
+    CHECK_LE(adjusted_pose.time, current_time_);
+    ba::PoseT<double> last_adjusted_pose = adjusted_pose;
+    bool lag_integrated = true;
+    if (adjusted_pose.time < current_time_) {
+      imu_buffer_.GetRange(adjusted_pose.time, current_time_,
+                           imu_lag_measurements_);
+      if (imu_lag_measurements_.size() < 2) {
+        lag_integrated = false;
+      } else {
+        imu_poses_.clear();
+        const ba::ImuPoseT<double> lag_pose =
+            decltype(bundle_adjuster_)::ImuResidual::IntegrateResidual(
+              adjusted_pose, imu_lag_measurements_,
+              adjusted_pose.b.head<3>(), adjusted_pose.b.tail<3>(),
+              gravity_, imu_poses_);
+        last_adjusted_pose.t_wp = lag_pose.t_wp;
+        last_adjusted_pose.v_w  = lag_pose.v_w;
+        last_adjusted_pose.time = current_time_;
+      }
+    }
 
-    if (imu_measurements.size() < 3) {
+    if (!lag_integrated || imu_measurements.size() < 3) {
       LOG(WARNING) << "Not integrating IMU since few measurements were found between: " <<
-                      current_time_ << " and " << time;
+                      adjusted_pose.time << " and " << time;
       LOG(WARNING) << "Doing full pyramid visual only estimation instead.";
     } else {
-      std::vector<ba::ImuPoseT<double> > imu_poses;
-
-      ba::PoseT<double>& last_adjusted_pose = ba_window_.back();
-      CHECK_EQ(current_time_, last_adjusted_pose.time);
+      // Intermediate poses are not used; the buffer keeps its capacity.
+      imu_poses_.clear();
 
       ba::ImuPoseT<double> new_pose =
           decltype(bundle_adjuster_)::ImuResidual::IntegrateResidual(
             last_adjusted_pose, imu_measurements,
             last_adjusted_pose.b.head<3>(), last_adjusted_pose.b.tail<3>(),
-            bundle_adjuster_.GetImuCalibration().g_vec, imu_poses);
+            gravity_, imu_poses_);
 
       // Get new relative transform to seed ESM.
       rel_pose_estimate = last_adjusted_pose.t_wp.inverse() * new_pose.t_wp;
@@ -375,26 +447,55 @@ void Tracker::Estimate(
   }
 
 
+  ///--------------------
+  /// Otherwise, predict with constant velocity.
+  bool skip_coarse_levels = false;
+  if (use_pyramid && motion_prior_.enabled) {
+    skip_coarse_levels = _PredictMotion(time, rel_pose_estimate);
+  }
+
+
   ///--------------------
   /// RGBD pose estimation.
+  /// DTrack estimates the frame with respect to the keyframe, seeded with the
+  /// last frame's pose composed with the relative estimate.
   unsigned int        dtrack_num_obs;
   double              dtrack_error;
   Eigen::Matrix6d     dtrack_covariance;
-
-  if (use_pyramid) {
-    // TODO(jfalquez) If constant velocity model is to be used, this is the
-    // place to add it before calling DTrack's estimate. Do not use it on the
-    // else statement, since rel_pose_estimate should have IMU integration.
-    dtrack_error = dtrack_.Estimate(true, grey_image, rel_pose_estimate,
-                                    dtrack_covariance, dtrack_num_obs);
+  Sophus::SE3d        Tkc = Tkc_ * rel_pose_estimate;
+
+  if (use_pyramid && skip_coarse_levels) {
+    dtrack_error = dtrack_.Estimate(motion_prior_policy_, grey_image, Tkc,
+                                    dtrack_covariance, dtrack_num_obs,
+                                    &dtrack_report_);
+  } else if (use_pyramid) {
+    dtrack_error = dtrack_.Estimate(true, grey_image, Tkc,
+                                    dtrack_covariance, dtrack_num_obs,
+                                    &dtrack_report_);
   } else {
-    dtrack_error = dtrack_.Estimate(false, grey_image, rel_pose_estimate,
-                                    dtrack_covariance, dtrack_num_obs);
+    dtrack_error = dtrack_.Estimate(false, grey_image, Tkc,
+                                    dtrack_covariance, dtrack_num_obs,
+                                    &dtrack_report_);
   }
 
   LOG_IF(WARNING, dtrack_num_obs < (grey_image.cols*grey_image.rows*0.3))
       << "Number of observations for DTrack is less than 30%!";
 
+  // BA constrains consecutive frames.
+  rel_pose_estimate = Tkc_.inverse() * Tkc;
+
+  // DTrack's covariance is of the keyframe to frame estimate, perturbed as
+  // Tck = Tck exp(e). Move it to the frame to frame edge:
+  //   Tcp = Tck exp(e_c) exp(-e_p) Tkp = Tcp exp(Ad(Tpk) (e_c - e_p)).
+  // NOTE: This is an approximation. e_c and e_p come from the same keyframe
+  // and are correlated, and consecutive edges share e_p with opposite signs.
+  // BA treats edges as independent, so the cross terms are dropped; summing
+  // both covariances keeps each edge on the conservative side.
+  const Eigen::Matrix6d keyframe_covariance = dtrack_covariance;
+  const Eigen::Matrix6d Ad_pk = Tkc_.inverse().Adj();
+  dtrack_covariance = Ad_pk * (keyframe_covariance + Tkc_covariance_)
+      * Ad_pk.transpose();
+
   // Transform covariance from tangent space to euclidean.
   // TODO(jfalquez) Verify this.
   Sophus::SO3d rotation = rel_pose_estimate.so3().inverse();
@@ -440,16 +541,99 @@ void Tracker::Estimate(
   rel_pose_estimate = Tic_ * rel_pose_estimate * Tic_.inverse();
   vo_pose = rel_pose_estimate;
 
-  // Push pose estimate into DTrack window.
-  DTrackPose dtrack_rel_pose;
+  // New edge of the pose graph.
   dtrack_rel_pose.T_ab        = rel_pose_estimate;
   dtrack_rel_pose.covariance  = dtrack_covariance;
   dtrack_rel_pose.time_a      = current_time_;
   dtrack_rel_pose.time_b      = time;
-  dtrack_window_.push_back(dtrack_rel_pose);
 
-  // Set current frame as new keyframe.
-  dtrack_.SetKeyframe(grey_image, depth_image);
+  // Switch keyframe if the policy asks for it, reusing the pyramid DTrack
+  // already built for this frame. Otherwise keep the cached keyframe.
+  is_keyframe_ = _NeedsNewKeyframe(Tkc, dtrack_num_obs, time);
+  if (is_keyframe_) {
+    dtrack_.PromoteLiveToKeyframe(depth_image);
+    Tkc_ = Sophus::SE3d();
+    Tkc_covariance_.setZero();
+    keyframe_time_ = time;
+    keyframe_num_obs_ = 0;
+  } else {
+    Tkc_ = Tkc;
+    Tkc_covariance_ = keyframe_covariance;
+    if (keyframe_num_obs_ == 0) {
+      keyframe_num_obs_ = dtrack_num_obs;
+    }
+  }
+
+  // Keep the edge until BA has adjusted the frame it ends at.
+  DTrackPose vo_edge;
+  vo_edge.T_ab        = dtrack_rel_pose.T_ab;
+  vo_edge.covariance  = dtrack_rel_pose.covariance;
+  vo_edge.time_a      = dtrack_rel_pose.time_a;
+  vo_edge.time_b      = dtrack_rel_pose.time_b;
+  vo_edges_.push_back(vo_edge);
+
+  // Hand the edge over to BA. The back-end only blocks Estimate if it is
+  // a whole queue behind.
+  if (tracker_options_.async_ba) {
+    while (!edge_queue_.TryPush(dtrack_rel_pose)) {
+      std::this_thread::yield();
+    }
+    _TakeBAResults();
+  } else {
+    _AddToWindow(dtrack_rel_pose, true);
+    ba_result_.converged = ba_has_converged_;
+    ba_result_.pose      = ba_window_.back();
+    _TakeBAResults();
+  }
+
+  // If BA has not converged yet, return visual only global pose.
+  // Otherwise, return BA's adjusted pose.
+  if (ba_result_.converged == false) {
+    current_pose_ *= rel_pose_estimate;
+    rel_pose = rel_pose_estimate;
+  } else if (tracker_options_.async_ba) {
+    // BA may be a few frames behind: apply its correction to the visual
+    // estimates since.
+    ba::PoseT<double> latest_pose;
+    _PropagateBAResult(latest_pose);
+    rel_pose = current_pose_.inverse() * latest_pose.t_wp;
+    current_pose_ = latest_pose.t_wp;
+  } else {
+    ba::PoseT<double>& last_adjusted_pose = ba_window_.back();
+    current_pose_ = last_adjusted_pose.t_wp;
+    ba::PoseT<double>& last_last_adjusted_pose = ba_window_[ba_window_.size()-2];
+    rel_pose = last_last_adjusted_pose.t_wp.inverse() * last_adjusted_pose.t_wp;
+  }
+
+  // Update last estimated pose.
+  last_estimated_pose_ = global_pose;
+
+  // Update time.
+  current_time_ = time;
+
+  // Update return pose.
+  global_pose = current_pose_;
+
+  // "Map".
+  KeyframeStore::Frame dtrack_rel_pose_out;
+  dtrack_rel_pose_out.T_ab        = rel_pose;
+  dtrack_rel_pose_out.covariance  = dtrack_covariance;
+  dtrack_rel_pose_out.time_a      = current_time_;
+  dtrack_rel_pose_out.time_b      = time;
+  dtrack_rel_pose_out.thumbnail   = GenerateThumbnail(grey_image).clone();
+  keyframe_store_.Add(dtrack_rel_pose_out, grey_image, depth_image);
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+void Tracker::_AddToWindow(
+    DTrackPose&   edge,
+    bool          solve
+  )
+{
+  // Push pose estimate into DTrack window.
+  const double time = edge.time_b;
+  dtrack_window_.push_back(std::move(edge));
 
   // Get latest adjusted pose.
   ba::PoseT<double>& latest_adjusted_pose = ba_window_.back();
@@ -459,131 +643,272 @@ void Tracker::Estimate(
   // velocities or anything affect BA?
   ba::PoseT<double> latest_pose;
   latest_pose = latest_adjusted_pose;
-  latest_pose.t_wp = latest_adjusted_pose.t_wp * dtrack_rel_pose.T_ab;
+  latest_pose.t_wp = latest_adjusted_pose.t_wp * dtrack_window_.back().T_ab;
   latest_pose.time = time;
   ba_window_.push_back(latest_pose);
 
 
   ///--------------------
   /// Windowed BA.
-  if (dtrack_window_.size() >= 2 && FLAGS_use_imu) {
+  if (dtrack_window_.size() >= 2 && tracker_options_.use_imu) {
     // Sanity check.
     CHECK_EQ(ba_window_.size(), dtrack_window_.size()+1)
         << "BA: " << ba_window_.size() << " DTrack: " << dtrack_window_.size();
 
-    bundle_adjuster_.Init(options_, kWindowSize, kWindowSize*10);
+    // A window that is about to be extended again is not solved.
+    if (solve) {
+      bundle_adjuster_.Init(options_, kWindowSize, kWindowSize*10);
 
-    // Reset IMU residuals IDs.
-    imu_residual_ids_.clear();
+      // Reset IMU residuals IDs.
+      imu_residual_ids_.clear();
 
-    // Push first pose and keep track of ID.
-    int cur_id, prev_id;
-    ba::PoseT<double>& front_adjusted_pose = ba_window_.front();
+      // Push first pose and keep track of ID.
+      int cur_id, prev_id;
+      ba::PoseT<double>& front_adjusted_pose = ba_window_.front();
 //    std::cout << "-- First pose velocity: " << front_adjusted_pose.v_w.transpose()
 //              << std::endl;
-    prev_id = bundle_adjuster_.AddPose(front_adjusted_pose.t_wp,
-                                       front_adjusted_pose.cam_params,
-                                       front_adjusted_pose.v_w,
-                                       front_adjusted_pose.b,
-                                       front_adjusted_pose.is_active,
-                                       front_adjusted_pose.time);
-
-    // Set this pose as root ID.
-    bundle_adjuster_.SetRootPoseId(prev_id);
-
-    // Push rest of BA poses.
-    for (size_t ii = 1; ii < ba_window_.size(); ++ii) {
-      ba::PoseT<double>& adjusted_pose = ba_window_[ii];
-      cur_id = bundle_adjuster_.AddPose(adjusted_pose.t_wp,
-                                        adjusted_pose.cam_params,
-                                        adjusted_pose.v_w,
-                                        adjusted_pose.b, true,
-                                        adjusted_pose.time);
-
-      DTrackPose& dtrack_rel_pose = dtrack_window_[ii-1];
-
-      CHECK_EQ(adjusted_pose.time, dtrack_rel_pose.time_b);
-
-      // Add binary constraints.
-      CHECK_EQ(cur_id-1, prev_id);
-      bundle_adjuster_.AddBinaryConstraint(prev_id, cur_id,
-                                           dtrack_rel_pose.T_ab,
-                                           dtrack_rel_pose.covariance);
-
-      // Get IMU measurements between frames.
-      std::vector<ImuMeasurement> imu_measurements =
-          imu_buffer_.GetRange(dtrack_rel_pose.time_a, dtrack_rel_pose.time_b);
+      prev_id = bundle_adjuster_.AddPose(front_adjusted_pose.t_wp,
+                                         front_adjusted_pose.cam_params,
+                                         front_adjusted_pose.v_w,
+                                         front_adjusted_pose.b,
+                                         front_adjusted_pose.is_active,
+                                         front_adjusted_pose.time);
+
+      // Set this pose as root ID.
+      bundle_adjuster_.SetRootPoseId(prev_id);
+
+      // Push rest of BA poses.
+      for (size_t ii = 1; ii < ba_window_.size(); ++ii) {
+        ba::PoseT<double>& adjusted_pose = ba_window_[ii];
+        cur_id = bundle_adjuster_.AddPose(adjusted_pose.t_wp,
+                                          adjusted_pose.cam_params,
+                                          adjusted_pose.v_w,
+                                          adjusted_pose.b, true,
+                                          adjusted_pose.time);
+
+        DTrackPose& dtrack_rel_pose = dtrack_window_[ii-1];
+
+        CHECK_EQ(adjusted_pose.time, dtrack_rel_pose.time_b);
+
+        // Add binary constraints.
+        CHECK_EQ(cur_id-1, prev_id);
+        bundle_adjuster_.AddBinaryConstraint(prev_id, cur_id,
+                                             dtrack_rel_pose.T_ab,
+                                             dtrack_rel_pose.covariance);
+
+        // Get IMU measurements between frames. Edges already covered by the
+        // buffer keep theirs, so each range is only looked up once.
+        if (!dtrack_rel_pose.imu_complete) {
+          dtrack_rel_pose.imu_complete =
+              imu_buffer_.EndTime() >= dtrack_rel_pose.time_b;
+          imu_buffer_.GetRange(dtrack_rel_pose.time_a, dtrack_rel_pose.time_b,
+                               dtrack_rel_pose.imu_measurements);
+        }
 
 #if USE_IMU
-      // Add IMU constraints.
-      imu_residual_ids_.push_back(
-            bundle_adjuster_.AddImuResidual(prev_id, cur_id, imu_measurements));
+        // Add IMU constraints.
+        imu_residual_ids_.push_back(
+              bundle_adjuster_.AddImuResidual(prev_id, cur_id,
+                                              dtrack_rel_pose.imu_measurements));
 #endif
 
-      // Update pose IDs.
-      prev_id = cur_id;
-    }
+        // Update pose IDs.
+        prev_id = cur_id;
+      }
 
-    // Solve.
-    bundle_adjuster_.Solve(1000, 1.0, false);
+      // Solve.
+      bundle_adjuster_.Solve(1000, 1.0, false);
 
-    // NOTE(jfalquez) This is a hack since BA has that weird memory problem
-    // and the minimum window has to be set to 2. However, the real minimum
-    // window is controlled here.
-    if (ba_window_.size() == kWindowSize) {
-      ba_has_converged_ = true;
-    }
+      // NOTE(jfalquez) This is a hack since BA has that weird memory problem
+      // and the minimum window has to be set to 2. However, the real minimum
+      // window is controlled here. Not an equality: an async back-end that
+      // is catching up may skip the solve of the first full window.
+      if (ba_window_.size() >= kWindowSize) {
+        ba_has_converged_ = true;
+      }
 
-    // Get adjusted poses.
-    ba_window_.clear();
-    for (size_t ii = 0; ii < bundle_adjuster_.GetNumPoses(); ++ii) {
-      ba_window_.push_back(bundle_adjuster_.GetPose(ii));
+      // Get adjusted poses.
+      ba_window_.clear();
+      for (size_t ii = 0; ii < bundle_adjuster_.GetNumPoses(); ++ii) {
+        ba_window_.push_back(bundle_adjuster_.GetPose(ii));
+      }
     }
+  }
 
-    // Pop front element of DTrack estimates.
-    if (dtrack_window_.size() == kWindowSize) {
-      dtrack_window_.pop_front();
-      ba_window_.pop_front();
-      ba::PoseT<double>& front_adjusted_pose = ba_window_.front();
+  ///--------------------
+  /// Pop front element of DTrack estimates. Done without IMU too, so visual
+  /// only windows stay bounded.
+  if (dtrack_window_.size() == kWindowSize) {
+    // Kept for the next edge rather than freed.
+    spare_imu_measurements_.swap(dtrack_window_.front().imu_measurements);
+    spare_imu_measurements_.clear();
+    dtrack_window_.erase(dtrack_window_.begin());
+    ba_window_.erase(ba_window_.begin());
+    ba::PoseT<double>& front_adjusted_pose = ba_window_.front();
 //      front_adjusted_pose.is_active = false;
 //      std::cout << "-- Popping pose." << std::endl;
+
+    // IMU samples before the window are no longer needed.
+    imu_buffer_.EvictBefore(dtrack_window_.front().time_a);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+void Tracker::_PropagateBAResult(ba::PoseT<double>& pose) const
+{
+  pose = ba_result_.pose;
+  for (const DTrackPose& edge : vo_edges_) {
+    if (edge.time_a >= ba_result_.pose.time) {
+      pose.t_wp *= edge.T_ab;
+      pose.time  = edge.time_b;
     }
   }
+}
 
-  // If BA has not converged yet, return visual only global pose.
-  // Otherwise, return BA's adjusted pose.
-  if (ba_has_converged_ == false) {
-    current_pose_ *= rel_pose_estimate;
-    rel_pose = rel_pose_estimate;
-  } else {
-    ba::PoseT<double>& last_adjusted_pose = ba_window_.back();
-    current_pose_ = last_adjusted_pose.t_wp;
-    ba::PoseT<double>& last_last_adjusted_pose = ba_window_[ba_window_.size()-2];
-    rel_pose = last_last_adjusted_pose.t_wp.inverse() * last_adjusted_pose.t_wp;
+
+///////////////////////////////////////////////////////////////////////////
+void Tracker::_TakeBAResults()
+{
+  BAResult result;
+  while (result_queue_.TryPop(result)) {
+    ba_result_ = result;
   }
 
-  // Update last estimated pose.
-  last_estimated_pose_ = global_pose;
+  // Adjusted edges are only kept for the motion prior.
+  while (vo_edges_.size() > 2
+         && vo_edges_.front().time_b <= ba_result_.pose.time) {
+    vo_edges_.erase(vo_edges_.begin());
+  }
+}
 
-  // Update time.
-  current_time_ = time;
 
-  // Update return pose.
-  global_pose = current_pose_;
+///////////////////////////////////////////////////////////////////////////
+void Tracker::_BackEndLoop()
+{
+  DTrackPose edge;
+  BAResult   result;
+  while (true) {
+    if (back_end_pause_.load(std::memory_order_acquire)
+        && !back_end_stop_.load(std::memory_order_acquire)) {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      continue;
+    }
+    if (!edge_queue_.TryPop(edge)) {
+      // Stopping still drains what Estimate already handed over.
+      if (back_end_stop_.load(std::memory_order_acquire)) {
+        if (edge_queue_.Empty()) {
+          break;
+        }
+        continue;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      continue;
+    }
 
-  // "Map".
-  DTrackPoseOut dtrack_rel_pose_out;
-  dtrack_rel_pose_out.T_ab        = rel_pose;
-  dtrack_rel_pose_out.covariance  = dtrack_covariance;
-  dtrack_rel_pose_out.time_a      = current_time_;
-  dtrack_rel_pose_out.time_b      = time;
-  dtrack_rel_pose_out.grey_img    = grey_image.clone();
-  dtrack_rel_pose_out.depth_img   = depth_image.clone();
-  dtrack_rel_pose_out.thumbnail   = GenerateThumbnail(grey_image).clone();
-  dtrack_vector_.push_back(dtrack_rel_pose_out);
+    // If frames come in faster than BA solves, catch up by only solving
+    // the window of the newest one.
+    const bool solve = edge_queue_.Empty();
+    _AddToWindow(edge, solve);
+    if (!solve) {
+      continue;
+    }
+
+    result.converged = ba_has_converged_;
+    result.pose      = ba_window_.back();
+    while (!result_queue_.TryPush(result)
+           && !back_end_stop_.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+void Tracker::_StopBackEnd()
+{
+  if (!back_end_.joinable()) {
+    return;
+  }
+  back_end_stop_.store(true, std::memory_order_release);
+  back_end_.join();
+  back_end_stop_.store(false, std::memory_order_relaxed);
+
+  // The window is ours again, and it is up to date.
+  BAResult result;
+  while (result_queue_.TryPop(result)) {
+  }
+  if (!ba_window_.empty()) {
+    ba_result_.converged = ba_has_converged_;
+    ba_result_.pose      = ba_window_.back();
+  }
+  _TakeBAResults();
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+bool Tracker::_NeedsNewKeyframe(
+    const Sophus::SE3d&   Tkc,
+    unsigned int          num_obs,
+    double                time
+  ) const
+{
+  const KeyframePolicy& policy = keyframe_policy_;
+  if (time - keyframe_time_ >= policy.max_time) {
+    return true;
+  }
+  if (Tkc.translation().norm() > policy.max_translation
+      || Tkc.so3().log().norm() > policy.max_rotation) {
+    return true;
+  }
+  const size_t num_points = dtrack_.NumKeyframePoints(0);
+  if (num_points > 0 && num_obs < policy.min_overlap * num_points) {
+    return true;
+  }
+  if (keyframe_num_obs_ > 0
+      && num_obs < policy.min_obs_ratio * keyframe_num_obs_) {
+    return true;
+  }
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////
+bool Tracker::_PredictMotion(
+    double                time,
+    Sophus::SE3d&         rel_pose
+  ) const
+{
+  if (vo_edges_.empty()) {
+    return false;
+  }
+
+  // Velocities in the camera (vision) frame. The window is in IMU frame.
+  auto velocity = [this](const DTrackPose& pose) {
+    const Sophus::SE3d T_ab = Tic_.inverse() * pose.T_ab * Tic_;
+    return Eigen::Vector6d(T_ab.log() / (pose.time_b - pose.time_a));
+  };
+
+  const double dt = time - current_time_;
+  const DTrackPose& last = vo_edges_.back();
+  if (last.time_b <= last.time_a) {
+    return false;
+  }
+  const Eigen::Vector6d last_velocity = velocity(last);
+  rel_pose = Sophus::SE3d::exp(last_velocity * dt);
+
+  // Trust the prediction only if the motion was steady.
+  if (vo_edges_.size() < 2) {
+    return false;
+  }
+  const DTrackPose& previous = vo_edges_[vo_edges_.size()-2];
+  if (previous.time_b <= previous.time_a) {
+    return false;
+  }
+  const Eigen::Vector6d error = (last_velocity - velocity(previous)) * dt;
+  return error.head<3>().norm() < motion_prior_.max_translation_error
+      && error.tail<3>().norm() < motion_prior_.max_rotation_error;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 void Tracker::RefinePose(
     const cv::Mat&    grey_image,
@@ -677,8 +1002,10 @@ void Tracker::ExportMap()
   std::ofstream fw;
   fw.open("map/poses.txt");
 
-  for (size_t ii = 0; ii < dtrack_vector_.size(); ++ii) {
-    DTrackPoseOut& dtrack_pose = dtrack_vector_[ii];
+  cv::Mat grey_img, depth_img;
+  for (size_t ii = 0; ii < keyframe_store_.Size(); ++ii) {
+    const KeyframeStore::Frame& dtrack_pose = keyframe_store_[ii];
+    keyframe_store_.GetImages(ii, grey_img, depth_img);
 
     // Export file of poses.
     fw << T2Cart(dtrack_pose.T_wp.matrix()).transpose() << std::endl;
@@ -692,18 +1019,18 @@ void Tracker::ExportMap()
     depth_filename = depth_file_prefix + index + ".pdm";
     std::ofstream file(depth_filename.c_str(), std::ios::out | std::ios::binary);
     file << "P7" << std::endl;
-    file << dtrack_pose.depth_img.cols << " " << dtrack_pose.depth_img.rows << std::endl;
-    unsigned int size = dtrack_pose.depth_img.elemSize1()
-        * dtrack_pose.depth_img.rows * dtrack_pose.depth_img.cols;
+    file << depth_img.cols << " " << depth_img.rows << std::endl;
+    unsigned int size = depth_img.elemSize1()
+        * depth_img.rows * depth_img.cols;
     file << 4294967295 << std::endl;
-    file.write((const char*)dtrack_pose.depth_img.data, size);
+    file.write((const char*)depth_img.data, size);
     file.close();
 
     // Save grey image.
     std::string grey_prefix = "map/grey_";
     std::string grey_filename;
     grey_filename = grey_prefix + index + ".pgm";
-    cv::imwrite(grey_filename, dtrack_pose.grey_img);
+    cv::imwrite(grey_filename, grey_img);
 
     std::cout << "-- Saving: " << depth_filename << " " <<
               grey_filename << std::endl;
@@ -764,11 +1091,7 @@ void Tracker::ImportMap(const std::string& map_path)
     std::string grey_filename;
     grey_filename = map_path + grey_prefix + index_string + ".pgm";
     map_frame.grey_img = cv::imread(grey_filename, -1);
-    // Build pyramids.
-    std::vector<cv::Mat> pyramid;
-    const int thumb_level = 4;
-    cv::buildPyramid(map_frame.grey_img, pyramid, thumb_level);
-    map_frame.thumbnail = pyramid[thumb_level-1].clone();
+    map_frame.thumbnail = GenerateThumbnail(map_frame.grey_img).clone();
 
 
     dtrack_map_.push_back(map_frame);
@@ -786,21 +1109,24 @@ void Tracker::RunBatchBAwithLC()
 {
   // Init pose only BA.
   pose_relaxer_.debug_level_threshold = -1;
-  pose_relaxer_.Init(options_, dtrack_vector_.size(), dtrack_vector_.size()*5);
+  pose_relaxer_.Init(options_, keyframe_store_.Size(),
+                     keyframe_store_.Size()*5);
 
-  // Reset IMU residuals IDs.
-  imu_residual_ids_.clear();
+  // Reset IMU residuals IDs, unless the BA back-end owns them.
+  if (!tracker_options_.async_ba) {
+    imu_residual_ids_.clear();
+  }
 
   ///-------------------- PUSH VO AND IMU CONSTRAINTS
   // Push first pose and keep track of ID.
   int cur_id, prev_id;
   Sophus::SE3d global_pose;
-  DTrackPoseOut& dtrack_estimate = dtrack_vector_[1];
+  const KeyframeStore::Frame& dtrack_estimate = keyframe_store_[1];
   prev_id = pose_relaxer_.AddPose(global_pose, true, dtrack_estimate.time_a);
 
   // Push rest of BA poses.
-  for (size_t ii = 2; ii < dtrack_vector_.size(); ++ii) {
-    DTrackPoseOut& dtrack_estimate = dtrack_vector_[ii-1];
+  for (size_t ii = 2; ii < keyframe_store_.Size(); ++ii) {
+    const KeyframeStore::Frame& dtrack_estimate = keyframe_store_[ii-1];
     global_pose = global_pose * dtrack_estimate.T_ab;
 
     cur_id = pose_relaxer_.AddPose(global_pose, true, dtrack_estimate.time_b);
@@ -812,8 +1138,9 @@ void Tracker::RunBatchBAwithLC()
 
 #if 0
     // Get IMU measurements between frames.
-    std::vector<ImuMeasurement> imu_measurements =
-        imu_buffer_.GetRange(dtrack_estimate.time_a, dtrack_estimate.time_b);
+    std::vector<ImuMeasurement> imu_measurements;
+    imu_buffer_.GetRange(dtrack_estimate.time_a, dtrack_estimate.time_b,
+                         imu_measurements);
 
     // Add IMU constraint.
     imu_residual_ids_.push_back(
@@ -827,8 +1154,9 @@ void Tracker::RunBatchBAwithLC()
 
   ///-------------------- CHECK LOOP CLOSURES AND ADD LC CONSTRAINTS
 
-  for (size_t ii = 0; ii < dtrack_vector_.size(); ++ii) {
-    DTrackPoseOut& dtrack_estimate = dtrack_vector_[ii];
+  cv::Mat keyframe_grey, keyframe_depth;
+  for (size_t ii = 0; ii < keyframe_store_.Size(); ++ii) {
+    const KeyframeStore::Frame& dtrack_estimate = keyframe_store_[ii];
 
     std::vector<std::pair<unsigned int, float> > candidates;
     FindLoopClosureCandidates(500, ii, dtrack_estimate.thumbnail,
@@ -836,29 +1164,48 @@ void Tracker::RunBatchBAwithLC()
 
 #if 0
     if (!candidates.empty()) {
-      cv::imshow("Keyframe", dtrack_estimate.grey_img);
+      cv::imshow("Keyframe", keyframe_store_.GetGrey(ii));
       for (size_t ii = 0; ii < candidates.size(); ++ii) {
         int index = std::get<0>(candidates[ii]);
-        DTrackPoseOut& dtrack_match = dtrack_vector_[index];
-        cv::imshow("Match", dtrack_match.grey_img);
+        cv::imshow("Match", keyframe_store_.GetGrey(index));
         cv::waitKey(5000);
       }
     }
 #endif
 
-    // If loop closure candidates found, chose the "best" one and track against it.
+    // If loop closure candidates found, track the best ones against the
+    // keyframe in one batch and keep the one with the lowest error. The
+    // refine instance is used so the tracking keyframe is left intact.
     if (!candidates.empty()) {
-      dtrack_.SetKeyframe(dtrack_estimate.grey_img, dtrack_estimate.depth_img);
+      keyframe_store_.GetImages(ii, keyframe_grey, keyframe_depth);
+      dtrack_refine_.SetKeyframe(keyframe_grey, keyframe_depth);
 
-      int index = std::get<0>(candidates[0]);
-      DTrackPoseOut& dtrack_match = dtrack_vector_[index];
+      if (candidates.size() > kMaxLoopClosureCandidates) {
+        candidates.resize(kMaxLoopClosureCandidates);
+      }
+      std::vector<cv::Mat> match_images;
+      for (const std::pair<unsigned int, float>& candidate : candidates) {
+        match_images.push_back(keyframe_store_.GetGrey(candidate.first));
+      }
 
-      double              dtrack_error;
-      Sophus::SE3d        Trl;
-      unsigned int        dtrack_num_obs;
-      Eigen::Matrix6d     dtrack_covariance;
-      dtrack_error = dtrack_.Estimate(true, dtrack_match.grey_img, Trl,
-                                      dtrack_covariance, dtrack_num_obs);
+      std::vector<Sophus::SE3d>   Trls(candidates.size());
+      std::vector<double>         dtrack_errors;
+      std::vector<unsigned int>   dtrack_num_obs;
+      std::vector<Eigen::Matrix6d,
+          Eigen::aligned_allocator<Eigen::Matrix6d> > dtrack_covariances;
+      dtrack_refine_.EstimateHypotheses(dtrack_refine_.DefaultPolicy(true),
+                                        match_images, Trls, dtrack_errors,
+                                        dtrack_num_obs, dtrack_covariances,
+                                        kLoopClosureSurvivors);
+
+      const size_t best = std::min_element(dtrack_errors.begin(),
+                                           dtrack_errors.end())
+          - dtrack_errors.begin();
+      int index = std::get<0>(candidates[best]);
+
+      double                  dtrack_error = dtrack_errors[best];
+      Sophus::SE3d            Trl = Trls[best];
+      const Eigen::Matrix6d&  dtrack_covariance = dtrack_covariances[best];
 
       // Transfer relative pose to IMU frame.
       Trl = Tic_ * Trl * Tic_.inverse();
@@ -868,8 +1215,8 @@ void Tracker::RunBatchBAwithLC()
         LOG(INFO) << "Loop closure found!";
         pose_relaxer_.AddBinaryConstraint(ii, index, Trl, dtrack_covariance);
 #if 1
-        cv::imshow("Keyframe", dtrack_estimate.grey_img);
-        cv::imshow("Match", dtrack_match.grey_img);
+        cv::imshow("Keyframe", keyframe_grey);
+        cv::imshow("Match", match_images[best]);
         cv::waitKey(8000);
 #endif
       }
@@ -882,8 +1229,7 @@ void Tracker::RunBatchBAwithLC()
   // Update adjusted poses.
   for (size_t ii = 0; ii < pose_relaxer_.GetNumPoses(); ++ii) {
     const ba::PoseT<double>& pose = pose_relaxer_.GetPose(ii);
-    DTrackPoseOut& dtrack_pose = dtrack_vector_[ii];
-    dtrack_pose.T_wp = pose.t_wp;
+    keyframe_store_[ii].T_wp = pose.t_wp;
   }
 }
 
@@ -898,7 +1244,7 @@ bool Tracker::WhereAmI(
   frame_id = -1;
   Twp = Sophus::SE3d();
 
-  cv::Mat thumbnail = GenerateThumbnail(image);
+  const cv::Mat& thumbnail = GenerateThumbnail(image);
 
   std::vector<std::pair<unsigned int, float> > candidates;
   const float max_score = 5.0 * (thumbnail.rows * thumbnail.cols);
@@ -952,14 +1298,20 @@ bool Tracker::WhereAmI(
 }
 
 ///////////////////////////////////////////////////////////////////////////
-cv::Mat Tracker::GenerateThumbnail(const cv::Mat& image)
+const cv::Mat& Tracker::GenerateThumbnail(const cv::Mat& image)
 {
-  cv::Mat thumbnail;
-  const int thumb_level = 4;
-  std::vector<cv::Mat> pyramid;
-  cv::buildPyramid(image, pyramid, thumb_level);
-  thumbnail = pyramid[thumb_level-1].clone();
-  return thumbnail;
+  // Intermediate levels are pool buffers too, so nothing is allocated once
+  // the pool has seen this resolution.
+  const unsigned int thumb_level = 3;
+  const cv::Mat* level_img = &image;
+  for (unsigned int level = 1; level <= thumb_level; ++level) {
+    cv::Mat& next_img = thumbnail_pool_.Get(level, (level_img->rows+1)/2,
+                                            (level_img->cols+1)/2,
+                                            image.type());
+    PyrDown(*level_img, next_img, level, thumbnail_pool_);
+    level_img = &next_img;
+  }
+  return *level_img;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -970,5 +1322,6 @@ void Tracker::AddInertialMeasurement(
     )
 {
   ImuMeasurement imu(gyro, accel, time);
-  imu_buffer_.AddElement(imu);
+  LOG_IF(WARNING, !imu_buffer_.Push(imu))
+      << "Dropping IMU measurement not newer than the last one: " << time;
 }
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <vidtrack/dtrack.h>
+
+#include "../src/dtrack_simd.h"
+#include "test_scene.h"
+
+typedef std::chrono::steady_clock Clock;
+
+
+/////////////////////////////////////////////////////////////////////////////
+inline double Milliseconds(Clock::duration duration)
+{
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Frame to frame tracking of a whole sequence.
+struct TrackingResult {
+  double    estimate_time = 0;        // Mean per frame (ms).
+  double    build_problem_time = 0;   // Best finest level BuildProblem (ms).
+  double    max_translation = 0;      // Drift from ground truth (m).
+  double    max_rotation = 0;         // Drift from ground truth (rad).
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+TrackingResult Track(
+    const TestSequence&       sequence,
+    const DTrack::Options&    options
+  )
+{
+  const int kBuildProblemRuns = 20;
+
+  DTrack dtrack(4);
+  dtrack.SetParams(sequence.K, sequence.K, sequence.K, Sophus::SE3d());
+  dtrack.SetOptions(options);
+
+  TrackingResult result;
+  result.build_problem_time = FLT_MAX;
+  Sophus::SE3d Twc;
+  for (size_t ii = 1; ii < sequence.grey.size(); ++ii) {
+    dtrack.SetKeyframe(sequence.grey[ii-1], sequence.depth[ii-1]);
+
+    Sophus::SE3d      Trl;
+    Eigen::Matrix6d   covariance;
+    unsigned int      num_obs;
+    const Clock::time_point start = Clock::now();
+    dtrack.Estimate(true, sequence.grey[ii], Trl, covariance, num_obs);
+    result.estimate_time += Milliseconds(Clock::now() - start);
+
+    // Finest level problem at the estimate, live pyramid already built.
+    for (int jj = 0; jj < kBuildProblemRuns; ++jj) {
+      Eigen::Matrix6d LHS;
+      Eigen::Vector6d RHS;
+      double          squared_error, number_observations;
+      const Clock::time_point build_start = Clock::now();
+      dtrack.BuildProblem(Trl.inverse(), LHS, RHS, squared_error,
+                          number_observations, 0);
+      result.build_problem_time =
+          std::min(result.build_problem_time,
+                   Milliseconds(Clock::now() - build_start));
+    }
+
+    Twc *= Trl;
+    const Eigen::Vector6d error = (sequence.Twc[ii].inverse() * Twc).log();
+    result.max_translation = std::max(result.max_translation,
+                                      error.head<3>().norm());
+    result.max_rotation    = std::max(result.max_rotation,
+                                      error.tail<3>().norm());
+  }
+  result.estimate_time /= sequence.grey.size() - 1;
+  return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void PrintResult(const char* name, const TrackingResult& result)
+{
+  printf("  %-16s estimate %8.2f ms  build problem %7.3f ms  "
+         "drift %.2e m %.2e rad\n", name, result.estimate_time,
+         result.build_problem_time, result.max_translation,
+         result.max_rotation);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Double precision reference against the single precision kernels. SIMD
+/// kernels the CPU lacks fall back to the widest one it has.
+void BenchKernels(const TestSequence& sequence)
+{
+  printf("Kernels (%dx%d, %zu frames):\n", sequence.grey[0].cols,
+         sequence.grey[0].rows, sequence.grey.size());
+  const DTrack::Kernel kKernels[] = {
+    DTrack::kKernelScalar, DTrack::kKernelFloat, DTrack::kKernelSSE4,
+    DTrack::kKernelAVX2, DTrack::kKernelAVX512
+  };
+  const char* kNames[] = {"scalar (double)", "float", "sse4", "avx2",
+                          "avx512"};
+  for (size_t ii = 0; ii < sizeof(kKernels)/sizeof(kKernels[0]); ++ii) {
+    DTrack::Options options;
+    options.kernel = kKernels[ii];
+    PrintResult(kNames[ii], Track(sequence, options));
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// ESM against inverse compositional, with and without brightness
+/// estimation, on the sequence as rendered and with the exposure of every
+/// frame changed (gain 1 - 0.03 i, bias 2 i, no saturation).
+void BenchSolvers(const TestSequence& sequence)
+{
+  TestSequence exposed = sequence;
+  for (size_t ii = 0; ii < exposed.grey.size(); ++ii) {
+    // Fresh image, the copy shares its pixels with the original.
+    exposed.grey[ii] = cv::Mat();
+    sequence.grey[ii].convertTo(exposed.grey[ii], CV_8UC1, 1.0 - 0.03*ii,
+                                2.0*ii);
+  }
+
+  const TestSequence* kSequences[] = {&sequence, &exposed};
+  const char* kSequenceNames[] = {"constant exposure", "changing exposure"};
+  const char* kNames[] = {"esm", "ic", "esm brightness", "ic brightness"};
+  for (int ii = 0; ii < 2; ++ii) {
+    printf("Solvers, %s:\n", kSequenceNames[ii]);
+    for (int jj = 0; jj < 4; ++jj) {
+      DTrack::Options options;
+      options.use_inverse_compositional = (jj % 2) == 1;
+      options.estimate_brightness       = jj >= 2;
+      PrintResult(kNames[jj], Track(*kSequences[ii], options));
+    }
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Gradients as DTrack computed them before packing: two planar images,
+/// double precision division, one level at a time.
+void CalculateGradientsPlanar(
+    const unsigned char*      image_ptr,
+    int                       image_width,
+    int                       image_height,
+    float*                    gradX_ptr,
+    float*                    gradY_ptr
+  )
+{
+  const int image_width_M1  = image_width - 1;
+  const int image_height_M1 = image_height - 1;
+  for (int vv = 0; vv < image_height; ++vv) {
+    const unsigned char* row_ptr = image_ptr + vv*image_width;
+    const unsigned char* top_row_ptr =
+        (vv == 0) ? row_ptr : row_ptr - image_width;
+    const unsigned char* bottom_row_ptr =
+        (vv == image_height_M1) ? row_ptr : row_ptr + image_width;
+    const double scale_y = (vv == 0 || vv == image_height_M1) ? 1.0 : 2.0;
+    float* rowX_ptr = gradX_ptr + vv*image_width;
+    float* rowY_ptr = gradY_ptr + vv*image_width;
+
+    rowX_ptr[0] = row_ptr[1] - row_ptr[0];
+    rowY_ptr[0] = (bottom_row_ptr[0] - top_row_ptr[0])/scale_y;
+    for (int uu = 1; uu < image_width_M1; ++uu) {
+      rowX_ptr[uu] = (row_ptr[uu+1] - row_ptr[uu-1])/2.0;
+      rowY_ptr[uu] = (bottom_row_ptr[uu] - top_row_ptr[uu])/scale_y;
+    }
+    rowX_ptr[image_width_M1] =
+        row_ptr[image_width_M1] - row_ptr[image_width_M1-1];
+    rowY_ptr[image_width_M1] =
+        (bottom_row_ptr[image_width_M1] - top_row_ptr[image_width_M1])/scale_y;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Same as DTrack::_CalculatePackedImage, with the instruction set given.
+void CalculatePackedImage(
+    dtrack_simd::Isa          isa,
+    const unsigned char*      image_ptr,
+    int                       image_width,
+    int                       image_height,
+    float*                    packed_ptr
+  )
+{
+  const int image_width_M1  = image_width - 1;
+  const int image_height_M1 = image_height - 1;
+  for (int vv = 0; vv < image_height; ++vv) {
+    const unsigned char* row_ptr = image_ptr + vv*image_width;
+    const unsigned char* top_row_ptr =
+        (vv == 0) ? row_ptr : row_ptr - image_width;
+    const unsigned char* bottom_row_ptr =
+        (vv == image_height_M1) ? row_ptr : row_ptr + image_width;
+    const float scale_y = (vv == 0 || vv == image_height_M1) ? 1.0f : 0.5f;
+    float* out_ptr = packed_ptr + 4*vv*image_width;
+
+    out_ptr[0] = row_ptr[0];
+    out_ptr[1] = row_ptr[1] - row_ptr[0];
+    out_ptr[2] = scale_y * (bottom_row_ptr[0] - top_row_ptr[0]);
+    out_ptr[3] = 0;
+
+    const int num_packed = dtrack_simd::PackRow(
+          isa, row_ptr+1, top_row_ptr+1, bottom_row_ptr+1, scale_y,
+          image_width-2, out_ptr+4);
+    for (int uu = 1+num_packed; uu < image_width_M1; ++uu) {
+      float* pixel_ptr = out_ptr + 4*uu;
+      pixel_ptr[0] = row_ptr[uu];
+      pixel_ptr[1] = 0.5f * (row_ptr[uu+1] - row_ptr[uu-1]);
+      pixel_ptr[2] = scale_y * (bottom_row_ptr[uu] - top_row_ptr[uu]);
+      pixel_ptr[3] = 0;
+    }
+
+    float* pixel_ptr = out_ptr + 4*image_width_M1;
+    pixel_ptr[0] = row_ptr[image_width_M1];
+    pixel_ptr[1] = row_ptr[image_width_M1] - row_ptr[image_width_M1-1];
+    pixel_ptr[2] = scale_y * (bottom_row_ptr[image_width_M1]
+                              - top_row_ptr[image_width_M1]);
+    pixel_ptr[3] = 0;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Cost per pyramid level of the planar gradients against the packed image,
+/// scalar and with the SSE4 row kernel (the only one PackRow has), and of a
+/// whole live pyramid. The SSE4 output must match the scalar one bit for bit.
+void BenchGradients(const TestSequence& sequence)
+{
+  const int kLevels = 4;
+  const int kRuns = 50;
+  printf("Gradients (best of %d runs):\n", kRuns);
+
+  const bool has_sse4 = dtrack_simd::DetectIsa() >= dtrack_simd::kIsaSSE4;
+
+  cv::Mat image = sequence.grey[0];
+  for (int level = 0; level < kLevels; ++level) {
+    if (level > 0) {
+      cv::pyrDown(image, image);
+    }
+    const int width = image.cols, height = image.rows;
+    std::vector<float> gradX(width*height), gradY(width*height);
+    std::vector<float> reference(4*width*height), packed(4*width*height);
+
+    double best = FLT_MAX;
+    for (int run = 0; run < kRuns; ++run) {
+      const Clock::time_point start = Clock::now();
+      CalculateGradientsPlanar(image.data, width, height, gradX.data(),
+                               gradY.data());
+      best = std::min(best, Milliseconds(Clock::now() - start));
+    }
+    printf("  level %d %4dx%-4d planar %7.3f ms", level, width, height, best);
+
+    best = FLT_MAX;
+    for (int run = 0; run < kRuns; ++run) {
+      const Clock::time_point start = Clock::now();
+      CalculatePackedImage(dtrack_simd::kIsaScalar, image.data, width, height,
+                           reference.data());
+      best = std::min(best, Milliseconds(Clock::now() - start));
+    }
+    printf("  scalar %7.3f ms", best);
+
+    if (has_sse4) {
+      best = FLT_MAX;
+      for (int run = 0; run < kRuns; ++run) {
+        const Clock::time_point start = Clock::now();
+        CalculatePackedImage(dtrack_simd::kIsaSSE4, image.data, width, height,
+                             packed.data());
+        best = std::min(best, Milliseconds(Clock::now() - start));
+      }
+      const bool match = memcmp(reference.data(), packed.data(),
+                                packed.size()*sizeof(float)) == 0;
+      printf("  sse4 %7.3f ms%s", best, match ? "" : " MISMATCH");
+    }
+    printf("\n");
+  }
+
+  // Live pyramid with every level packed, as Estimate builds it.
+  DTrack dtrack(kLevels);
+  dtrack.SetParams(sequence.K, sequence.K, sequence.K, Sophus::SE3d());
+  dtrack.SetKeyframe(sequence.grey[0], sequence.depth[0]);
+  dtrack.BuildPyramid(sequence.grey[1]);
+  double best = FLT_MAX;
+  for (int run = 0; run < kRuns; ++run) {
+    const Clock::time_point start = Clock::now();
+    dtrack.BuildPyramid(sequence.grey[1]);
+    best = std::min(best, Milliseconds(Clock::now() - start));
+  }
+  printf("  BuildPyramid, all levels packed: %.3f ms\n", best);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+int main()
+{
+  const TestSequence sequence = RenderTestSequence(640, 480, 10);
+  BenchKernels(sequence);
+  BenchSolvers(sequence);
+  BenchGradients(sequence);
+  return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+
+#include <gtest/gtest.h>
+
+#include <vidtrack/dtrack.h>
+#include <vidtrack/tracker.h>
+
+#include "test_scene.h"
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Every heap allocation of the process, from any thread, goes through
+/// these and is counted. Replacing the C allocator, not operator new, also
+/// catches cv::fastMalloc and Eigen's aligned allocator; operator new ends
+/// up here too. glibc only: the real allocator is reached through its
+/// __libc_ entry points.
+static std::atomic<size_t> g_num_allocations(0);
+
+extern "C" {
+
+void* __libc_malloc(size_t size) noexcept;
+void* __libc_calloc(size_t num, size_t size) noexcept;
+void* __libc_realloc(void* ptr, size_t size) noexcept;
+void* __libc_memalign(size_t alignment, size_t size) noexcept;
+void* __libc_valloc(size_t size) noexcept;
+void* __libc_pvalloc(size_t size) noexcept;
+void  __libc_free(void* ptr) noexcept;
+
+void* malloc(size_t size) noexcept
+{
+  ++g_num_allocations;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t num, size_t size) noexcept
+{
+  ++g_num_allocations;
+  return __libc_calloc(num, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept
+{
+  ++g_num_allocations;
+  return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept
+{
+  ++g_num_allocations;
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) noexcept
+{
+  if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  void* aligned = memalign(alignment, size);
+  if (aligned == nullptr) {
+    return ENOMEM;
+  }
+  *ptr = aligned;
+  return 0;
+}
+
+void* valloc(size_t size) noexcept
+{
+  ++g_num_allocations;
+  return __libc_valloc(size);
+}
+
+void* pvalloc(size_t size) noexcept
+{
+  ++g_num_allocations;
+  return __libc_pvalloc(size);
+}
+
+void free(void* ptr) noexcept
+{
+  __libc_free(ptr);
+}
+
+} /* extern "C" */
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Allocations of Estimate and PromoteLiveToKeyframe over the frames after
+/// the first two, which warm up the pools.
+size_t SteadyStateAllocations(const DTrack::Options& options)
+{
+  const int kWarmUpFrames = 2;
+  const TestSequence sequence = RenderTestSequence(640, 480, 6);
+
+  DTrack dtrack(4);
+  dtrack.SetParams(sequence.K, sequence.K, sequence.K, Sophus::SE3d());
+  dtrack.SetOptions(options);
+  dtrack.SetKeyframe(sequence.grey[0], sequence.depth[0]);
+
+  DTrack::EstimateReport report;
+  size_t num_allocations = 0;
+  for (size_t ii = 1; ii < sequence.grey.size(); ++ii) {
+    Sophus::SE3d      Trl;
+    Eigen::Matrix6d   covariance;
+    unsigned int      num_obs;
+    const size_t start = g_num_allocations;
+    dtrack.Estimate(true, sequence.grey[ii], Trl, covariance, num_obs,
+                    &report);
+    dtrack.PromoteLiveToKeyframe(sequence.depth[ii]);
+    if (ii > kWarmUpFrames) {
+      num_allocations += g_num_allocations - start;
+    }
+  }
+  return num_allocations;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+TEST(Allocations, EstimateScalar)
+{
+  DTrack::Options options;
+  EXPECT_EQ(0u, SteadyStateAllocations(options));
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+TEST(Allocations, EstimateSIMDThreaded)
+{
+  DTrack::Options options;
+  options.kernel      = DTrack::kKernelAuto;
+  options.num_threads = 2;
+  EXPECT_EQ(0u, SteadyStateAllocations(options));
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+TEST(Allocations, EstimateInverseCompositionalBrightness)
+{
+  DTrack::Options options;
+  options.use_inverse_compositional = true;
+  options.estimate_brightness       = true;
+  options.pixel_budget              = 20000;
+  EXPECT_EQ(0u, SteadyStateAllocations(options));
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+TEST(Allocations, GenerateThumbnail)
+{
+  const TestSequence sequence = RenderTestSequence(640, 480, 3);
+  vid::Tracker tracker(15, 4);
+  tracker.GenerateThumbnail(sequence.grey[0]);
+
+  const size_t start = g_num_allocations;
+  for (size_t ii = 1; ii < sequence.grey.size(); ++ii) {
+    tracker.GenerateThumbnail(sequence.grey[ii]);
+  }
+  EXPECT_EQ(0u, g_num_allocations - start);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// A Tracker keeps the history of every frame: its images, cloned into the
+/// keyframe store, and a thumbnail. Those allocations, and the ones the
+/// store makes to grow, are inherent. Anything else a steady state frame
+/// allocates is not. Visual only, since BA is re-initialized, and
+/// allocates, on every solve.
+TEST(Allocations, TrackerOnlyAllocatesHistory)
+{
+  const int kWarmUpFrames = 10;
+  const TestSequence sequence = RenderTestSequence(320, 240, 40);
+
+  vid::Tracker::Options options;
+  options.use_imu = false;
+  vid::Tracker tracker(5, 4);
+  tracker.SetOptions(options);
+  tracker.ConfigureBA(TestRig(sequence));
+  tracker.ConfigureDTrack(sequence.grey[0], sequence.depth[0], 0,
+                          sequence.K);
+
+  // What the same history costs a store of its own, plus the thumbnails.
+  vid::KeyframeStore history;
+  history.Add(vid::KeyframeStore::Frame(), sequence.grey[0],
+              sequence.depth[0]);
+  size_t start = g_num_allocations;
+  const cv::Mat thumbnail = sequence.grey[0].clone();
+  const size_t image_allocations = g_num_allocations - start;
+
+  size_t tracker_allocations = 0;
+  size_t history_allocations = 0;
+  for (size_t ii = 1; ii < sequence.grey.size(); ++ii) {
+    Sophus::SE3d global_pose, rel_pose, vo_pose;
+    start = g_num_allocations;
+    tracker.Estimate(sequence.grey[ii], sequence.depth[ii],
+                     ii * sequence.frame_interval, global_pose, rel_pose,
+                     vo_pose);
+    const size_t tracker_frame = g_num_allocations - start;
+
+    start = g_num_allocations;
+    history.Add(vid::KeyframeStore::Frame(), sequence.grey[ii],
+                sequence.depth[ii]);
+    const size_t history_frame = g_num_allocations - start;
+
+    if (ii > kWarmUpFrames) {
+      tracker_allocations += tracker_frame;
+      history_allocations += history_frame + image_allocations;
+    }
+  }
+  EXPECT_EQ(history_allocations, tracker_allocations);
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <vidtrack/dtrack.h>
+#include <vidtrack/tracker.h>
+
+#include "test_scene.h"
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Options of instance id. Every instance differs from the others, so any
+/// state shared between instances shows up as a mismatch.
+DTrack::Options DTrackOptions(int id)
+{
+  DTrack::Options options;
+  options.norm_param                = 5.0 + 5.0*(id % 3);
+  options.discard_saturated         = (id % 2) == 0;
+  options.do_semi_dense_tracking    = (id % 4) == 3;
+  options.max_depth                 = id == 2 ? 2.1 : 20.0;
+  options.use_inverse_compositional = (id % 5) == 4;
+  options.estimate_brightness       = (id % 3) == 1;
+  options.kernel = (id % 4) == 1 ? DTrack::kKernelFloat :
+                   (id % 4) == 2 ? DTrack::kKernelAuto : DTrack::kKernelScalar;
+  options.num_threads               = 1 + (id % 2);
+  return options;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Tracks the sequence frame to frame, promoting each frame to keyframe.
+/// Results are appended as raw doubles.
+void DTrackSequence(
+    int                       id,         //< Input: Instance.
+    const TestSequence&       sequence,   //< Input: Frames.
+    std::vector<double>&      results     //< Output: Errors, poses, ...
+  )
+{
+  DTrack dtrack(4);
+  dtrack.SetParams(sequence.K, sequence.K, sequence.K, Sophus::SE3d());
+  dtrack.SetOptions(DTrackOptions(id));
+  dtrack.SetKeyframe(sequence.grey[0], sequence.depth[0]);
+
+  results.clear();
+  for (size_t ii = 1; ii < sequence.grey.size(); ++ii) {
+    Sophus::SE3d      Trl;
+    Eigen::Matrix6d   covariance;
+    unsigned int      num_obs;
+    results.push_back(dtrack.Estimate(true, sequence.grey[ii], Trl,
+                                      covariance, num_obs));
+    results.push_back(num_obs);
+    const Eigen::Vector6d log = Trl.log();
+    results.insert(results.end(), log.data(), log.data() + 6);
+    results.insert(results.end(), covariance.data(), covariance.data() + 36);
+    dtrack.PromoteLiveToKeyframe(sequence.depth[ii]);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Runs instances 0 .. num_instances-1 serially, then all at once on their
+/// own threads. Each instance's results must not depend on the others.
+template<typename Run>
+void ExpectThreadsMatchSerial(int num_instances, Run run)
+{
+  std::vector<std::vector<double> > serial(num_instances);
+  for (int ii = 0; ii < num_instances; ++ii) {
+    run(ii, std::ref(serial[ii]));
+  }
+
+  std::vector<std::vector<double> > threaded(num_instances);
+  std::vector<std::thread> threads;
+  for (int ii = 0; ii < num_instances; ++ii) {
+    threads.emplace_back(run, ii, std::ref(threaded[ii]));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (int ii = 0; ii < num_instances; ++ii) {
+    ASSERT_EQ(serial[ii].size(), threaded[ii].size()) << "Instance " << ii;
+    EXPECT_EQ(0, memcmp(serial[ii].data(), threaded[ii].data(),
+                        serial[ii].size() * sizeof(double)))
+        << "Instance " << ii << " differs from its serial run.";
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Tracker options of instance id, on top of DTrackOptions. How far an
+/// asynchronous back-end lags depends on timing, so those instances do not
+/// seed DTrack with BA results.
+vid::Tracker::Options TrackerOptions(int id)
+{
+  vid::Tracker::Options options;
+  options.async_ba    = (id % 3) == 0;
+  options.imu_seeding = (id % 3) == 1;
+  options.use_imu     = (id % 4) != 3;
+  options.dtrack      = DTrackOptions(id);
+
+  // Push frame history down to the compressed and the on-disk tiers.
+  if ((id % 2) == 1) {
+    options.keyframes.max_hot_bytes = 0;
+  }
+  if ((id % 3) == 2) {
+    options.keyframes.max_hot_bytes  = 0;
+    options.keyframes.max_warm_bytes = 0;
+  }
+  return options;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Feeds the sequence and its IMU samples to a Tracker, with a small BA
+/// window so BA converges and IMU seeding kicks in. Results are appended as
+/// raw doubles. With async_ba only the visual estimates are deterministic.
+void TrackerSequence(
+    int                       id,         //< Input: Instance.
+    const TestSequence&       sequence,   //< Input: Frames.
+    std::vector<double>&      results     //< Output: Poses, keyframe flags, ...
+  )
+{
+  const unsigned int kWindowSize = 4;
+  const double       kImuRate    = 200;
+
+  const vid::Tracker::Options options = TrackerOptions(id);
+  vid::Tracker tracker(kWindowSize, 4);
+  tracker.SetOptions(options);
+  vid::Tracker::KeyframePolicy policy;
+  policy.max_time = (id % 2) == 0 ? 0.0 : 1.0;
+  tracker.SetKeyframePolicy(policy);
+  vid::Tracker::MotionPrior prior;
+  prior.enabled = (id % 3) != 1;
+  tracker.SetMotionPrior(prior);
+
+  const std::shared_ptr<calibu::Rig<double> > rig = TestRig(sequence);
+  tracker.ConfigureBA(rig);
+  tracker.ConfigureDTrack(sequence.grey[0], sequence.depth[0], 0,
+                          sequence.K);
+
+  // Same IMU-camera transform and gravity the tracker works with.
+  Sophus::SE3d Trv;
+  Trv.so3() = calibu::RdfRobotics;
+  const Sophus::SE3d Tic = calibu::ToCoordinateConvention(
+        rig, calibu::RdfRobotics)->cameras_[0]->Pose() * Trv;
+  const std::vector<TestImuSample> imu =
+      RenderTestImu(sequence, Tic, Eigen::Vector3d(0, 0, 9.806), kImuRate);
+
+  results.clear();
+  size_t next_sample = 0;
+  for (size_t ii = 1; ii < sequence.grey.size(); ++ii) {
+    const double time = ii * sequence.frame_interval;
+    while (next_sample < imu.size() && imu[next_sample].time <= time) {
+      tracker.AddInertialMeasurement(imu[next_sample].accel,
+                                     imu[next_sample].gyro,
+                                     imu[next_sample].time);
+      ++next_sample;
+    }
+
+    Sophus::SE3d global_pose, rel_pose, vo_pose;
+    tracker.Estimate(sequence.grey[ii], sequence.depth[ii], time,
+                     global_pose, rel_pose, vo_pose);
+    for (const Sophus::SE3d* pose : {&vo_pose, &global_pose, &rel_pose}) {
+      const Eigen::Vector6d log = pose->log();
+      results.insert(results.end(), log.data(), log.data() + 6);
+      if (options.async_ba) {
+        break;
+      }
+    }
+    results.push_back(tracker.IsKeyframe());
+  }
+
+  // Frame history, read back from whichever tier holds it.
+  for (size_t ii = 0; ii < tracker.keyframe_store_.Size(); ++ii) {
+    cv::Mat grey, depth;
+    tracker.keyframe_store_.GetImages(ii, grey, depth);
+    results.push_back(cv::sum(grey)[0]);
+    // Depth has NaN holes, which would make every sum NaN. Hot images are
+    // shared with the store, so they are patched on a copy.
+    cv::Mat finite_depth = depth.clone();
+    cv::patchNaNs(finite_depth, 0);
+    results.push_back(cv::sum(finite_depth)[0]);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+TEST(DTrackConcurrency, ThreadsMatchSerialBitForBit)
+{
+  const TestSequence sequence = RenderTestSequence(320, 240, 5);
+  ExpectThreadsMatchSerial(8, [&sequence](int id,
+                                          std::vector<double>& results) {
+    DTrackSequence(id, sequence, results);
+  });
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Trackers keep their own options, keyframes, IMU buffers and BA windows.
+TEST(TrackerConcurrency, ThreadsMatchSerialBitForBit)
+{
+  const TestSequence sequence = RenderTestSequence(320, 240, 8);
+  ExpectThreadsMatchSerial(6, [&sequence](int id,
+                                          std::vector<double>& results) {
+    TrackerSequence(id, sequence, results);
+  });
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// An async back-end that is behind only solves the newest window. BA still
+/// converges if the first full window is one it skipped.
+TEST(TrackerConcurrency, AsyncBAConvergesWhenSolvesAreSkipped)
+{
+  const unsigned int kWindowSize = 4;
+  const double       kImuRate    = 200;
+  const TestSequence sequence = RenderTestSequence(320, 240, 8);
+
+  vid::Tracker::Options options;
+  options.async_ba    = true;
+  options.imu_seeding = false;
+  options.use_imu     = true;
+  vid::Tracker tracker(kWindowSize, 4);
+  tracker.SetOptions(options);
+
+  const std::shared_ptr<calibu::Rig<double> > rig = TestRig(sequence);
+  tracker.ConfigureBA(rig);
+  tracker.ConfigureDTrack(sequence.grey[0], sequence.depth[0], 0,
+                          sequence.K);
+
+  Sophus::SE3d Trv;
+  Trv.so3() = calibu::RdfRobotics;
+  const Sophus::SE3d Tic = calibu::ToCoordinateConvention(
+        rig, calibu::RdfRobotics)->cameras_[0]->Pose() * Trv;
+  const std::vector<TestImuSample> imu =
+      RenderTestImu(sequence, Tic, Eigen::Vector3d(0, 0, 9.806), kImuRate);
+
+  // Every edge is queued before the back-end looks at any of them.
+  tracker.PauseBackEnd(true);
+  size_t next_sample = 0;
+  for (size_t ii = 1; ii < sequence.grey.size(); ++ii) {
+    const double time = ii * sequence.frame_interval;
+    while (next_sample < imu.size() && imu[next_sample].time <= time) {
+      tracker.AddInertialMeasurement(imu[next_sample].accel,
+                                     imu[next_sample].gyro,
+                                     imu[next_sample].time);
+      ++next_sample;
+    }
+    Sophus::SE3d global_pose, rel_pose, vo_pose;
+    tracker.Estimate(sequence.grey[ii], sequence.depth[ii], time,
+                     global_pose, rel_pose, vo_pose);
+  }
+  EXPECT_FALSE(tracker.HasBAConverged());
+
+  // Restarting the back-end drains the queue, solving the last window only.
+  ASSERT_LT(kWindowSize, sequence.grey.size() - 1);
+  tracker.SetOptions(options);
+  EXPECT_TRUE(tracker.HasBAConverged());
+}
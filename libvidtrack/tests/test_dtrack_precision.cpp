@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <vidtrack/dtrack.h>
+
+#include "test_scene.h"
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Camera trajectory from frame to frame tracking with the given kernel.
+std::vector<Sophus::SE3d> TrackTrajectory(
+    const TestSequence&       sequence,
+    DTrack::Kernel            kernel
+  )
+{
+  DTrack::Options options;
+  options.kernel = kernel;
+  DTrack dtrack(4);
+  dtrack.SetParams(sequence.K, sequence.K, sequence.K, Sophus::SE3d());
+  dtrack.SetOptions(options);
+  dtrack.SetKeyframe(sequence.grey[0], sequence.depth[0]);
+
+  std::vector<Sophus::SE3d> Twc(1);
+  for (size_t ii = 1; ii < sequence.grey.size(); ++ii) {
+    Sophus::SE3d      Trl;
+    Eigen::Matrix6d   covariance;
+    unsigned int      num_obs;
+    dtrack.Estimate(true, sequence.grey[ii], Trl, covariance, num_obs);
+    Twc.push_back(Twc.back() * Trl);
+    dtrack.PromoteLiveToKeyframe(sequence.depth[ii]);
+  }
+  return Twc;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Largest translation (meters) and rotation (radians) between two
+/// trajectories.
+void TrajectoryDifference(
+    const std::vector<Sophus::SE3d>&  lhs,
+    const std::vector<Sophus::SE3d>&  rhs,
+    double&                           translation,
+    double&                           rotation
+  )
+{
+  translation = 0;
+  rotation    = 0;
+  for (size_t ii = 0; ii < lhs.size(); ++ii) {
+    const Eigen::Vector6d error = (lhs[ii].inverse() * rhs[ii]).log();
+    translation = std::max(translation, error.head<3>().norm());
+    rotation    = std::max(rotation, error.tail<3>().norm());
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Single precision kernels drift from the double precision reference by
+/// far less than the reference drifts from ground truth.
+TEST(DTrackPrecision, FloatKernelsMatchDouble)
+{
+  const TestSequence sequence = RenderTestSequence(640, 480, 10);
+  const std::vector<Sophus::SE3d> reference =
+      TrackTrajectory(sequence, DTrack::kKernelScalar);
+
+  double translation, rotation;
+  TrajectoryDifference(sequence.Twc, reference, translation, rotation);
+  EXPECT_LT(translation, 1e-3);
+  EXPECT_LT(rotation, 1e-3);
+
+  const DTrack::Kernel kKernels[] = {DTrack::kKernelFloat,
+                                     DTrack::kKernelAuto};
+  for (DTrack::Kernel kernel : kKernels) {
+    TrajectoryDifference(reference, TrackTrajectory(sequence, kernel),
+                         translation, rotation);
+    EXPECT_LT(translation, 1e-5) << "Kernel " << kernel;
+    EXPECT_LT(rotation, 1e-5) << "Kernel " << kernel;
+  }
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <cfloat>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <vidtrack/imu_buffer.h>
+
+using vid::ImuBuffer;
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Samples every 10 ms whose values are linear in time, so interpolated
+/// samples are known exactly.
+ImuBuffer::ImuMeasurement Sample(double time)
+{
+  return ImuBuffer::ImuMeasurement(Eigen::Vector3d(time, 2*time, -time),
+                                   Eigen::Vector3d(-time, 3*time, 1 + time),
+                                   time);
+}
+
+double SampleTime(int index)
+{
+  return 0.01 * index;
+}
+
+void Fill(ImuBuffer& buffer, int begin, int end)
+{
+  for (int ii = begin; ii < end; ++ii) {
+    ASSERT_TRUE(buffer.Push(Sample(SampleTime(ii))));
+  }
+}
+
+/// Sample matches the linear signal at its own time.
+void ExpectOnSignal(const ImuBuffer::ImuMeasurement& measurement)
+{
+  const ImuBuffer::ImuMeasurement expected = Sample(measurement.time);
+  EXPECT_NEAR(0, (expected.w - measurement.w).norm(), 1e-12)
+      << "At " << measurement.time;
+  EXPECT_NEAR(0, (expected.a - measurement.a).norm(), 1e-12)
+      << "At " << measurement.time;
+}
+
+/// Times of the samples in a range.
+std::vector<double> Times(
+    const std::vector<ImuBuffer::ImuMeasurement>& measurements)
+{
+  std::vector<double> times;
+  for (const ImuBuffer::ImuMeasurement& measurement : measurements) {
+    times.push_back(measurement.time);
+    ExpectOnSignal(measurement);
+  }
+  return times;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Samples strictly inside the range, with interpolated samples at both
+/// ends.
+TEST(ImuBufferTest, GetRangeInterpolatesEnds)
+{
+  ImuBuffer buffer(64);
+  Fill(buffer, 0, 10);
+  EXPECT_EQ(SampleTime(0), buffer.StartTime());
+  EXPECT_EQ(SampleTime(9), buffer.EndTime());
+
+  std::vector<ImuBuffer::ImuMeasurement> measurements;
+  buffer.GetRange(0.015, 0.043, measurements);
+  const std::vector<double> times = Times(measurements);
+  ASSERT_EQ(5u, times.size());
+  EXPECT_DOUBLE_EQ(0.015, times[0]);
+  EXPECT_EQ(SampleTime(2), times[1]);
+  EXPECT_EQ(SampleTime(3), times[2]);
+  EXPECT_EQ(SampleTime(4), times[3]);
+  EXPECT_DOUBLE_EQ(0.043, times[4]);
+
+  // Ends on a sample.
+  buffer.GetRange(SampleTime(2), SampleTime(4), measurements);
+  ASSERT_EQ(3u, measurements.size());
+  EXPECT_EQ(SampleTime(2), measurements[0].time);
+  EXPECT_EQ(SampleTime(3), measurements[1].time);
+  EXPECT_EQ(SampleTime(4), measurements[2].time);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Ends past the newest sample are clamped to it.
+TEST(ImuBufferTest, GetRangeClampsToNewest)
+{
+  ImuBuffer buffer(64);
+  Fill(buffer, 0, 10);
+
+  std::vector<ImuBuffer::ImuMeasurement> measurements;
+  buffer.GetRange(0.075, 1.0, measurements);
+  std::vector<double> times = Times(measurements);
+  ASSERT_EQ(4u, times.size());
+  EXPECT_DOUBLE_EQ(0.075, times[0]);
+  EXPECT_EQ(SampleTime(8), times[1]);
+  EXPECT_EQ(SampleTime(9), times[2]);
+  EXPECT_EQ(SampleTime(9), times[3]);
+
+  buffer.GetRange(0.5, 1.0, measurements);
+  times = Times(measurements);
+  ASSERT_EQ(2u, times.size());
+  EXPECT_EQ(SampleTime(9), times[0]);
+  EXPECT_EQ(SampleTime(9), times[1]);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Nothing is returned unless the start is after the oldest sample, and
+/// nothing from an empty buffer.
+TEST(ImuBufferTest, GetRangeEmptyAtOrBeforeOldest)
+{
+  ImuBuffer buffer(64);
+  std::vector<ImuBuffer::ImuMeasurement> measurements;
+  buffer.GetRange(0.0, 1.0, measurements);
+  EXPECT_TRUE(measurements.empty());
+  EXPECT_EQ(-DBL_MAX, buffer.StartTime());
+  EXPECT_EQ(-DBL_MAX, buffer.EndTime());
+
+  Fill(buffer, 1, 10);
+  measurements.push_back(Sample(0));
+  buffer.GetRange(SampleTime(1), SampleTime(5), measurements);
+  EXPECT_TRUE(measurements.empty());
+  buffer.GetRange(SampleTime(0), SampleTime(5), measurements);
+  EXPECT_TRUE(measurements.empty());
+  buffer.GetRange(SampleTime(1) + 1e-9, SampleTime(5), measurements);
+  EXPECT_FALSE(measurements.empty());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Once full, the oldest samples are overwritten.
+TEST(ImuBufferTest, WrapsAroundPastCapacity)
+{
+  ImuBuffer buffer(6);
+  ASSERT_EQ(8u, buffer.Capacity());
+  Fill(buffer, 0, 21);
+  EXPECT_EQ(SampleTime(13), buffer.StartTime());
+  EXPECT_EQ(SampleTime(20), buffer.EndTime());
+
+  std::vector<ImuBuffer::ImuMeasurement> measurements;
+  buffer.GetRange(SampleTime(12), SampleTime(20), measurements);
+  EXPECT_TRUE(measurements.empty());
+
+  buffer.GetRange(0.135, 0.195, measurements);
+  const std::vector<double> times = Times(measurements);
+  ASSERT_EQ(8u, times.size());
+  EXPECT_DOUBLE_EQ(0.135, times.front());
+  for (int ii = 1; ii < 7; ++ii) {
+    EXPECT_EQ(SampleTime(13 + ii), times[ii]);
+  }
+  EXPECT_DOUBLE_EQ(0.195, times.back());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Eviction keeps the last sample not after the time, so ranges starting
+/// at it can still be interpolated.
+TEST(ImuBufferTest, EvictBeforeKeepsInterpolationSample)
+{
+  ImuBuffer buffer(64);
+  Fill(buffer, 0, 10);
+
+  // Before the oldest sample, or before the second one: nothing to drop.
+  buffer.EvictBefore(-1.0);
+  EXPECT_EQ(SampleTime(0), buffer.StartTime());
+  buffer.EvictBefore(0.005);
+  EXPECT_EQ(SampleTime(0), buffer.StartTime());
+
+  buffer.EvictBefore(0.045);
+  EXPECT_EQ(SampleTime(4), buffer.StartTime());
+  std::vector<ImuBuffer::ImuMeasurement> measurements;
+  buffer.GetRange(0.045, 0.06, measurements);
+  const std::vector<double> times = Times(measurements);
+  ASSERT_EQ(3u, times.size());
+  EXPECT_DOUBLE_EQ(0.045, times[0]);
+  EXPECT_EQ(SampleTime(5), times[1]);
+  EXPECT_DOUBLE_EQ(0.06, times[2]);
+
+  // Never moves back.
+  buffer.EvictBefore(0.025);
+  EXPECT_EQ(SampleTime(4), buffer.StartTime());
+
+  // Past the newest sample, the newest one is kept.
+  buffer.EvictBefore(1.0);
+  EXPECT_EQ(SampleTime(9), buffer.StartTime());
+  EXPECT_EQ(SampleTime(9), buffer.EndTime());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Samples not newer than the last one are dropped.
+TEST(ImuBufferTest, RejectsOutOfOrderPush)
+{
+  ImuBuffer buffer(64);
+  Fill(buffer, 0, 5);
+  EXPECT_FALSE(buffer.Push(Sample(SampleTime(4))));
+  EXPECT_FALSE(buffer.Push(Sample(SampleTime(2))));
+  EXPECT_EQ(SampleTime(4), buffer.EndTime());
+
+  std::vector<ImuBuffer::ImuMeasurement> measurements;
+  buffer.GetRange(0.005, 1.0, measurements);
+  const std::vector<double> times = Times(measurements);
+  ASSERT_EQ(6u, times.size());
+  for (size_t ii = 1; ii < times.size(); ++ii) {
+    EXPECT_LE(times[ii-1], times[ii]);
+  }
+
+  EXPECT_TRUE(buffer.Push(Sample(SampleTime(5))));
+  EXPECT_EQ(SampleTime(5), buffer.EndTime());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Readers racing with a writer that laps the ring many times only see
+/// whole samples, in order, on the signal.
+TEST(ImuBufferTest, OneWriterTwoReaders)
+{
+  const int kNumSamples = 200000;
+  ImuBuffer buffer(256);
+  std::atomic<bool> done(false);
+
+  auto reader = [&](double span, int& num_ranges) {
+    std::vector<ImuBuffer::ImuMeasurement> measurements;
+    num_ranges = 0;
+    // At least one range, should the writer be done before the reader
+    // starts.
+    while (!done.load() || num_ranges == 0) {
+      const double end_time = buffer.EndTime();
+      if (end_time < 1.0) {
+        continue;
+      }
+      buffer.GetRange(end_time - span, end_time, measurements);
+      if (measurements.empty()) {
+        continue;
+      }
+      ++num_ranges;
+      EXPECT_DOUBLE_EQ(end_time - span, measurements.front().time);
+      EXPECT_DOUBLE_EQ(end_time, measurements.back().time);
+      for (size_t ii = 0; ii < measurements.size(); ++ii) {
+        const ImuBuffer::ImuMeasurement expected =
+            Sample(measurements[ii].time);
+        ASSERT_NEAR(0, (expected.w - measurements[ii].w).norm(), 1e-9);
+        ASSERT_NEAR(0, (expected.a - measurements[ii].a).norm(), 1e-9);
+        if (ii > 0) {
+          ASSERT_LE(measurements[ii-1].time, measurements[ii].time);
+        }
+      }
+    }
+  };
+
+  int num_ranges[2];
+  std::thread readers[2] = {
+    std::thread(reader, 0.105, std::ref(num_ranges[0])),
+    std::thread(reader, 0.505, std::ref(num_ranges[1]))
+  };
+  for (int ii = 0; ii < kNumSamples; ++ii) {
+    buffer.Push(Sample(SampleTime(ii)));
+    if (ii % 1000 == 0) {
+      buffer.EvictBefore(SampleTime(ii) - 1.0);
+    }
+  }
+  done.store(true);
+  for (std::thread& thread : readers) {
+    thread.join();
+  }
+  EXPECT_LT(0, num_ranges[0]);
+  EXPECT_LT(0, num_ranges[1]);
+  EXPECT_EQ(SampleTime(kNumSamples - 1), buffer.EndTime());
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <vidtrack/keyframe_store.h>
+
+#include "test_scene.h"
+
+using vid::KeyframeStore;
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Test sequence frames, with depth pixels at each edge of the encoding:
+/// invalid ones, ones at or around half a millimeter, and one past the 16
+/// bit range.
+class KeyframeStoreTest : public ::testing::Test {
+
+protected:
+  KeyframeStoreTest()
+    : sequence_(RenderTestSequence(80, 60, 4))
+  {
+    const float kInf = std::numeric_limits<float>::infinity();
+    const float kSpecial[] = {kInf, -kInf, 0.0f, -1.0f, 0.0004f, 0.0005f,
+                              0.0006f, 0.0123f, 70.0f};
+    for (cv::Mat& depth : sequence_.depth) {
+      for (size_t ii = 0; ii < sizeof(kSpecial)/sizeof(kSpecial[0]); ++ii) {
+        depth.at<float>(1, 2*ii) = kSpecial[ii];
+      }
+    }
+  }
+
+  /// Adds every frame of the sequence.
+  void AddAll(KeyframeStore& store) const
+  {
+    for (size_t ii = 0; ii < sequence_.grey.size(); ++ii) {
+      KeyframeStore::Frame frame;
+      frame.T_wp = sequence_.Twc[ii];
+      store.Add(frame, sequence_.grey[ii], sequence_.depth[ii]);
+    }
+  }
+
+  /// Images of every frame come back as given. Frames are the sequence,
+  /// added as many times as the store holds.
+  void ExpectExact(const KeyframeStore& store) const
+  {
+    for (size_t ii = 0; ii < store.Size(); ++ii) {
+      const size_t frame = ii % sequence_.grey.size();
+      cv::Mat grey, depth;
+      store.GetImages(ii, grey, depth);
+      EXPECT_EQ(0, cv::countNonZero(grey != sequence_.grey[frame]));
+      ASSERT_EQ(CV_32FC1, depth.type());
+      const cv::Mat& given = sequence_.depth[frame];
+      for (int vv = 0; vv < depth.rows; ++vv) {
+        for (int uu = 0; uu < depth.cols; ++uu) {
+          const float expected = given.at<float>(vv, uu);
+          const float actual   = depth.at<float>(vv, uu);
+          EXPECT_TRUE(actual == expected
+                      || (std::isnan(actual) && std::isnan(expected)))
+              << "Frame " << ii << " at " << uu << ", " << vv;
+        }
+      }
+    }
+  }
+
+  /// Grey of every frame comes back exactly, finite depth within half a
+  /// millimeter, and depth that cannot be encoded as NaN.
+  void ExpectEncoded(const KeyframeStore& store) const
+  {
+    // Half a millimeter, and the rounding of meters in single precision.
+    const float kTolerance = 0.0005f + 1e-6f;
+    for (size_t ii = 0; ii < store.Size(); ++ii) {
+      const size_t frame = ii % sequence_.grey.size();
+      cv::Mat grey, depth;
+      store.GetImages(ii, grey, depth);
+      EXPECT_EQ(0, cv::countNonZero(grey != sequence_.grey[frame]));
+      EXPECT_EQ(0, cv::countNonZero(store.GetGrey(ii) !=
+                                    sequence_.grey[frame]));
+      ASSERT_EQ(CV_32FC1, depth.type());
+      const cv::Mat& given = sequence_.depth[frame];
+      for (int vv = 0; vv < depth.rows; ++vv) {
+        for (int uu = 0; uu < depth.cols; ++uu) {
+          const float expected = given.at<float>(vv, uu);
+          const float actual   = depth.at<float>(vv, uu);
+          if (!std::isfinite(expected) || expected <= 0.0005f) {
+            EXPECT_TRUE(std::isnan(actual))
+                << "Frame " << ii << " at " << uu << ", " << vv
+                << ": " << expected << " came back as " << actual;
+          } else if (expected > 65.535f) {
+            EXPECT_FLOAT_EQ(65.535f, actual);
+          } else {
+            EXPECT_NEAR(expected, actual, kTolerance)
+                << "Frame " << ii << " at " << uu << ", " << vv;
+          }
+        }
+      }
+    }
+  }
+
+  TestSequence    sequence_;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Frames keep their images as they move from hot to warm to cold.
+TEST_F(KeyframeStoreTest, MovesThroughTiers)
+{
+  KeyframeStore store;
+  AddAll(store);
+  EXPECT_LT(0u, store.HotBytes());
+  EXPECT_EQ(0u, store.WarmBytes());
+  EXPECT_EQ(0u, store.ColdBytes());
+  ExpectExact(store);
+
+  KeyframeStore::Options options = store.GetOptions();
+  options.max_hot_bytes = 0;
+  store.SetOptions(options);
+  EXPECT_EQ(0u, store.HotBytes());
+  EXPECT_LT(0u, store.WarmBytes());
+  EXPECT_EQ(0u, store.ColdBytes());
+  ExpectEncoded(store);
+
+  options.max_warm_bytes = 0;
+  store.SetOptions(options);
+  EXPECT_EQ(0u, store.HotBytes());
+  EXPECT_EQ(0u, store.WarmBytes());
+  EXPECT_LT(0u, store.ColdBytes());
+  ExpectEncoded(store);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Without RAM for images, frames go straight to the cold file, each at an
+/// offset that is not page aligned.
+TEST_F(KeyframeStoreTest, NoRamGoesCold)
+{
+  KeyframeStore store;
+  KeyframeStore::Options options;
+  options.max_hot_bytes  = 0;
+  options.max_warm_bytes = 0;
+  store.SetOptions(options);
+  AddAll(store);
+  AddAll(store);
+  EXPECT_EQ(2*sequence_.grey.size(), store.Size());
+  EXPECT_EQ(0u, store.HotBytes());
+  EXPECT_EQ(0u, store.WarmBytes());
+  EXPECT_LT(0u, store.ColdBytes());
+  EXPECT_EQ(sequence_.Twc[1].matrix(), store[1].T_wp.matrix());
+  ExpectEncoded(store);
+}
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <gtest/gtest.h>
+
+#include <vidtrack/image_pool.h>
+#include <vidtrack/pyramid.h>
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Sizes with even and odd sides, ones too small for a full filter or SIMD
+/// step, and ones with SIMD steps and scalar tails.
+const cv::Size kSizes[] = {
+  cv::Size(2, 3), cv::Size(3, 2), cv::Size(5, 5), cv::Size(8, 9),
+  cv::Size(33, 17), cv::Size(67, 45), cv::Size(80, 60), cv::Size(641, 481)
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Uniform noise, the hardest case for rounding.
+cv::Mat RandomImage(const cv::Size& size, int type, int seed)
+{
+  cv::Mat image(size, type);
+  cv::RNG rng(seed);
+  if (type == CV_8UC1) {
+    rng.fill(image, cv::RNG::UNIFORM, 0, 256);
+  } else {
+    rng.fill(image, cv::RNG::UNIFORM, -10.0, 10.0);
+  }
+  return image;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Number of pixels whose bit patterns differ. NaN equals NaN.
+int NumDifferent(const cv::Mat& expected, const cv::Mat& actual)
+{
+  EXPECT_EQ(expected.size(), actual.size());
+  EXPECT_EQ(expected.type(), actual.type());
+  if (expected.size() != actual.size() || expected.type() != actual.type()) {
+    return -1;
+  }
+  const size_t row_bytes = expected.cols * expected.elemSize();
+  int num_different = 0;
+  for (int vv = 0; vv < expected.rows; ++vv) {
+    for (size_t bb = 0; bb < row_bytes; bb += expected.elemSize()) {
+      const unsigned char* e = expected.ptr<unsigned char>(vv) + bb;
+      const unsigned char* a = actual.ptr<unsigned char>(vv) + bb;
+      if (expected.type() == CV_32FC1
+          && std::isnan(*reinterpret_cast<const float*>(e))
+          && std::isnan(*reinterpret_cast<const float*>(a))) {
+        continue;
+      }
+      if (memcmp(e, a, expected.elemSize()) != 0) {
+        ++num_different;
+      }
+    }
+  }
+  return num_different;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// What HalfSampleGrey is documented to do, one pixel at a time.
+cv::Mat ReferenceHalfSampleGrey(const cv::Mat& src)
+{
+  cv::Mat dst(src.rows / 2, src.cols / 2, CV_8UC1);
+  for (int vv = 0; vv < dst.rows; ++vv) {
+    for (int uu = 0; uu < dst.cols; ++uu) {
+      const int sum = src.at<unsigned char>(2*vv, 2*uu)
+          + src.at<unsigned char>(2*vv, 2*uu+1)
+          + src.at<unsigned char>(2*vv+1, 2*uu)
+          + src.at<unsigned char>(2*vv+1, 2*uu+1);
+      dst.at<unsigned char>(vv, uu) = (sum + 2) / 4;
+    }
+  }
+  return dst;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// What HalfSampleDepth is documented to do, one block at a time. Sums are
+/// paired as (0 + 1) + (2 + 3), top row first, so the result is exact to
+/// the bit.
+cv::Mat ReferenceHalfSampleDepth(const cv::Mat& src)
+{
+  cv::Mat dst(src.rows / 2, src.cols / 2, CV_32FC1);
+  for (int vv = 0; vv < dst.rows; ++vv) {
+    for (int uu = 0; uu < dst.cols; ++uu) {
+      const float block[4] = {
+        src.at<float>(2*vv, 2*uu),   src.at<float>(2*vv, 2*uu+1),
+        src.at<float>(2*vv+1, 2*uu), src.at<float>(2*vv+1, 2*uu+1)
+      };
+
+      bool any_valid = false;
+      float nearest = 0;
+      for (float depth : block) {
+        if (depth > 0 && std::isfinite(depth)
+            && (!any_valid || depth < nearest)) {
+          nearest = depth;
+          any_valid = true;
+        }
+      }
+      if (!any_valid) {
+        dst.at<float>(vv, uu) = std::numeric_limits<float>::quiet_NaN();
+        continue;
+      }
+
+      const float limit = nearest * (1.0f + vid::kMaxDepthSpread);
+      float sums[2]   = {0, 0};
+      float counts[2] = {0, 0};
+      for (int ii = 0; ii < 4; ++ii) {
+        if (block[ii] > 0 && block[ii] <= limit) {
+          sums[ii / 2]   += block[ii];
+          counts[ii / 2] += 1.0f;
+        }
+      }
+      dst.at<float>(vv, uu) = (sums[0] + sums[1]) / (counts[0] + counts[1]);
+    }
+  }
+  return dst;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Depth from 0.5 to 5 meters with special blocks spread over it: invalid
+/// samples of every kind, whole invalid blocks, two surfaces, and samples
+/// right at the spread limit.
+cv::Mat TestDepth(const cv::Size& size, int seed)
+{
+  const float kNaN = std::numeric_limits<float>::quiet_NaN();
+  const float kInf = std::numeric_limits<float>::infinity();
+  const float kLimit = 2.0f * (1.0f + vid::kMaxDepthSpread);
+  const float kBlocks[][4] = {
+    {kNaN, kNaN, kNaN, kNaN},
+    {0.0f, -1.0f, kNaN, -0.0f},
+    {kInf, kInf, kInf, kInf},
+    {kNaN, 2.0f, 0.0f, -3.0f},
+    {1.0f, 2.0f, 2.0f, 2.0f},
+    {2.0f, 2.0f, 2.0f, 1.0f},
+    {2.0f, kLimit, std::nextafter(kLimit, kInf), kNaN},
+    {3.0f, kInf, -kInf, 3.1f},
+    {1e-6f, 4.0f, 4.0f, 4.0f}
+  };
+  const int kNumBlocks = sizeof(kBlocks) / sizeof(kBlocks[0]);
+
+  cv::Mat depth(size, CV_32FC1);
+  cv::RNG rng(seed);
+  rng.fill(depth, cv::RNG::UNIFORM, 0.5, 5.0);
+  int block = 0;
+  for (int vv = 0; vv + 1 < depth.rows; vv += 2) {
+    for (int uu = 0; uu + 1 < depth.cols; uu += 2) {
+      if (rng.uniform(0, 3) != 0) {
+        continue;
+      }
+      const float* values = kBlocks[block++ % kNumBlocks];
+      depth.at<float>(vv, uu)     = values[0];
+      depth.at<float>(vv, uu+1)   = values[1];
+      depth.at<float>(vv+1, uu)   = values[2];
+      depth.at<float>(vv+1, uu+1) = values[3];
+    }
+  }
+  return depth;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Greyscale thumbnails and keyframe pyramids depend on this being exact.
+TEST(PyramidTest, PyrDownGreyMatchesOpenCV)
+{
+  vid::ImagePool pool;
+  for (const cv::Size& size : kSizes) {
+    const cv::Mat src = RandomImage(size, CV_8UC1, size.area());
+    cv::Mat expected, actual;
+    cv::pyrDown(src, expected);
+    vid::PyrDown(src, actual, 1, pool);
+    EXPECT_EQ(0, NumDifferent(expected, actual))
+        << size.width << "x" << size.height;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// OpenCV's vectorized float path adds the taps in another order, so the
+/// last bit may differ.
+TEST(PyramidTest, PyrDownFloatMatchesOpenCV)
+{
+  vid::ImagePool pool;
+  for (const cv::Size& size : kSizes) {
+    const cv::Mat src = RandomImage(size, CV_32FC1, size.area());
+    cv::Mat expected, actual;
+    cv::pyrDown(src, expected);
+    vid::PyrDown(src, actual, 1, pool);
+    ASSERT_EQ(expected.size(), actual.size());
+    for (int vv = 0; vv < expected.rows; ++vv) {
+      for (int uu = 0; uu < expected.cols; ++uu) {
+        EXPECT_NEAR(expected.at<float>(vv, uu), actual.at<float>(vv, uu),
+                    1e-5f) << size.width << "x" << size.height
+                           << " at " << uu << ", " << vv;
+      }
+    }
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Views into a larger image are read row by row, and a reused dst of the
+/// wrong size is reallocated.
+TEST(PyramidTest, PyrDownRegionOfInterest)
+{
+  vid::ImagePool pool;
+  const cv::Mat image = RandomImage(cv::Size(100, 80), CV_8UC1, 7);
+  const cv::Mat src = image(cv::Rect(3, 5, 61, 39));
+  cv::Mat expected;
+  cv::pyrDown(src, expected);
+
+  cv::Mat actual(4, 4, CV_8UC1);
+  vid::PyrDown(src, actual, 2, pool);
+  EXPECT_EQ(0, NumDifferent(expected, actual));
+
+  // Same level, same row buffers.
+  vid::PyrDown(src, actual, 2, pool);
+  EXPECT_EQ(0, NumDifferent(expected, actual));
+  EXPECT_EQ(1u, pool.NumAllocations());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// The SIMD path, where built, must match the scalar one.
+TEST(PyramidTest, HalfSampleGreyMatchesReference)
+{
+  for (const cv::Size& size : kSizes) {
+    const cv::Mat src = RandomImage(size, CV_8UC1, size.area());
+    cv::Mat actual;
+    vid::HalfSampleGrey(src, actual);
+    EXPECT_EQ(0, NumDifferent(ReferenceHalfSampleGrey(src), actual))
+        << size.width << "x" << size.height;
+  }
+
+  // Sums that need all ten bits.
+  const cv::Mat white(6, 66, CV_8UC1, cv::Scalar(255));
+  cv::Mat actual;
+  vid::HalfSampleGrey(white, actual);
+  EXPECT_EQ(0, cv::countNonZero(actual != 255));
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+TEST(PyramidTest, HalfSampleDepthMatchesReference)
+{
+  for (const cv::Size& size : kSizes) {
+    const cv::Mat src = TestDepth(size, size.area());
+    cv::Mat actual;
+    vid::HalfSampleDepth(src, actual);
+    EXPECT_EQ(0, NumDifferent(ReferenceHalfSampleDepth(src), actual))
+        << size.width << "x" << size.height;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Blocks with nothing valid are NaN. Surfaces farther than the spread from
+/// the nearest sample are left out of the mean.
+TEST(PyramidTest, HalfSampleDepthBlocks)
+{
+  const float kNaN = std::numeric_limits<float>::quiet_NaN();
+  const float kInf = std::numeric_limits<float>::infinity();
+  // Thirteen blocks, so both the SIMD steps and the scalar tail see them.
+  const float kTop[] = {
+    kNaN, kNaN,   0.0f, -1.0f,  1.0f, 2.0f,   2.0f, 2.02f,
+    kNaN, 3.0f,   kInf, kInf,   1.0f, 1.0f,   5.0f, kNaN,
+    -2.0f, kNaN,  0.0f, 0.0f,   2.0f, 4.0f,   1.0f, 1.0f,
+    kNaN, kNaN
+  };
+  const float kBottom[] = {
+    kNaN, kNaN,   -0.0f, kNaN,  2.0f, 2.0f,   2.04f, 2.2f,
+    kNaN, kNaN,   kInf, kInf,   1.0f, 1.0f,   kNaN, kNaN,
+    kNaN, 7.0f,   0.0f, 0.0f,   4.0f, 4.0f,   1.0f, 1.0f,
+    4.0f, 4.1f
+  };
+  const float kExpected[] = {
+    kNaN, kNaN, 1.0f, (2.0f + 2.02f + 2.04f) / 3.0f,
+    3.0f, kNaN, 1.0f, 5.0f,
+    7.0f, kNaN, 2.0f, 1.0f,
+    (4.0f + 4.1f) / 2.0f
+  };
+  const int kNumBlocks = sizeof(kExpected) / sizeof(kExpected[0]);
+
+  cv::Mat src(2, 2*kNumBlocks, CV_32FC1);
+  memcpy(src.ptr<float>(0), kTop, sizeof(kTop));
+  memcpy(src.ptr<float>(1), kBottom, sizeof(kBottom));
+  cv::Mat actual;
+  vid::HalfSampleDepth(src, actual);
+  ASSERT_EQ(1, actual.rows);
+  ASSERT_EQ(kNumBlocks, actual.cols);
+  for (int uu = 0; uu < kNumBlocks; ++uu) {
+    if (std::isnan(kExpected[uu])) {
+      EXPECT_TRUE(std::isnan(actual.at<float>(0, uu))) << "Block " << uu;
+    } else {
+      EXPECT_FLOAT_EQ(kExpected[uu], actual.at<float>(0, uu))
+          << "Block " << uu;
+    }
+  }
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2015  Juan M. Falquez,
+ *                     University of Colorado - Boulder
+ *
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <Eigen/Eigen>
+#include <calibu/Calibu.h>
+#include <opencv2/opencv.hpp>
+#include <sophus/se3.hpp>
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Synthetic RGB-D frames shared by tests and benchmarks: a textured plane
+/// Z = 2 + 0.2 X (vision frame) seen by a pinhole camera. A sparse grid of
+/// depth pixels is NaN, as holes in real depth maps are.
+struct TestSequence {
+  Eigen::Matrix3d             K;
+  Eigen::Matrix<double, 6, 1> motion;       // Per frame, Twc[i] = exp(i motion).
+  double                      frame_interval; // Seconds between frames.
+  std::vector<Sophus::SE3d>   Twc;          // Camera poses, first is identity.
+  std::vector<cv::Mat>        grey;         // CV_8UC1.
+  std::vector<cv::Mat>        depth;        // CV_32FC1, meters.
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Noise free IMU sample.
+struct TestImuSample {
+  Eigen::Vector3d   accel;
+  Eigen::Vector3d   gyro;
+  double            time;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+inline double TestTexture(double X, double Y)
+{
+  return 127 + 50*std::sin(7*X + 0.3) * std::cos(5*Y)
+      + 40*std::sin(13*X*Y + 2*Y) + 20*std::cos(23*X - 11*Y);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+inline void RenderTestFrame(
+    const Eigen::Matrix3d&    K,          //< Input: Camera matrix.
+    const Sophus::SE3d&       Twc,        //< Input: Camera pose.
+    int                       width,      //< Input: Image width.
+    int                       height,     //< Input: Image height.
+    cv::Mat&                  grey,       //< Output: CV_8UC1 image.
+    cv::Mat&                  depth       //< Output: CV_32FC1 depth.
+  )
+{
+  grey.create(height, width, CV_8UC1);
+  depth.create(height, width, CV_32FC1);
+  const Eigen::Matrix3d R = Twc.so3().matrix();
+  const Eigen::Vector3d c = Twc.translation();
+  for (int vv = 0; vv < height; ++vv) {
+    for (int uu = 0; uu < width; ++uu) {
+      const Eigen::Vector3d ray = R * Eigen::Vector3d((uu-K(0,2))/K(0,0),
+                                                      (vv-K(1,2))/K(1,1), 1.0);
+      const double t = (2.0 - c.z() + 0.2*c.x()) / (ray.z() - 0.2*ray.x());
+      const Eigen::Vector3d P = c + t*ray;
+      const double I = TestTexture(P.x(), P.y());
+      grey.at<unsigned char>(vv, uu) =
+          static_cast<unsigned char>(std::max(1.0, std::min(254.0, I)));
+      depth.at<float>(vv, uu) = (uu % 97 == 3 && vv % 53 == 7) ?
+            std::numeric_limits<float>::quiet_NaN() :
+            static_cast<float>((R.transpose()*(P-c)).z());
+    }
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Frames along a smooth trajectory with about 1 cm and 0.5 degrees of
+/// motion between them, 30 frames per second.
+inline TestSequence RenderTestSequence(
+    int                       width,      //< Input: Image width.
+    int                       height,     //< Input: Image height.
+    int                       num_frames  //< Input: Frames, at least one.
+  )
+{
+  TestSequence sequence;
+  const double scale = width / 640.0;
+  sequence.K << 525*scale, 0, (width-1)/2.0,
+                0, 525*scale, (height-1)/2.0,
+                0, 0, 1;
+  sequence.motion << 0.01, -0.005, 0.01, 0.004, -0.006, 0.002;
+  sequence.frame_interval = 1.0 / 30;
+  sequence.Twc.resize(num_frames);
+  sequence.grey.resize(num_frames);
+  sequence.depth.resize(num_frames);
+  for (int ii = 0; ii < num_frames; ++ii) {
+    sequence.Twc[ii] = Sophus::SE3d::exp(ii * sequence.motion);
+    RenderTestFrame(sequence.K, sequence.Twc[ii], width, height,
+                    sequence.grey[ii], sequence.depth[ii]);
+  }
+  return sequence;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// IMU samples along the trajectory of the sequence, from its first frame to
+/// its last. The IMU is rigidly attached to the camera, and its pose at the
+/// first frame is the world frame. Follows the convention of BA: the world
+/// acceleration is R accel - gravity.
+inline std::vector<TestImuSample> RenderTestImu(
+    const TestSequence&       sequence,   //< Input: Frames.
+    const Sophus::SE3d&       Tic,        //< Input: Camera wrt IMU.
+    const Eigen::Vector3d&    gravity,    //< Input: Gravity in world frame.
+    double                    rate        //< Input: Samples per second.
+  )
+{
+  // Constant twist, so constant body rates: R^T dR/dt = [w]x and
+  // R^T dp/dt = v.
+  const Eigen::Matrix<double, 6, 1> twist =
+      Tic.Adj() * sequence.motion / sequence.frame_interval;
+  const Eigen::Vector3d v = twist.head<3>();
+  const Eigen::Vector3d w = twist.tail<3>();
+
+  const double duration = (sequence.Twc.size()-1) * sequence.frame_interval;
+  const int num_samples = static_cast<int>(std::floor(duration * rate)) + 1;
+  std::vector<TestImuSample> samples(num_samples);
+  for (int ii = 0; ii < num_samples; ++ii) {
+    TestImuSample& sample = samples[ii];
+    sample.time  = ii / rate;
+    const Sophus::SO3d Rwi = Sophus::SE3d::exp(sample.time * twist).so3();
+    sample.gyro  = w;
+    sample.accel = w.cross(v) + Rwi.inverse() * gravity;
+  }
+  return samples;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Rig of one pinhole camera at the origin.
+inline std::shared_ptr<calibu::Rig<double> > TestRig(
+    const TestSequence&       sequence    //< Input: Intrinsics and size.
+  )
+{
+  Eigen::VectorXd params(4);
+  params << sequence.K(0,0), sequence.K(1,1), sequence.K(0,2), sequence.K(1,2);
+  std::shared_ptr<calibu::CameraInterface<double> > camera(
+        new calibu::LinearCamera<double>(
+          params, Eigen::Vector2i(sequence.grey[0].cols,
+                                  sequence.grey[0].rows)));
+  camera->SetPose(Sophus::SE3d());
+  std::shared_ptr<calibu::Rig<double> > rig(new calibu::Rig<double>);
+  rig->AddCamera(camera);
+  return rig;
+}